@@ -42,7 +42,7 @@
 #include "sysemu/replay.h"
 #include "sysemu/tcg.h"
 #include "exec/helper-proto.h"
-#include "tb-hash.h"
+#include "tb-jmp-cache.h"
 #include "tb-context.h"
 #include "internal.h"
 
@@ -207,6 +207,10 @@ static bool tb_lookup_cmp(const void *p, const void *d)
              * is different for the new TB.  Therefore any exception raised
              * here by the faulting lookup is not premature.
              */
+            if (desc->env == NULL) {
+                /* Without a vCPU the second page cannot be checked. */
+                return true;
+            }
             virt_page2 = TARGET_PAGE_ALIGN(desc->pc);
             phys_page2 = get_page_addr_code(desc->env, virt_page2);
             if (tb->page_addr[1] == phys_page2) {
@@ -240,33 +244,70 @@ static TranslationBlock *tb_htable_lookup(CPUState *cpu, target_ulong pc,
     return qht_lookup_custom(&tb_ctx.htable, &desc, h, tb_lookup_cmp);
 }
 
+/*
+ * Look up a TB by the ram address @phys_pc of its code, without going
+ * through the TLB of a vCPU.  A TB that spans two pages is returned
+ * without checking its second page.
+ */
+TranslationBlock *tb_htable_lookup_phys(tb_page_addr_t phys_pc,
+                                        target_ulong pc, target_ulong cs_base,
+                                        uint32_t flags, uint32_t cflags,
+                                        uint32_t trace_vcpu_dstate)
+{
+    struct tb_desc desc;
+    uint32_t h;
+
+    desc.env = NULL;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+    desc.cflags = cflags;
+    desc.trace_vcpu_dstate = trace_vcpu_dstate;
+    desc.pc = pc;
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    h = tb_hash_func(phys_pc, pc, flags, cflags, trace_vcpu_dstate);
+    return qht_lookup_custom(&tb_ctx.htable, &desc, h, tb_lookup_cmp);
+}
+
 /* Might cause an exception, so have a longjmp destination ready */
 static inline TranslationBlock *tb_lookup(CPUState *cpu, target_ulong pc,
                                           target_ulong cs_base,
                                           uint32_t flags, uint32_t cflags)
 {
     TranslationBlock *tb;
-    uint32_t hash;
+    TranslationBlock **set;
+    int way;
 
     /* we should never be trying to look up an INVALID tb */
     tcg_debug_assert(!(cflags & CF_INVALID));
 
-    hash = tb_jmp_cache_hash_func(pc);
-    tb = qatomic_rcu_read(&cpu->tb_jmp_cache[hash]);
-
-    if (likely(tb &&
-               tb->pc == pc &&
-               tb->cs_base == cs_base &&
-               tb->flags == flags &&
-               tb->trace_vcpu_dstate == *cpu->trace_dstate &&
-               tb_cflags(tb) == cflags)) {
-        return tb;
+    set = tb_jmp_cache_set(cpu, pc);
+    cpu->tb_jmp_cache_stats.lookups++;
+
+    for (way = 0; way < TB_JMP_CACHE_WAYS; way++) {
+        tb = qatomic_rcu_read(&set[way]);
+        if (likely(tb &&
+                   tb->pc == pc &&
+                   tb->cs_base == cs_base &&
+                   tb->flags == flags &&
+                   tb->trace_vcpu_dstate == *cpu->trace_dstate &&
+                   tb_cflags(tb) == cflags)) {
+            /* Generated code only probes the first way */
+            if (way) {
+                tb_jmp_cache_move_to_front(set, way, tb);
+            }
+            return tb;
+        }
     }
     tb = tb_htable_lookup(cpu, pc, cs_base, flags, cflags);
     if (tb == NULL) {
         return NULL;
     }
-    qatomic_set(&cpu->tb_jmp_cache[hash], tb);
+    /* First use of a speculatively translated TB */
+    if (unlikely(qatomic_read(&tb->spec)) && qatomic_xchg(&tb->spec, 0)) {
+        qatomic_inc(&tb_ctx.tb_spec_used);
+    }
+    tb_jmp_cache_miss(cpu);
+    tb_jmp_cache_insert(cpu, tb);
     return tb;
 }
 
@@ -457,6 +498,16 @@ cpu_tb_exec(CPUState *cpu, TranslationBlock *itb, int *tb_exit)
             assert(cc->set_pc);
             cc->set_pc(cpu, last_tb->pc);
         }
+
+        /*
+         * The exit may also have been taken because the execution count
+         * of the TB ran out.  We are at its start, so it can be replaced.
+         */
+        if (unlikely(tb_counts_execs(last_tb) &&
+                     qatomic_read(&last_tb->exec_count) == 0 &&
+                     !(tb_cflags(last_tb) & CF_INVALID))) {
+            tb_promote(cpu, last_tb);
+        }
     }
 
     /*
@@ -491,44 +542,197 @@ static void cpu_exec_exit(CPUState *cpu)
     }
 }
 
-void cpu_exec_step_atomic(CPUState *cpu)
+/* Look up or translate the TB that runs one instruction serially. */
+static TranslationBlock *cpu_exec_step_tb(CPUState *cpu)
 {
     CPUArchState *env = cpu->env_ptr;
     TranslationBlock *tb;
     target_ulong cs_base, pc;
     uint32_t flags, cflags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+
+    cflags = curr_cflags(cpu);
+    /* Execute in a serial context. */
+    cflags &= ~CF_PARALLEL;
+    /* After 1 insn, return and release the exclusive lock. */
+    cflags |= CF_NO_GOTO_TB | CF_NO_GOTO_PTR | 1;
+    /*
+     * No need to check_for_breakpoints here.
+     * We only arrive in cpu_exec_step_atomic after beginning execution
+     * of an insn that includes an atomic operation we can't handle.
+     * Any breakpoint for this insn will have been recognized earlier.
+     */
+
+    tb = tb_lookup(cpu, pc, cs_base, flags, cflags);
+    if (tb == NULL) {
+        mmap_lock();
+        tb = tb_gen_code(cpu, pc, cs_base, flags, cflags);
+        mmap_unlock();
+    }
+    trace_exec_tb(tb, pc);
+    return tb;
+}
+
+/*
+ * Host hardware transactional memory.
+ *
+ * An atomic operation that the host cannot perform natively is normally
+ * emulated by stopping all other vCPUs while the one instruction runs.
+ * With Intel RTM the instruction can instead run in a transaction: any
+ * access of another thread to the cache lines it touches aborts it, so
+ * that it only serializes against those accesses, and anything else the
+ * transaction cannot contain (system calls, faults, I/O that blocks)
+ * aborts it as well, in which case we fall back to the exclusive section.
+ */
+#if defined(CONFIG_CPUID_H) && (defined(__x86_64__) || defined(__i386__))
+#include "qemu/cpuid.h"
+
+#define HTM_STARTED         (~0u)
+#define HTM_ABORT_RETRY     (1 << 1)
+/* Number of transactions to try before taking the exclusive section */
+#define HTM_RETRIES         4
+
+static bool htm_available;
+
+static void __attribute__((constructor)) htm_init(void)
+{
+    unsigned a, b, c, d;
+
+    if (__get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, a, b, c, d);
+        htm_available = (b & bit_RTM) && !(d & bit_RTM_ALWAYS_ABORT);
+    }
+}
+
+static inline unsigned htm_begin(void)
+{
+    unsigned ret = HTM_STARTED;
+
+    asm volatile("xbegin 1f\n1:" : "+a"(ret) : : "memory");
+    return ret;
+}
+
+static inline void htm_end(void)
+{
+    asm volatile("xend" : : : "memory");
+}
+
+/* Roll back to htm_begin(), or do nothing outside of a transaction. */
+static inline void htm_abort(void)
+{
+    asm volatile("xabort $0xff" : : : "memory");
+}
+
+static inline bool htm_test(void)
+{
+    bool ret;
+
+    asm volatile("xtest; setnz %0" : "=q"(ret) : : "memory");
+    return ret;
+}
+
+/*
+ * Run the instruction in a transaction.  Return false if it has to be
+ * run in the exclusive section instead.
+ */
+static bool cpu_exec_step_htm(CPUState *cpu)
+{
+    TranslationBlock *tb;
+    unsigned status;
+    int tb_exit, i;
+
+    /* Like cpu_exec, keep tb_flush away while the TB is in use. */
+    cpu_exec_start(cpu);
+#ifdef CONFIG_SOFTMMU
+    /* Flushes posted while we were not running did not wait for us. */
+    tlb_shootdown_poll(cpu);
+#endif
+    if (sigsetjmp(cpu->jmp_env, 0) != 0) {
+        /*
+         * An exception raised by the instruction is left to the
+         * exclusive section, as the state built up for it in the
+         * transaction must not be committed.  One raised while
+         * looking up the TB goes to the cpu loop as usual.
+         */
+        if (htm_test()) {
+            htm_abort();
+        }
+#ifndef CONFIG_SOFTMMU
+        clear_helper_retaddr();
+        if (have_mmap_lock()) {
+            mmap_unlock();
+        }
+#endif
+        if (qemu_mutex_iothread_locked()) {
+            qemu_mutex_unlock_iothread();
+        }
+        assert_no_pages_locked();
+        cpu_exec_end(cpu);
+        return true;
+    }
+
+    tb = cpu_exec_step_tb(cpu);
+    for (i = 0; i < HTM_RETRIES; i++) {
+        status = htm_begin();
+        if (status == HTM_STARTED) {
+            cpu_exec_enter(cpu);
+            cpu_tb_exec(cpu, tb, &tb_exit);
+            cpu_exec_exit(cpu);
+            htm_end();
+            cpu_exec_end(cpu);
+            qatomic_inc(&tb_ctx.htm_steps);
+            return true;
+        }
+        if (!(status & HTM_ABORT_RETRY)) {
+            break;
+        }
+    }
+    cpu_exec_end(cpu);
+    qatomic_inc(&tb_ctx.htm_aborts);
+    return false;
+}
+#else
+#define htm_available false
+
+static bool cpu_exec_step_htm(CPUState *cpu)
+{
+    g_assert_not_reached();
+}
+#endif
+
+void cpu_exec_step_atomic(CPUState *cpu)
+{
+    TranslationBlock *tb;
     int tb_exit;
 
+    /*
+     * Other vCPUs only run concurrently in a parallel context, in which
+     * case try a transaction first.
+     */
+    if (htm_available && (curr_cflags(cpu) & CF_PARALLEL) &&
+        cpu_exec_step_htm(cpu)) {
+        return;
+    }
+
     if (sigsetjmp(cpu->jmp_env, 0) == 0) {
         start_exclusive();
+#ifdef CONFIG_SOFTMMU
+        /*
+         * Flushes posted while we were not running did not wait for
+         * us, so apply them before running guest code.
+         */
+        tlb_shootdown_poll(cpu);
+#endif
+        qatomic_inc(&tb_ctx.exclusive_steps);
         g_assert(cpu == current_cpu);
         g_assert(!cpu->running);
         cpu->running = true;
 
-        cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-
-        cflags = curr_cflags(cpu);
-        /* Execute in a serial context. */
-        cflags &= ~CF_PARALLEL;
-        /* After 1 insn, return and release the exclusive lock. */
-        cflags |= CF_NO_GOTO_TB | CF_NO_GOTO_PTR | 1;
-        /*
-         * No need to check_for_breakpoints here.
-         * We only arrive in cpu_exec_step_atomic after beginning execution
-         * of an insn that includes an atomic operation we can't handle.
-         * Any breakpoint for this insn will have been recognized earlier.
-         */
-
-        tb = tb_lookup(cpu, pc, cs_base, flags, cflags);
-        if (tb == NULL) {
-            mmap_lock();
-            tb = tb_gen_code(cpu, pc, cs_base, flags, cflags);
-            mmap_unlock();
-        }
+        tb = cpu_exec_step_tb(cpu);
 
         cpu_exec_enter(cpu);
         /* execute the generated code */
-        trace_exec_tb(tb, pc);
         cpu_tb_exec(cpu, tb, &tb_exit);
         cpu_exec_exit(cpu);
     } else {
@@ -746,6 +950,10 @@ static inline bool cpu_handle_interrupt(CPUState *cpu,
      */
     qatomic_mb_set(&cpu_neg(cpu)->icount_decr.u16.high, 0);
 
+#ifdef CONFIG_SOFTMMU
+    tlb_shootdown_poll(cpu);
+#endif
+
     if (unlikely(qatomic_read(&cpu->interrupt_request))) {
         int interrupt_request;
         qemu_mutex_lock_iothread();
@@ -870,9 +1078,15 @@ static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
          */
         return;
     }
+    if (!icount_enabled()) {
+        /*
+         * The TB left at its start for a reason of its own: it became
+         * hot, or its code changed.  cpu_tb_exec() has dealt with it.
+         */
+        return;
+    }
 
     /* Instruction counter expired.  */
-    assert(icount_enabled());
 #ifndef CONFIG_USER_ONLY
     /* Ensure global icount has gone forward */
     icount_update(cpu);
@@ -894,6 +1108,40 @@ static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
 #endif
 }
 
+/*
+ * Count the iterations of a spin loop, which come back here as the TB is
+ * never chained to itself, and give up the host CPU once there were
+ * tb_spin_threshold of them in a row: under MTTCG the vCPU that is
+ * expected to store to what the loop polls may be waiting for it, and
+ * with round-robin TCG that vCPU cannot run before this one yields.
+ * Return true to leave the execution loop.
+ */
+static inline bool cpu_loop_spin(CPUState *cpu, TranslationBlock *tb,
+                                 TranslationBlock **last_tb)
+{
+    if (likely(!tb->spin_loop) || *last_tb != tb) {
+        cpu->spin_iters = 0;
+        return false;
+    }
+
+    *last_tb = NULL;
+    if (++cpu->spin_iters < tb_spin_threshold) {
+        return false;
+    }
+    cpu->spin_iters = 0;
+    qatomic_inc(&tb_ctx.spin_yields);
+    if (cpu->tcg_cflags & CF_PARALLEL) {
+        g_thread_yield();
+        return false;
+    }
+#ifndef CONFIG_USER_ONLY
+    cpu->exception_index = EXCP_YIELD;
+    return true;
+#else
+    return false;
+#endif
+}
+
 /* main execution loop */
 
 int cpu_exec(CPUState *cpu)
@@ -911,6 +1159,10 @@ int cpu_exec(CPUState *cpu)
     rcu_read_lock();
 
     cpu_exec_enter(cpu);
+#ifdef CONFIG_SOFTMMU
+    /* Flushes posted while we were not running must be applied now. */
+    tlb_shootdown_poll(cpu);
+#endif
 
     /* Calculate difference between guest clock and host clock.
      * This delay includes the delay of the last cycle, so
@@ -994,7 +1246,11 @@ int cpu_exec(CPUState *cpu)
                  * We add the TB in the virtual pc hash table
                  * for the fast lookup
                  */
-                qatomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
+                tb_jmp_cache_insert(cpu, tb);
+            }
+
+            if (cpu_loop_spin(cpu, tb, &last_tb)) {
+                break;
             }
 
 #ifndef CONFIG_USER_ONLY
@@ -1008,8 +1264,14 @@ int cpu_exec(CPUState *cpu)
                 last_tb = NULL;
             }
 #endif
-            /* See if we can patch the calling TB. */
-            if (last_tb) {
+            /*
+             * See if we can patch the calling TB.  One-shot TBs are not
+             * tracked in the region trees, so region eviction would
+             * neither unlink the jumps out of them nor reset the jumps
+             * into them: never chain from or to those.
+             */
+            if (last_tb && last_tb->page_addr[0] != -1 &&
+                tb->page_addr[0] != -1) {
                 tb_add_jump(last_tb, tb_exit, tb);
             }
 
@@ -1037,6 +1299,7 @@ void tcg_exec_realizefn(CPUState *cpu, Error **errp)
         tcg_target_initialized = true;
     }
     tlb_init(cpu);
+    tb_jmp_cache_init(cpu);
     qemu_plugin_vcpu_init_hook(cpu);
 
 #ifndef CONFIG_USER_ONLY
@@ -1052,6 +1315,7 @@ void tcg_exec_unrealizefn(CPUState *cpu)
 #endif /* !CONFIG_USER_ONLY */
 
     qemu_plugin_vcpu_exit_hook(cpu);
+    tb_jmp_cache_free(cpu);
     tlb_destroy(cpu);
 }
 
@@ -19,6 +19,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/main-loop.h"
+#include "qemu/processor.h"
 #include "hw/core/tcg-cpu-ops.h"
 #include "exec/exec-all.h"
 #include "exec/memory.h"
@@ -100,10 +101,11 @@ static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns,
 
 static void tb_jmp_cache_clear_page(CPUState *cpu, target_ulong page_addr)
 {
-    unsigned int i, i0 = tb_jmp_cache_hash_page(page_addr);
+    unsigned int g = (tb_jmp_cache_hash_page(page_addr) &
+                      cpu->tb_jmp_cache_mask) >> TB_JMP_PAGE_BITS;
 
-    for (i = 0; i < TB_JMP_PAGE_SIZE; i++) {
-        qatomic_set(&cpu->tb_jmp_cache[i0 + i], NULL);
+    if (test_bit(g, cpu->tb_jmp_cache_used)) {
+        cpu_tb_jmp_cache_clear_group(cpu, g);
     }
 }
 
@@ -113,6 +115,8 @@ static void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
        overlap the flushed page.  */
     tb_jmp_cache_clear_page(cpu, addr - TARGET_PAGE_SIZE);
     tb_jmp_cache_clear_page(cpu, addr);
+    /* The return stack is not indexed by page; it is small, drop it all. */
+    cpu_tb_ras_clear(cpu);
 }
 
 /**
@@ -232,12 +236,19 @@ static void tlb_mmu_resize_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast,
 
 static void tlb_mmu_flush_locked(CPUTLBDesc *desc, CPUTLBDescFast *fast)
 {
+    int k;
+
     desc->n_used_entries = 0;
     desc->large_page_addr = -1;
     desc->large_page_mask = -1;
     desc->vindex = 0;
     memset(fast->table, -1, sizeof_tlb(fast));
     memset(desc->vtable, -1, sizeof(desc->vtable));
+    desc->lpindex = 0;
+    for (k = 0; k < CPU_LPTLB_SIZE; k++) {
+        desc->lptlb[k].addr = -1;
+        desc->lptlb[k].mask = 0;
+    }
 }
 
 static void tlb_flush_one_mmuidx_locked(CPUArchState *env, int mmu_idx,
@@ -250,6 +261,369 @@ static void tlb_flush_one_mmuidx_locked(CPUArchState *env, int mmu_idx,
     tlb_mmu_flush_locked(desc, fast);
 }
 
+/*
+ * Tagged TLB sets.
+ *
+ * A target that tags its address spaces, like the Arm ASID, can switch
+ * between them with tlb_switch_tag_by_mmuidx instead of flushing.  The
+ * entries of the address space being left are moved aside into one of
+ * tlb_tag_sets per MMU mode, and those of the address space being
+ * entered come back if they are still there.  Entries are not tagged
+ * individually, so the TCG fast path is unchanged: only the current set
+ * is ever looked up.  Sets that are aside still see page, range and
+ * dirty tracking flushes; full flushes drop them.
+ */
+uint32_t tlb_tag_sets;
+
+bool tlb_tags_enabled(void)
+{
+    return tlb_tag_sets != 0;
+}
+
+#define TLB_SWAP(a, b) \
+    do { typeof(a) tmp_ = (a); (a) = (b); (b) = tmp_; } while (0)
+
+static void tlb_tag_set_swap(CPUTLBDesc *desc, CPUTLBDescFast *fast,
+                             CPUTLBTagSet *set)
+{
+    CPUTLBEntry vtable[CPU_VTLB_SIZE];
+    CPUIOTLBEntry viotlb[CPU_VTLB_SIZE];
+    CPULPTLBEntry lptlb[CPU_LPTLB_SIZE];
+
+    TLB_SWAP(desc->large_page_addr, set->large_page_addr);
+    TLB_SWAP(desc->large_page_mask, set->large_page_mask);
+    TLB_SWAP(desc->n_used_entries, set->n_used_entries);
+    TLB_SWAP(desc->vindex, set->vindex);
+    TLB_SWAP(desc->iotlb, set->iotlb);
+    TLB_SWAP(fast->mask, set->mask);
+    TLB_SWAP(fast->table, set->table);
+
+    memcpy(vtable, desc->vtable, sizeof(vtable));
+    memcpy(desc->vtable, set->vtable, sizeof(vtable));
+    memcpy(set->vtable, vtable, sizeof(vtable));
+    memcpy(viotlb, desc->viotlb, sizeof(viotlb));
+    memcpy(desc->viotlb, set->viotlb, sizeof(viotlb));
+    memcpy(set->viotlb, viotlb, sizeof(viotlb));
+    TLB_SWAP(desc->lpindex, set->lpindex);
+    memcpy(lptlb, desc->lptlb, sizeof(lptlb));
+    memcpy(desc->lptlb, set->lptlb, sizeof(lptlb));
+    memcpy(set->lptlb, lptlb, sizeof(lptlb));
+}
+
+static void tlb_tag_sets_drop_locked(CPUTLBDesc *desc)
+{
+    uint32_t i;
+
+    if (desc->tag_sets) {
+        for (i = 0; i < tlb_tag_sets; i++) {
+            desc->tag_sets[i].valid = false;
+        }
+    }
+}
+
+/*
+ * Set the entries of @mmu_idx aside under @old_tag and bring back those
+ * of @new_tag.  Returns true if entries for @new_tag were still present.
+ */
+static bool tlb_switch_tag_locked(CPUArchState *env, int mmu_idx,
+                                  uint32_t old_tag, uint32_t new_tag)
+{
+    CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+    CPUTLBDescFast *fast = &env_tlb(env)->f[mmu_idx];
+    CPUTLBTagSet *set, *victim = NULL;
+    bool restored = false;
+    uint32_t i;
+
+    if (desc->tag_sets == NULL) {
+        desc->tag_sets = g_new0(CPUTLBTagSet, tlb_tag_sets);
+    }
+    desc->tag_clock++;
+
+    for (i = 0; i < tlb_tag_sets; i++) {
+        set = &desc->tag_sets[i];
+        if (set->valid && set->tag == new_tag) {
+            victim = set;
+            restored = true;
+            break;
+        }
+        if (victim == NULL || !set->valid ||
+            (victim->valid && set->stamp < victim->stamp)) {
+            victim = set;
+        }
+    }
+
+    if (restored) {
+        tlb_tag_set_swap(desc, fast, victim);
+        victim->tag = old_tag;
+        victim->stamp = desc->tag_clock;
+        victim->valid = victim->n_used_entries != 0;
+    } else if (desc->n_used_entries != 0) {
+        /* Reuse the tables of the least recently used set, if any. */
+        if (victim->table == NULL) {
+            size_t n_entries = 1 << CPU_TLB_DYN_DEFAULT_BITS;
+
+            victim->mask = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
+            victim->table = g_new(CPUTLBEntry, n_entries);
+            victim->iotlb = g_new(CPUIOTLBEntry, n_entries);
+        }
+        tlb_tag_set_swap(desc, fast, victim);
+        victim->tag = old_tag;
+        victim->stamp = desc->tag_clock;
+        victim->valid = true;
+        tlb_mmu_flush_locked(desc, fast);
+    }
+
+    desc->tag = new_tag;
+    desc->has_tag = true;
+    return restored;
+}
+
+/*
+ * Shared second-level TLB.
+ *
+ * With "-accel tcg,tlb-shared=on", the translations that tlb_fill gets
+ * from the target for a tagged MMU mode (see tlb_switch_tag_by_mmuidx)
+ * are also entered in a table shared by all vCPUs, keyed on the tag,
+ * the base of the translation table (see TCGCPUOps.tlb_root), the page
+ * and the mmu_idx.  A vCPU that misses in its own TLB looks there before
+ * asking the target to walk the page tables, so threads of one guest
+ * process running on several vCPUs only walk each page once.  The table
+ * base keeps vCPUs that use one tag for different page tables apart.
+ *
+ * Entries are written and read without a lock.  Each one has a sequence
+ * count that is odd while the entry is being written; a reader that sees
+ * it change treats the lookup as a miss, and a writer that finds it odd
+ * leaves the entry alone.
+ *
+ * Rather than finding the entries a flush concerns, flushes bump a
+ * generation: a full or tag flush that of the mmu_idx, and a page flush
+ * that of the page's bucket within the mmu_idx.  Since a page flush
+ * anywhere in a large page drops all of it, it also bumps a generation
+ * that all large page entries of the mmu_idx share.  Entries carry the
+ * generations read before the walk that produced them and are only
+ * valid while both are current.  Any flush on any vCPU counts, since
+ * the entries of one vCPU are used by all the others.
+ */
+#define TLB_SHARED_BITS         14
+#define TLB_SHARED_SIZE         (1 << TLB_SHARED_BITS)
+#define TLB_SHARED_PAGE_GENS    256
+
+typedef struct TLBSharedEntry {
+    uint32_t seq;
+    uint32_t tag;
+    uint32_t gen;
+    uint32_t page_gen;
+    uint64_t root;
+    target_ulong vaddr;
+    target_ulong size;
+    hwaddr paddr;
+    MemTxAttrs attrs;
+    int prot;
+    int mmu_idx;
+} TLBSharedEntry;
+
+bool tlb_shared_enabled;
+
+static struct {
+    TLBSharedEntry *table;
+    uint32_t gen[NB_MMU_MODES];
+    uint32_t large_gen[NB_MMU_MODES];
+    uint32_t page_gen[NB_MMU_MODES][TLB_SHARED_PAGE_GENS];
+} tlb_shared;
+
+/*
+ * The tlb_fill in progress on this thread, whose result may be shared.
+ * @pending is only set while the target's tlb_fill runs.
+ */
+static __thread struct {
+    bool pending;
+    int mmu_idx;
+    uint64_t root;
+    target_ulong page;
+    uint32_t gen;
+    uint32_t large_gen;
+    uint32_t page_gen;
+} tlb_shared_fill;
+
+void tlb_shared_init(void)
+{
+    tlb_shared.table = g_new0(TLBSharedEntry, TLB_SHARED_SIZE);
+    tlb_shared_enabled = true;
+}
+
+static inline uint32_t *tlb_shared_page_gen(int mmu_idx, target_ulong page)
+{
+    return &tlb_shared.page_gen[mmu_idx]
+        [(page >> TARGET_PAGE_BITS) & (TLB_SHARED_PAGE_GENS - 1)];
+}
+
+static TLBSharedEntry *tlb_shared_entry(uint32_t tag, uint64_t root,
+                                        target_ulong page, int mmu_idx)
+{
+    uint32_t h = qemu_xxhash6(page, root, tag, mmu_idx);
+
+    return &tlb_shared.table[h & (TLB_SHARED_SIZE - 1)];
+}
+
+static void tlb_shared_flush(uint16_t idxmap)
+{
+    int mmu_idx;
+
+    if (tlb_shared_enabled) {
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            if ((idxmap >> mmu_idx) & 1) {
+                qatomic_inc(&tlb_shared.gen[mmu_idx]);
+            }
+        }
+    }
+}
+
+static void tlb_shared_flush_range(uint16_t idxmap, target_ulong addr,
+                                   target_ulong len)
+{
+    target_ulong i;
+    int mmu_idx;
+
+    if (!tlb_shared_enabled) {
+        return;
+    }
+    if (len > (target_ulong)TLB_SHARED_PAGE_GENS * TARGET_PAGE_SIZE) {
+        tlb_shared_flush(idxmap);
+        return;
+    }
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if ((idxmap >> mmu_idx) & 1) {
+            qatomic_inc(&tlb_shared.large_gen[mmu_idx]);
+            for (i = 0; i < len; i += TARGET_PAGE_SIZE) {
+                qatomic_inc(tlb_shared_page_gen(mmu_idx, addr + i));
+            }
+        }
+    }
+}
+
+/*
+ * Look up the page of @addr in the shared TLB, and enter it in the TLB
+ * of @cpu if it is there and allows @prot_needed.  Otherwise return
+ * false, with @share set if the result of the coming tlb_fill can be
+ * shared.
+ */
+static bool tlb_shared_fill_page(CPUState *cpu, target_ulong addr,
+                                 int prot_needed, int mmu_idx, bool *share)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+    target_ulong page = addr & TARGET_PAGE_MASK;
+    TLBSharedEntry *e, copy;
+    uint32_t seq, gen, large_gen, page_gen;
+    uint64_t root;
+
+    *share = false;
+    if (!tlb_shared_enabled || !desc->has_tag || !cc->tcg_ops->tlb_root ||
+        !cc->tcg_ops->tlb_root(cpu, mmu_idx, addr, &root)) {
+        return false;
+    }
+
+    gen = qatomic_load_acquire(&tlb_shared.gen[mmu_idx]);
+    large_gen = qatomic_load_acquire(&tlb_shared.large_gen[mmu_idx]);
+    page_gen = qatomic_load_acquire(tlb_shared_page_gen(mmu_idx, page));
+    e = tlb_shared_entry(desc->tag, root, page, mmu_idx);
+
+    seq = qatomic_load_acquire(&e->seq);
+    if (!(seq & 1)) {
+        copy = *e;
+        smp_rmb();
+        if (qatomic_read(&e->seq) == seq &&
+            copy.tag == desc->tag && copy.root == root &&
+            copy.vaddr == page &&
+            copy.mmu_idx == mmu_idx && copy.gen == gen &&
+            copy.page_gen == (copy.size > TARGET_PAGE_SIZE ?
+                              large_gen : page_gen) &&
+            (copy.prot & prot_needed)) {
+            tlb_set_page_with_attrs(cpu, page, copy.paddr, copy.attrs,
+                                    copy.prot, mmu_idx, copy.size);
+            qatomic_set(&env_tlb(env)->c.shared_hit_count,
+                        env_tlb(env)->c.shared_hit_count + 1);
+            return true;
+        }
+    }
+
+    qatomic_set(&env_tlb(env)->c.shared_miss_count,
+                env_tlb(env)->c.shared_miss_count + 1);
+    *share = true;
+    tlb_shared_fill.mmu_idx = mmu_idx;
+    tlb_shared_fill.root = root;
+    tlb_shared_fill.page = page;
+    tlb_shared_fill.gen = gen;
+    tlb_shared_fill.large_gen = large_gen;
+    tlb_shared_fill.page_gen = page_gen;
+    return false;
+}
+
+/* Share the page that the target has just entered for the pending fill. */
+static void tlb_shared_insert(CPUArchState *env, target_ulong vaddr,
+                              hwaddr paddr, MemTxAttrs attrs, int prot,
+                              int mmu_idx, target_ulong size)
+{
+    CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+    target_ulong page = vaddr & TARGET_PAGE_MASK;
+    TLBSharedEntry *e;
+    uint32_t seq;
+
+    if (mmu_idx != tlb_shared_fill.mmu_idx ||
+        page != tlb_shared_fill.page) {
+        return;
+    }
+    tlb_shared_fill.pending = false;
+
+    /* A translation for part of the page does not hold for all of it. */
+    if (size < TARGET_PAGE_SIZE || !desc->has_tag) {
+        return;
+    }
+
+    e = tlb_shared_entry(desc->tag, tlb_shared_fill.root, page, mmu_idx);
+    seq = qatomic_read(&e->seq);
+    if ((seq & 1) || qatomic_cmpxchg(&e->seq, seq, seq + 1) != seq) {
+        /* Someone else is writing the entry. */
+        return;
+    }
+    smp_wmb();
+    e->tag = desc->tag;
+    e->root = tlb_shared_fill.root;
+    e->gen = tlb_shared_fill.gen;
+    e->page_gen = size > TARGET_PAGE_SIZE ? tlb_shared_fill.large_gen
+                                          : tlb_shared_fill.page_gen;
+    e->vaddr = page;
+    e->size = size;
+    e->paddr = paddr & TARGET_PAGE_MASK;
+    e->attrs = attrs;
+    e->prot = prot;
+    e->mmu_idx = mmu_idx;
+    qatomic_store_release(&e->seq, seq + 2);
+}
+
+void tlb_shared_dump_info(GString *buf)
+{
+    CPUState *cpu;
+    size_t hits, misses;
+
+    if (!tlb_shared_enabled) {
+        return;
+    }
+
+    g_string_append_printf(buf, "\nShared TLB:\n");
+    CPU_FOREACH(cpu) {
+        CPUArchState *env = cpu->env_ptr;
+
+        hits = qatomic_read(&env_tlb(env)->c.shared_hit_count);
+        misses = qatomic_read(&env_tlb(env)->c.shared_miss_count);
+        g_string_append_printf(buf, "CPU#%-3d %12zu hits %12zu misses "
+                               "(%0.1f%% hit)\n", cpu->cpu_index,
+                               hits, misses, hits + misses ?
+                               (double)hits * 100 / (hits + misses) : 0);
+    }
+}
+
 static void tlb_mmu_init(CPUTLBDesc *desc, CPUTLBDescFast *fast, int64_t now)
 {
     size_t n_entries = 1 << CPU_TLB_DYN_DEFAULT_BITS;
@@ -291,6 +665,7 @@ void tlb_init(CPUState *cpu)
 void tlb_destroy(CPUState *cpu)
 {
     CPUArchState *env = cpu->env_ptr;
+    uint32_t j;
     int i;
 
     qemu_spin_destroy(&env_tlb(env)->c.lock);
@@ -300,6 +675,13 @@ void tlb_destroy(CPUState *cpu)
 
         g_free(fast->table);
         g_free(desc->iotlb);
+        if (desc->tag_sets) {
+            for (j = 0; j < tlb_tag_sets; j++) {
+                g_free(desc->tag_sets[j].table);
+                g_free(desc->tag_sets[j].iotlb);
+            }
+            g_free(desc->tag_sets);
+        }
     }
 }
 
@@ -322,6 +704,9 @@ static void flush_all_helper(CPUState *src, run_on_cpu_func fn,
     }
 }
 
+static void tlb_shootdown_all_cpus(CPUState *src, uint16_t full,
+                                   const TLBFlushRangeData *d);
+
 void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
 {
     CPUState *cpu;
@@ -339,6 +724,60 @@ void tlb_flush_counts(size_t *pfull, size_t *ppart, size_t *pelide)
     *pelide = elide;
 }
 
+void tlb_tag_counts(size_t *pswitches, size_t *prestores)
+{
+    CPUState *cpu;
+    size_t switches = 0, restores = 0;
+
+    CPU_FOREACH(cpu) {
+        CPUArchState *env = cpu->env_ptr;
+
+        switches += qatomic_read(&env_tlb(env)->c.tag_switch_count);
+        restores += qatomic_read(&env_tlb(env)->c.tag_restore_count);
+    }
+    *pswitches = switches;
+    *prestores = restores;
+}
+
+void tlb_lptlb_counts(size_t *pfills, size_t *pflushes)
+{
+    CPUState *cpu;
+    size_t fills = 0, flushes = 0;
+
+    CPU_FOREACH(cpu) {
+        CPUArchState *env = cpu->env_ptr;
+
+        fills += qatomic_read(&env_tlb(env)->c.lptlb_fill_count);
+        flushes += qatomic_read(&env_tlb(env)->c.lptlb_flush_count);
+    }
+    *pfills = fills;
+    *pflushes = flushes;
+}
+
+void tlb_shootdown_counts(size_t *pposted, size_t *pwaited)
+{
+    CPUState *cpu;
+    size_t posted = 0, waited = 0;
+
+    CPU_FOREACH(cpu) {
+        CPUArchState *env = cpu->env_ptr;
+
+        posted += qatomic_read(&env_tlb(env)->c.shootdown_count);
+        waited += qatomic_read(&env_tlb(env)->c.shootdown_wait_count);
+    }
+    *pposted = posted;
+    *pwaited = waited;
+}
+
+/* Let the target drop what it derived from the flushed translations. */
+static void tlb_notify_flushed(CPUState *cpu, uint16_t idxmap,
+                               vaddr addr, vaddr len)
+{
+    if (cpu->cc->tcg_ops->tlb_flushed) {
+        cpu->cc->tcg_ops->tlb_flushed(cpu, idxmap, addr, len);
+    }
+}
+
 static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
 {
     CPUArchState *env = cpu->env_ptr;
@@ -360,10 +799,21 @@ static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
     for (work = to_clean; work != 0; work &= work - 1) {
         int mmu_idx = ctz32(work);
         tlb_flush_one_mmuidx_locked(env, mmu_idx, now);
+        tlb_tag_sets_drop_locked(&env_tlb(env)->d[mmu_idx]);
+    }
+    /*
+     * A full flush may come with a change of address space that the
+     * target did not report, e.g. on reset: forget the current tag.
+     */
+    for (work = asked; work != 0; work &= work - 1) {
+        env_tlb(env)->d[ctz32(work)].has_tag = false;
     }
 
     qemu_spin_unlock(&env_tlb(env)->c.lock);
 
+    /* Even an elided flush may have walks cached outside of the TLB. */
+    tlb_notify_flushed(cpu, asked, 0, 0);
+    tlb_shared_flush(asked);
     cpu_tb_jmp_cache_clear(cpu);
 
     if (to_clean == ALL_MMUIDX_BITS) {
@@ -414,12 +864,9 @@ void tlb_flush_all_cpus(CPUState *src_cpu)
 
 void tlb_flush_by_mmuidx_all_cpus_synced(CPUState *src_cpu, uint16_t idxmap)
 {
-    const run_on_cpu_func fn = tlb_flush_by_mmuidx_async_work;
-
     tlb_debug("mmu_idx: 0x%"PRIx16"\n", idxmap);
 
-    flush_all_helper(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
-    async_safe_run_on_cpu(src_cpu, fn, RUN_ON_CPU_HOST_INT(idxmap));
+    tlb_shootdown_all_cpus(src_cpu, idxmap, NULL);
 }
 
 void tlb_flush_all_cpus_synced(CPUState *src_cpu)
@@ -493,6 +940,127 @@ static inline void tlb_flush_vtlb_page_locked(CPUArchState *env, int mmu_idx,
     tlb_flush_vtlb_page_mask_locked(env, mmu_idx, page, -1);
 }
 
+/*
+ * Return true if the block mapping @lp overlaps [@addr,@addr+@len),
+ * with addresses compared under @mask.
+ */
+static bool tlb_lptlb_overlap(const CPULPTLBEntry *lp, target_ulong addr,
+                              target_ulong len, target_ulong mask)
+{
+    target_ulong first = addr & mask;
+    target_ulong last = (addr + len - 1) & mask;
+    target_ulong lp_first = lp->addr & mask;
+    target_ulong lp_last = (lp->addr | ~lp->mask) & mask;
+
+    if (lp->mask == 0) {
+        return false;
+    }
+    /* Be conservative if either range wraps once masked. */
+    if (first > last || lp_first > lp_last) {
+        return true;
+    }
+    return first <= lp_last && lp_first <= last;
+}
+
+/*
+ * Flush the pages of the block mappings of @midx that overlap
+ * [@addr,@addr+@len) under @mask, and forget those block mappings.
+ */
+static void tlb_flush_lptlb_locked(CPUArchState *env, int midx,
+                                   target_ulong addr, target_ulong len,
+                                   target_ulong mask)
+{
+    CPUTLBDesc *d = &env_tlb(env)->d[midx];
+    size_t n_entries = tlb_n_entries(&env_tlb(env)->f[midx]);
+    size_t flushed = 0;
+    int k;
+
+    for (k = 0; k < CPU_LPTLB_SIZE; k++) {
+        CPULPTLBEntry *lp = &d->lptlb[k];
+        target_ulong n, i;
+
+        if (!tlb_lptlb_overlap(lp, addr, len, mask)) {
+            continue;
+        }
+
+        /*
+         * The pages of the block can only be at their own index, so
+         * once the block is larger than the tlb every entry is checked.
+         */
+        n = MIN((~lp->mask >> TARGET_PAGE_BITS) + 1, n_entries);
+        for (i = 0; i < n; i++) {
+            target_ulong page = lp->addr + (i << TARGET_PAGE_BITS);
+
+            if (tlb_flush_entry_mask_locked(tlb_entry(env, midx, page),
+                                            lp->addr, lp->mask)) {
+                tlb_n_used_entries_dec(env, midx);
+            }
+        }
+        tlb_flush_vtlb_page_mask_locked(env, midx, lp->addr, lp->mask);
+
+        lp->addr = -1;
+        lp->mask = 0;
+        flushed++;
+    }
+
+    if (flushed) {
+        qatomic_set(&env_tlb(env)->c.lptlb_flush_count,
+                    env_tlb(env)->c.lptlb_flush_count + flushed);
+    }
+}
+
+/*
+ * Apply a flush of [@addr,@addr+@len) under @mask to the tagged sets of
+ * @midx, dropping those for which this would be a full flush.
+ */
+static void tlb_flush_tag_sets_locked(CPUArchState *env, int midx,
+                                      target_ulong addr, target_ulong len,
+                                      target_ulong mask)
+{
+    CPUTLBDesc *d = &env_tlb(env)->d[midx];
+    uint32_t i;
+    int k;
+
+    if (d->tag_sets == NULL) {
+        return;
+    }
+    for (i = 0; i < tlb_tag_sets; i++) {
+        CPUTLBTagSet *set = &d->tag_sets[i];
+
+        if (!set->valid) {
+            continue;
+        }
+        if (mask < set->mask || len > set->mask ||
+            ((addr + len - 1) & set->large_page_mask) ==
+            set->large_page_addr) {
+            set->valid = false;
+            continue;
+        }
+        for (k = 0; k < CPU_LPTLB_SIZE; k++) {
+            if (tlb_lptlb_overlap(&set->lptlb[k], addr, len, mask)) {
+                set->valid = false;
+            }
+        }
+        if (!set->valid) {
+            continue;
+        }
+        for (target_ulong l = 0; l < len; l += TARGET_PAGE_SIZE) {
+            target_ulong page = addr + l;
+            uintptr_t index = (page >> TARGET_PAGE_BITS) &
+                              (set->mask >> CPU_TLB_ENTRY_BITS);
+
+            if (tlb_flush_entry_mask_locked(&set->table[index], page, mask)) {
+                set->n_used_entries--;
+            }
+            for (k = 0; k < CPU_VTLB_SIZE; k++) {
+                if (tlb_flush_entry_mask_locked(&set->vtable[k], page, mask)) {
+                    set->n_used_entries--;
+                }
+            }
+        }
+    }
+}
+
 static void tlb_flush_page_locked(CPUArchState *env, int midx,
                                   target_ulong page)
 {
@@ -510,7 +1078,9 @@ static void tlb_flush_page_locked(CPUArchState *env, int midx,
             tlb_n_used_entries_dec(env, midx);
         }
         tlb_flush_vtlb_page_locked(env, midx, page);
+        tlb_flush_lptlb_locked(env, midx, page, TARGET_PAGE_SIZE, -1);
     }
+    tlb_flush_tag_sets_locked(env, midx, page, TARGET_PAGE_SIZE, -1);
 }
 
 /**
@@ -541,6 +1111,8 @@ static void tlb_flush_page_by_mmuidx_async_0(CPUState *cpu,
     }
     qemu_spin_unlock(&env_tlb(env)->c.lock);
 
+    tlb_notify_flushed(cpu, idxmap, addr, TARGET_PAGE_SIZE);
+    tlb_shared_flush_range(idxmap, addr, TARGET_PAGE_SIZE);
     tb_flush_jmp_cache(cpu, addr);
 }
 
@@ -665,41 +1237,17 @@ void tlb_flush_page_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
                                               target_ulong addr,
                                               uint16_t idxmap)
 {
+    TLBFlushRangeData d;
+
     tlb_debug("addr: "TARGET_FMT_lx" mmu_idx:%"PRIx16"\n", addr, idxmap);
 
     /* This should already be page aligned */
-    addr &= TARGET_PAGE_MASK;
-
-    /*
-     * Allocate memory to hold addr+idxmap only when needed.
-     * See tlb_flush_page_by_mmuidx for details.
-     */
-    if (idxmap < TARGET_PAGE_SIZE) {
-        flush_all_helper(src_cpu, tlb_flush_page_by_mmuidx_async_1,
-                         RUN_ON_CPU_TARGET_PTR(addr | idxmap));
-        async_safe_run_on_cpu(src_cpu, tlb_flush_page_by_mmuidx_async_1,
-                              RUN_ON_CPU_TARGET_PTR(addr | idxmap));
-    } else {
-        CPUState *dst_cpu;
-        TLBFlushPageByMMUIdxData *d;
-
-        /* Allocate a separate data block for each destination cpu.  */
-        CPU_FOREACH(dst_cpu) {
-            if (dst_cpu != src_cpu) {
-                d = g_new(TLBFlushPageByMMUIdxData, 1);
-                d->addr = addr;
-                d->idxmap = idxmap;
-                async_run_on_cpu(dst_cpu, tlb_flush_page_by_mmuidx_async_2,
-                                 RUN_ON_CPU_HOST_PTR(d));
-            }
-        }
+    d.addr = addr & TARGET_PAGE_MASK;
+    d.len = TARGET_PAGE_SIZE;
+    d.idxmap = idxmap;
+    d.bits = TARGET_LONG_BITS;
 
-        d = g_new(TLBFlushPageByMMUIdxData, 1);
-        d->addr = addr;
-        d->idxmap = idxmap;
-        async_safe_run_on_cpu(src_cpu, tlb_flush_page_by_mmuidx_async_2,
-                              RUN_ON_CPU_HOST_PTR(d));
-    }
+    tlb_shootdown_all_cpus(src_cpu, 0, &d);
 }
 
 void tlb_flush_page_all_cpus_synced(CPUState *src, target_ulong addr)
@@ -715,6 +1263,8 @@ static void tlb_flush_range_locked(CPUArchState *env, int midx,
     CPUTLBDescFast *f = &env_tlb(env)->f[midx];
     target_ulong mask = MAKE_64BIT_MASK(0, bits);
 
+    tlb_flush_tag_sets_locked(env, midx, addr, len, mask);
+
     /*
      * If @bits is smaller than the tlb size, there may be multiple entries
      * within the TLB; otherwise all addresses that match under @mask hit
@@ -746,6 +1296,8 @@ static void tlb_flush_range_locked(CPUArchState *env, int midx,
         return;
     }
 
+    tlb_flush_lptlb_locked(env, midx, addr, len, mask);
+
     for (target_ulong i = 0; i < len; i += TARGET_PAGE_SIZE) {
         target_ulong page = addr + i;
         CPUTLBEntry *entry = tlb_entry(env, midx, page);
@@ -757,13 +1309,6 @@ static void tlb_flush_range_locked(CPUArchState *env, int midx,
     }
 }
 
-typedef struct {
-    target_ulong addr;
-    target_ulong len;
-    uint16_t idxmap;
-    uint16_t bits;
-} TLBFlushRangeData;
-
 static void tlb_flush_range_by_mmuidx_async_0(CPUState *cpu,
                                               TLBFlushRangeData d)
 {
@@ -783,11 +1328,14 @@ static void tlb_flush_range_by_mmuidx_async_0(CPUState *cpu,
     }
     qemu_spin_unlock(&env_tlb(env)->c.lock);
 
+    tlb_notify_flushed(cpu, d.idxmap, d.addr, d.len);
+    tlb_shared_flush_range(d.idxmap, d.addr, d.len);
+
     /*
      * If the length is larger than the jump cache size, then it will take
      * longer to clear each entry individually than it will to clear it all.
      */
-    if (d.len >= (TARGET_PAGE_SIZE * TB_JMP_CACHE_SIZE)) {
+    if (d.len >= TARGET_PAGE_SIZE * (cpu->tb_jmp_cache_mask + 1)) {
         cpu_tb_jmp_cache_clear(cpu);
         return;
     }
@@ -805,6 +1353,188 @@ static void tlb_flush_range_by_mmuidx_async_1(CPUState *cpu,
     g_free(d);
 }
 
+static void tlb_flush_tag_by_mmuidx_async_0(CPUState *cpu, uint32_t tag,
+                                            uint16_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int64_t now = get_clock_realtime();
+    uint16_t work, flushed = 0;
+    uint32_t i;
+
+    assert_cpu_is_self(cpu);
+
+    tlb_debug("tag:0x%" PRIx32 " mmu_idx:0x%" PRIx16 "\n", tag, idxmap);
+
+    qemu_spin_lock(&env_tlb(env)->c.lock);
+    for (work = idxmap & env_tlb(env)->c.dirty; work; work &= work - 1) {
+        int mmu_idx = ctz32(work);
+        CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+
+        /* Without a known tag, the current entries may belong to @tag. */
+        if (!desc->has_tag || desc->tag == tag) {
+            tlb_flush_one_mmuidx_locked(env, mmu_idx, now);
+            flushed |= 1 << mmu_idx;
+        }
+        for (i = 0; desc->tag_sets && i < tlb_tag_sets; i++) {
+            if (desc->tag_sets[i].tag == tag) {
+                desc->tag_sets[i].valid = false;
+            }
+        }
+    }
+    qemu_spin_unlock(&env_tlb(env)->c.lock);
+
+    /* The target's caches are not tagged, so they go as a whole. */
+    tlb_notify_flushed(cpu, idxmap, 0, 0);
+    tlb_shared_flush(idxmap);
+    if (flushed) {
+        cpu_tb_jmp_cache_clear(cpu);
+        qatomic_set(&env_tlb(env)->c.part_flush_count,
+                    env_tlb(env)->c.part_flush_count + ctpop16(flushed));
+    }
+}
+
+static void tlb_flush_tag_by_mmuidx_async_1(CPUState *cpu,
+                                            run_on_cpu_data data)
+{
+    TLBFlushRangeData *d = data.host_ptr;
+    tlb_flush_tag_by_mmuidx_async_0(cpu, d->addr, d->idxmap);
+    g_free(d);
+}
+
+/*
+ * Synced flushes across all vCPUs ("shootdowns").
+ *
+ * Instead of making every vCPU leave cpu_exec for an exclusive section,
+ * the flush is posted to each vCPU, which applies it at its next TB
+ * boundary, before it enters cpu_exec again, or while it waits for
+ * a shootdown of its own.  The source vCPU flushes itself right away
+ * and then waits for the vCPUs that are executing guest code.  A vCPU
+ * that is not executing does not need to acknowledge, since it applies
+ * the flush before it can use its TLB again.
+ */
+
+static void tlb_shootdown_post(CPUState *cpu, uint16_t full,
+                               const TLBFlushRangeData *d)
+{
+    CPUTLBCommon *c = &env_tlb(cpu->env_ptr)->c;
+
+    qemu_spin_lock(&c->lock);
+    if (d) {
+        if (c->nb_shootdown < CPU_TLB_SHOOTDOWN_RANGES) {
+            c->shootdown[c->nb_shootdown++] = *d;
+        } else {
+            /* Too many pending: flush these mmu_idx entirely. */
+            full |= d->idxmap;
+        }
+    }
+    c->shootdown_full |= full;
+    qatomic_set(&c->shootdown_posted, c->shootdown_posted + 1);
+    qemu_spin_unlock(&c->lock);
+}
+
+void tlb_shootdown_process(CPUState *cpu)
+{
+    CPUTLBCommon *c = &env_tlb(cpu->env_ptr)->c;
+    TLBFlushRangeData range[CPU_TLB_SHOOTDOWN_RANGES];
+    uint16_t full;
+    uint32_t gen;
+    int i, n;
+
+    qemu_spin_lock(&c->lock);
+    gen = c->shootdown_posted;
+    full = c->shootdown_full;
+    n = c->nb_shootdown;
+    memcpy(range, c->shootdown, n * sizeof(range[0]));
+    c->shootdown_full = 0;
+    c->nb_shootdown = 0;
+    qemu_spin_unlock(&c->lock);
+
+    if (full) {
+        tlb_flush_by_mmuidx_async_work(cpu, RUN_ON_CPU_HOST_INT(full));
+    }
+    for (i = 0; i < n; i++) {
+        range[i].idxmap &= ~full;
+        if (range[i].idxmap == 0) {
+            continue;
+        }
+        if (range[i].len == 0) {
+            tlb_flush_tag_by_mmuidx_async_0(cpu, range[i].addr,
+                                            range[i].idxmap);
+        } else if (range[i].bits >= TARGET_LONG_BITS &&
+                   range[i].len == TARGET_PAGE_SIZE) {
+            tlb_flush_page_by_mmuidx_async_0(cpu, range[i].addr,
+                                             range[i].idxmap);
+        } else {
+            tlb_flush_range_by_mmuidx_async_0(cpu, range[i]);
+        }
+    }
+
+    qatomic_store_release(&c->shootdown_done, gen);
+}
+
+static void tlb_shootdown_work(CPUState *cpu, run_on_cpu_data data)
+{
+    tlb_shootdown_process(cpu);
+}
+
+static void tlb_shootdown_all_cpus(CPUState *src, uint16_t full,
+                                   const TLBFlushRangeData *d)
+{
+    CPUTLBCommon *src_c = &env_tlb(src->env_ptr)->c;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        tlb_shootdown_post(cpu, full, d);
+    }
+    qatomic_set(&src_c->shootdown_count, src_c->shootdown_count + 1);
+
+    /*
+     * Waiting with the BQL held could deadlock against a vCPU that is
+     * blocked on it in an I/O access, and only the source vCPU can
+     * flush its own TLB.  Fall back to an exclusive section then.
+     */
+    if (!qemu_cpu_is_self(src) || qemu_mutex_iothread_locked()) {
+        CPU_FOREACH(cpu) {
+            if (cpu != src) {
+                qemu_cpu_kick(cpu);
+            }
+        }
+        async_safe_run_on_cpu(src, tlb_shootdown_work, RUN_ON_CPU_NULL);
+        return;
+    }
+
+    /* Make vCPUs that are executing stop chaining TBs. */
+    smp_mb();
+    CPU_FOREACH(cpu) {
+        if (cpu != src && qatomic_read(&cpu->running)) {
+            qatomic_set(&cpu_neg(cpu)->icount_decr.u16.high, -1);
+        }
+    }
+
+    tlb_shootdown_process(src);
+
+    CPU_FOREACH(cpu) {
+        CPUTLBCommon *c = &env_tlb(cpu->env_ptr)->c;
+        bool waited = false;
+
+        if (cpu == src) {
+            continue;
+        }
+        while (qatomic_load_acquire(&c->shootdown_done) !=
+               qatomic_read(&c->shootdown_posted) &&
+               qatomic_read(&cpu->running)) {
+            /* That vCPU may in turn be waiting for us. */
+            tlb_shootdown_poll(src);
+            waited = true;
+            cpu_relax();
+        }
+        if (waited) {
+            qatomic_set(&src_c->shootdown_wait_count,
+                        src_c->shootdown_wait_count + 1);
+        }
+    }
+}
+
 void tlb_flush_range_by_mmuidx(CPUState *cpu, target_ulong addr,
                                target_ulong len, uint16_t idxmap,
                                unsigned bits)
@@ -901,8 +1631,7 @@ void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
                                                uint16_t idxmap,
                                                unsigned bits)
 {
-    TLBFlushRangeData d, *p;
-    CPUState *dst_cpu;
+    TLBFlushRangeData d;
 
     /*
      * If all bits are significant, and len is small,
@@ -924,18 +1653,7 @@ void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
     d.idxmap = idxmap;
     d.bits = bits;
 
-    /* Allocate a separate data block for each destination cpu.  */
-    CPU_FOREACH(dst_cpu) {
-        if (dst_cpu != src_cpu) {
-            p = g_memdup(&d, sizeof(d));
-            async_run_on_cpu(dst_cpu, tlb_flush_range_by_mmuidx_async_1,
-                             RUN_ON_CPU_HOST_PTR(p));
-        }
-    }
-
-    p = g_memdup(&d, sizeof(d));
-    async_safe_run_on_cpu(src_cpu, tlb_flush_range_by_mmuidx_async_1,
-                          RUN_ON_CPU_HOST_PTR(p));
+    tlb_shootdown_all_cpus(src_cpu, 0, &d);
 }
 
 void tlb_flush_page_bits_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
@@ -947,6 +1665,65 @@ void tlb_flush_page_bits_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
                                               idxmap, bits);
 }
 
+void tlb_switch_tag_by_mmuidx(CPUState *cpu, uint16_t idxmap,
+                              uint32_t old_tag, uint32_t new_tag)
+{
+    CPUArchState *env = cpu->env_ptr;
+    uint16_t work;
+    size_t restored = 0;
+
+    assert_cpu_is_self(cpu);
+
+    tlb_debug("tag:0x%" PRIx32 "->0x%" PRIx32 " mmu_idx:0x%" PRIx16 "\n",
+              old_tag, new_tag, idxmap);
+
+    if (!tlb_tags_enabled()) {
+        tlb_flush_by_mmuidx(cpu, idxmap);
+        return;
+    }
+
+    qemu_spin_lock(&env_tlb(env)->c.lock);
+    for (work = idxmap; work != 0; work &= work - 1) {
+        restored += tlb_switch_tag_locked(env, ctz32(work), old_tag, new_tag);
+    }
+    /* Entries set aside must be dropped by the next full flush. */
+    env_tlb(env)->c.dirty |= idxmap;
+    qemu_spin_unlock(&env_tlb(env)->c.lock);
+
+    cpu_tb_jmp_cache_clear(cpu);
+
+    qatomic_set(&env_tlb(env)->c.tag_switch_count,
+                env_tlb(env)->c.tag_switch_count + 1);
+    qatomic_set(&env_tlb(env)->c.tag_restore_count,
+                env_tlb(env)->c.tag_restore_count + restored);
+}
+
+void tlb_flush_tag_by_mmuidx(CPUState *cpu, uint16_t idxmap, uint32_t tag)
+{
+    if (qemu_cpu_is_self(cpu)) {
+        tlb_flush_tag_by_mmuidx_async_0(cpu, tag, idxmap);
+    } else {
+        TLBFlushRangeData *p = g_new0(TLBFlushRangeData, 1);
+
+        p->addr = tag;
+        p->idxmap = idxmap;
+        async_run_on_cpu(cpu, tlb_flush_tag_by_mmuidx_async_1,
+                         RUN_ON_CPU_HOST_PTR(p));
+    }
+}
+
+void tlb_flush_tag_by_mmuidx_all_cpus_synced(CPUState *src_cpu,
+                                             uint16_t idxmap, uint32_t tag)
+{
+    TLBFlushRangeData d = {
+        .addr = tag,
+        .len = 0,
+        .idxmap = idxmap,
+    };
+
+    tlb_shootdown_all_cpus(src_cpu, 0, &d);
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
@@ -1034,6 +1811,27 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
             tlb_reset_dirty_range_locked(&env_tlb(env)->d[mmu_idx].vtable[i],
                                          start1, length);
         }
+
+        if (env_tlb(env)->d[mmu_idx].tag_sets) {
+            uint32_t j;
+
+            for (j = 0; j < tlb_tag_sets; j++) {
+                CPUTLBTagSet *set = &env_tlb(env)->d[mmu_idx].tag_sets[j];
+
+                if (!set->valid) {
+                    continue;
+                }
+                n = (set->mask >> CPU_TLB_ENTRY_BITS) + 1;
+                for (i = 0; i < n; i++) {
+                    tlb_reset_dirty_range_locked(&set->table[i],
+                                                 start1, length);
+                }
+                for (i = 0; i < CPU_VTLB_SIZE; i++) {
+                    tlb_reset_dirty_range_locked(&set->vtable[i],
+                                                 start1, length);
+                }
+            }
+        }
     }
     qemu_spin_unlock(&env_tlb(env)->c.lock);
 }
@@ -1123,6 +1921,10 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
 
     assert_cpu_is_self(cpu);
 
+    if (unlikely(tlb_shared_fill.pending)) {
+        tlb_shared_insert(env, vaddr, paddr, attrs, prot, mmu_idx, size);
+    }
+
     if (size <= TARGET_PAGE_SIZE) {
         sz = TARGET_PAGE_SIZE;
     } else {
@@ -1283,6 +2085,116 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                             prot, mmu_idx, size);
 }
 
+void tlb_set_large_page_with_attrs(CPUState *cpu, target_ulong vaddr,
+                                   hwaddr paddr, MemTxAttrs attrs, int prot,
+                                   int mmu_idx, target_ulong size)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+    target_ulong mask = ~(size - 1);
+    CPULPTLBEntry *lp = NULL;
+    int k;
+
+    assert_cpu_is_self(cpu);
+
+    if (size <= TARGET_PAGE_SIZE) {
+        tlb_set_page_with_attrs(cpu, vaddr, paddr, attrs, prot, mmu_idx, size);
+        return;
+    }
+    if (unlikely(tlb_shared_fill.pending)) {
+        /* Share the page as part of the block, not as a small page. */
+        tlb_shared_insert(env, vaddr, paddr, attrs, prot, mmu_idx, size);
+    }
+    vaddr &= TARGET_PAGE_MASK;
+    paddr &= TARGET_PAGE_MASK;
+
+    qemu_spin_lock(&env_tlb(env)->c.lock);
+    for (k = 0; k < CPU_LPTLB_SIZE; k++) {
+        if (desc->lptlb[k].addr == (vaddr & mask) &&
+            desc->lptlb[k].mask == mask) {
+            lp = &desc->lptlb[k];
+            break;
+        }
+    }
+    if (lp == NULL) {
+        lp = &desc->lptlb[desc->lpindex++ % CPU_LPTLB_SIZE];
+        if (lp->mask) {
+            /* The pages of the evicted block stay in the tlb. */
+            tlb_add_large_page(env, mmu_idx, lp->addr, ~lp->mask + 1);
+        }
+    }
+    lp->addr = vaddr & mask;
+    lp->mask = mask;
+    lp->paddr = paddr - (vaddr & ~mask);
+    lp->attrs = attrs;
+    lp->prot = prot;
+    qemu_spin_unlock(&env_tlb(env)->c.lock);
+
+    tlb_set_page_with_attrs(cpu, vaddr, paddr, attrs, prot, mmu_idx,
+                            TARGET_PAGE_SIZE);
+}
+
+static int tlb_prot_needed(MMUAccessType access_type)
+{
+    switch (access_type) {
+    case MMU_DATA_LOAD:
+        return PAGE_READ;
+    case MMU_DATA_STORE:
+        return PAGE_WRITE;
+    default:
+        return PAGE_EXEC;
+    }
+}
+
+/*
+ * Enter the page of @addr from a block mapping of @mmu_idx, if there
+ * is one that allows @prot_needed, instead of calling tlb_fill.
+ * Anything else, faults included, is left to tlb_fill.
+ */
+static bool tlb_fill_from_lptlb(CPUState *cpu, target_ulong addr,
+                                int prot_needed, int mmu_idx)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBDesc *desc = &env_tlb(env)->d[mmu_idx];
+    target_ulong page = addr & TARGET_PAGE_MASK;
+    int k;
+
+    for (k = 0; k < CPU_LPTLB_SIZE; k++) {
+        CPULPTLBEntry *lp = &desc->lptlb[k];
+
+        if ((page & lp->mask) == lp->addr && (lp->prot & prot_needed)) {
+            tlb_set_page_with_attrs(cpu, page, lp->paddr + (page - lp->addr),
+                                    lp->attrs, lp->prot, mmu_idx,
+                                    TARGET_PAGE_SIZE);
+            qatomic_set(&env_tlb(env)->c.lptlb_fill_count,
+                        env_tlb(env)->c.lptlb_fill_count + 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Call the target's tlb_fill, sharing the page it enters if @share.
+ * A fill that raises an exception longjmps out with @pending still set,
+ * so callers clear it before entering pages from the block TLB or the
+ * shared TLB: nothing may be shared under the generations of an
+ * earlier fill.
+ */
+static bool tlb_fill_target(CPUState *cpu, target_ulong addr, int size,
+                            MMUAccessType access_type, int mmu_idx,
+                            bool probe, uintptr_t retaddr, bool share)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    bool ok;
+
+    tlb_shared_fill.pending = share;
+    ok = cc->tcg_ops->tlb_fill(cpu, addr, size,
+                               access_type, mmu_idx, probe, retaddr);
+    tlb_shared_fill.pending = false;
+    return ok;
+}
+
 /*
  * Note: tlb_fill() can trigger a resize of the TLB. This means that all of the
  * caller's prior references to the TLB table (e.g. CPUTLBEntry pointers) must
@@ -1291,15 +2203,21 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
 static void tlb_fill(CPUState *cpu, target_ulong addr, int size,
                      MMUAccessType access_type, int mmu_idx, uintptr_t retaddr)
 {
-    CPUClass *cc = CPU_GET_CLASS(cpu);
-    bool ok;
+    int prot_needed = tlb_prot_needed(access_type);
+    bool share, ok;
+
+    tlb_shared_fill.pending = false;
+    if (tlb_fill_from_lptlb(cpu, addr, prot_needed, mmu_idx) ||
+        tlb_shared_fill_page(cpu, addr, prot_needed, mmu_idx, &share)) {
+        return;
+    }
 
     /*
      * This is not a probe, so only valid return is success; failure
      * should result in exception + longjmp to the cpu loop.
      */
-    ok = cc->tcg_ops->tlb_fill(cpu, addr, size,
-                               access_type, mmu_idx, false, retaddr);
+    ok = tlb_fill_target(cpu, addr, size, access_type, mmu_idx,
+                         false, retaddr, share);
     assert(ok);
 }
 
@@ -1539,10 +2457,15 @@ static int probe_access_internal(CPUArchState *env, target_ulong addr,
     if (!tlb_hit_page(tlb_addr, page_addr)) {
         if (!victim_tlb_hit(env, mmu_idx, index, elt_ofs, page_addr)) {
             CPUState *cs = env_cpu(env);
-            CPUClass *cc = CPU_GET_CLASS(cs);
-
-            if (!cc->tcg_ops->tlb_fill(cs, addr, fault_size, access_type,
-                                       mmu_idx, nonfault, retaddr)) {
+            int prot_needed = tlb_prot_needed(access_type);
+            bool share;
+
+            tlb_shared_fill.pending = false;
+            if (!tlb_fill_from_lptlb(cs, addr, prot_needed, mmu_idx) &&
+                !tlb_shared_fill_page(cs, addr, prot_needed, mmu_idx,
+                                      &share) &&
+                !tlb_fill_target(cs, addr, fault_size, access_type,
+                                 mmu_idx, nonfault, retaddr, share)) {
                 /* Non-faulting page table read failed.  */
                 *phost = NULL;
                 return TLB_INVALID_MASK;
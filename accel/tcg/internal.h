@@ -14,8 +14,68 @@
 TranslationBlock *tb_gen_code(CPUState *cpu, target_ulong pc,
                               target_ulong cs_base, uint32_t flags,
                               int cflags);
+TranslationBlock *tb_promote(CPUState *cpu, TranslationBlock *tb);
 G_NORETURN void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 void page_init(void);
 void tb_htable_init(void);
 
+#ifdef CONFIG_SOFTMMU
+void tlb_shootdown_process(CPUState *cpu);
+
+/* Number of tagged TLB sets kept per MMU mode, 0 to flush instead. */
+extern uint32_t tlb_tag_sets;
+
+/* Writes to a code page missing its code before it is left unprotected. */
+extern uint32_t tb_smc_threshold;
+
+extern bool tlb_shared_enabled;
+void tlb_shared_init(void);
+void tlb_shared_dump_info(GString *buf);
+
+/* Apply the TLB flushes that other vCPUs posted to @cpu. */
+static inline void tlb_shootdown_poll(CPUState *cpu)
+{
+    CPUTLBCommon *c = &env_tlb((CPUArchState *)cpu->env_ptr)->c;
+
+    if (unlikely(qatomic_read(&c->shootdown_posted) !=
+                 qatomic_read(&c->shootdown_done))) {
+        tlb_shootdown_process(cpu);
+    }
+}
+
+extern bool tb_cache_enabled;
+void tb_cache_init(const char *path);
+void tb_cache_record(CPUState *cpu, const TranslationBlock *tb,
+                     const void *host_pc, int64_t xlate_ns);
+void tb_cache_dump_info(GString *buf);
+
+extern bool tb_spec_enabled;
+extern __thread sigjmp_buf *tb_spec_abort;
+void tb_spec_init(unsigned nb_threads);
+void tb_spec_queue(CPUState *cpu, const TranslationBlock *tb,
+                   const target_ulong *dests, int n);
+void tb_spec_pause(void);
+void tb_spec_resume(void);
+void tb_spec_dump_info(GString *buf);
+
+extern bool tcg_affinity_enabled;
+void tcg_affinity_init(void);
+void tcg_affinity_pin_vcpu(CPUState *cpu);
+void tcg_affinity_pin_helper(const char *name, unsigned n);
+void tcg_affinity_sample(void);
+void tcg_affinity_dump_info(GString *buf);
+
+extern uint32_t tcg_halt_poll_max_ns;
+void tcg_halt_poll_wait(CPUState *cpu);
+void tcg_halt_poll_dump_info(GString *buf);
+TranslationBlock *tb_htable_lookup_phys(tb_page_addr_t phys_pc,
+                                        target_ulong pc, target_ulong cs_base,
+                                        uint32_t flags, uint32_t cflags,
+                                        uint32_t trace_vcpu_dstate);
+TranslationBlock *tb_gen_code_spec(CPUState *cpu, target_ulong pc,
+                                   target_ulong cs_base, uint32_t flags,
+                                   int cflags, tb_page_addr_t phys_pc,
+                                   void *host_pc);
+#endif
+
 #endif /* ACCEL_TCG_INTERNAL_H */
@@ -0,0 +1,261 @@
+/*
+ * Persistent translation block index
+ *
+ * Remembers which translation blocks were generated during a run, keyed
+ * on the guest code bytes, the TB lookup state and the CPU model, and
+ * stores that set on disk at exit.  On the next run every translation is
+ * checked against the stored set, which tells us exactly how much of the
+ * translation work of a boot is a repeat of the previous one and how much
+ * host time a cache of generated code would save.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/notify.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/xxhash.h"
+#include "qapi/error.h"
+#include "sysemu/sysemu.h"
+#include "exec/exec-all.h"
+#include "internal.h"
+
+#define TB_CACHE_MAGIC      "QEMUTBC"
+#define TB_CACHE_VERSION    1
+
+/* Per key state, stored as the hash table value. */
+#define TB_CACHE_LOADED     1   /* key was present in the file */
+#define TB_CACHE_SEEN       2   /* key was translated during this run */
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t build_id;
+    uint64_t nb_keys;
+} TBCacheHeader;
+
+typedef struct TBCacheStats {
+    size_t boot_hits;
+    size_t run_hits;
+    size_t misses;
+    size_t uncacheable;
+    int64_t hit_ns;
+    int64_t total_ns;
+} TBCacheStats;
+
+static struct {
+    char *path;
+    QemuMutex lock;
+    GHashTable *keys;
+    size_t nb_loaded;
+    TBCacheStats stats;
+    Notifier exit_notifier;
+} tb_cache;
+
+bool tb_cache_enabled;
+
+static uint32_t tb_cache_build_id(void)
+{
+    return g_str_hash(QEMU_VERSION "-" TARGET_NAME);
+}
+
+static void tb_cache_insert(uint64_t key, uintptr_t state)
+{
+    uint64_t *k = g_new(uint64_t, 1);
+
+    *k = key;
+    g_hash_table_replace(tb_cache.keys, k, (gpointer)state);
+}
+
+static void tb_cache_load(void)
+{
+    g_autoptr(GError) err = NULL;
+    g_autofree char *buf = NULL;
+    const TBCacheHeader *hdr;
+    const uint64_t *ent;
+    gsize len;
+    uint64_t i, n;
+
+    if (!g_file_get_contents(tb_cache.path, &buf, &len, &err)) {
+        if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            warn_report("tb-cache: %s", err->message);
+        }
+        return;
+    }
+
+    hdr = (const TBCacheHeader *)buf;
+    if (len < sizeof(*hdr) ||
+        memcmp(hdr->magic, TB_CACHE_MAGIC, sizeof(TB_CACHE_MAGIC)) != 0 ||
+        le32_to_cpu(hdr->version) != TB_CACHE_VERSION) {
+        warn_report("tb-cache: ignoring '%s': not a TB cache file",
+                    tb_cache.path);
+        return;
+    }
+    if (le32_to_cpu(hdr->build_id) != tb_cache_build_id()) {
+        /* Written by another QEMU build: start over. */
+        return;
+    }
+
+    n = le64_to_cpu(hdr->nb_keys);
+    if (n > (len - sizeof(*hdr)) / sizeof(uint64_t)) {
+        warn_report("tb-cache: ignoring '%s': file is truncated",
+                    tb_cache.path);
+        return;
+    }
+
+    ent = (const uint64_t *)(buf + sizeof(*hdr));
+    for (i = 0; i < n; i++) {
+        tb_cache_insert(le64_to_cpu(ent[i]), TB_CACHE_LOADED);
+    }
+    tb_cache.nb_loaded = g_hash_table_size(tb_cache.keys);
+}
+
+static void tb_cache_save(Notifier *n, void *unused)
+{
+    g_autoptr(GError) err = NULL;
+    g_autofree char *buf = NULL;
+    TBCacheHeader *hdr;
+    GHashTableIter iter;
+    gpointer key;
+    uint64_t *ent;
+    size_t nb_keys, len;
+
+    qemu_mutex_lock(&tb_cache.lock);
+    nb_keys = g_hash_table_size(tb_cache.keys);
+    len = sizeof(*hdr) + nb_keys * sizeof(uint64_t);
+    buf = g_malloc0(len);
+
+    hdr = (TBCacheHeader *)buf;
+    memcpy(hdr->magic, TB_CACHE_MAGIC, sizeof(TB_CACHE_MAGIC));
+    hdr->version = cpu_to_le32(TB_CACHE_VERSION);
+    hdr->build_id = cpu_to_le32(tb_cache_build_id());
+    hdr->nb_keys = cpu_to_le64(nb_keys);
+
+    ent = (uint64_t *)(buf + sizeof(*hdr));
+    g_hash_table_iter_init(&iter, tb_cache.keys);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        *ent++ = cpu_to_le64(*(uint64_t *)key);
+    }
+    qemu_mutex_unlock(&tb_cache.lock);
+
+    if (!g_file_set_contents(tb_cache.path, buf, len, &err)) {
+        warn_report("tb-cache: %s", err->message);
+    }
+}
+
+void tb_cache_init(const char *path)
+{
+    tb_cache.path = g_strdup(path);
+    qemu_mutex_init(&tb_cache.lock);
+    tb_cache.keys = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                          g_free, NULL);
+    tb_cache_load();
+
+    tb_cache.exit_notifier.notify = tb_cache_save;
+    qemu_add_exit_notifier(&tb_cache.exit_notifier);
+    tb_cache_enabled = true;
+}
+
+/*
+ * The key covers everything the generated code depends on: the guest
+ * code bytes, the lookup state of the TB and the CPU model.  The guest
+ * physical address is deliberately left out so that a relocated image
+ * still matches.
+ */
+static uint64_t tb_cache_key(CPUState *cpu, const TranslationBlock *tb,
+                             const void *host_pc)
+{
+    const uint8_t *p = host_pc;
+    uint64_t w[3];
+    uint64_t h;
+    size_t i, chunk;
+
+    h = g_str_hash(object_get_typename(OBJECT(cpu)));
+    for (i = 0; i < tb->size; i += sizeof(w)) {
+        chunk = MIN(sizeof(w), tb->size - i);
+        memset(w, 0, sizeof(w));
+        memcpy(w, p + i, chunk);
+        h = qemu_xxhash64_4(h, w[0], w[1], w[2]);
+    }
+    return qemu_xxhash64_4(h, tb->pc, tb->cs_base,
+                           deposit64(tb->flags, 32, 32,
+                                     tb->cflags & ~CF_INVALID));
+}
+
+void tb_cache_record(CPUState *cpu, const TranslationBlock *tb,
+                     const void *host_pc, int64_t xlate_ns)
+{
+    TBCacheStats *s = &tb_cache.stats;
+    gpointer state;
+    uint64_t key;
+
+    /*
+     * Code spanning two pages would need the host address of the second
+     * page as well; such blocks are rare enough to just count them.
+     */
+    if (host_pc == NULL || tb->page_addr[1] != -1) {
+        qemu_mutex_lock(&tb_cache.lock);
+        s->uncacheable++;
+        s->total_ns += xlate_ns;
+        qemu_mutex_unlock(&tb_cache.lock);
+        return;
+    }
+
+    key = tb_cache_key(cpu, tb, host_pc);
+
+    qemu_mutex_lock(&tb_cache.lock);
+    s->total_ns += xlate_ns;
+    state = g_hash_table_lookup(tb_cache.keys, &key);
+    if (state == NULL) {
+        s->misses++;
+        tb_cache_insert(key, TB_CACHE_SEEN);
+    } else {
+        uintptr_t st = (uintptr_t)state;
+
+        if (st & TB_CACHE_SEEN) {
+            s->run_hits++;
+        } else {
+            s->boot_hits++;
+            tb_cache_insert(key, st | TB_CACHE_SEEN);
+        }
+        s->hit_ns += xlate_ns;
+    }
+    qemu_mutex_unlock(&tb_cache.lock);
+}
+
+void tb_cache_dump_info(GString *buf)
+{
+    TBCacheStats s;
+    size_t total;
+
+    if (!tb_cache_enabled) {
+        return;
+    }
+
+    qemu_mutex_lock(&tb_cache.lock);
+    s = tb_cache.stats;
+    qemu_mutex_unlock(&tb_cache.lock);
+
+    total = s.boot_hits + s.run_hits + s.misses + s.uncacheable;
+    g_string_append_printf(buf, "\nTB cache (%s):\n", tb_cache.path);
+    g_string_append_printf(buf, "keys loaded         %zu\n",
+                           tb_cache.nb_loaded);
+    g_string_append_printf(buf, "translations        %zu\n", total);
+    g_string_append_printf(buf, "hits (prev. run)    %zu (%zu%%)\n",
+                           s.boot_hits,
+                           total ? (s.boot_hits * 100) / total : 0);
+    g_string_append_printf(buf, "hits (this run)     %zu (%zu%%)\n",
+                           s.run_hits,
+                           total ? (s.run_hits * 100) / total : 0);
+    g_string_append_printf(buf, "misses              %zu\n", s.misses);
+    g_string_append_printf(buf, "uncacheable         %zu\n", s.uncacheable);
+    g_string_append_printf(buf, "translation time    %" PRId64 " us\n",
+                           s.total_ns / SCALE_US);
+    g_string_append_printf(buf, "  spent on hits     %" PRId64 " us "
+                           "(%0.1f%%)\n", s.hit_ns / SCALE_US,
+                           s.total_ns ? (double)s.hit_ns * 100 / s.total_ns
+                           : 0);
+}
@@ -35,6 +35,24 @@ struct TBContext {
     /* statistics */
     unsigned tb_flush_count;
     unsigned tb_phys_invalidate_count;
+    unsigned tb_promote_count;
+    unsigned tb_evict_count;
+    size_t tb_evict_tbs;
+    size_t tb_evict_bytes;
+    size_t tb_retranslate_count;
+    int64_t tb_retranslate_ns;
+    size_t tb_spec_count;
+    size_t tb_spec_used;
+    size_t tb_smc_writes;
+    size_t tb_smc_clean_writes;
+    size_t tb_smc_self_check_pages;
+    size_t tb_smc_reprotected;
+    size_t tb_smc_check_fails;
+    size_t exclusive_steps;
+    size_t htm_steps;
+    size_t htm_aborts;
+    size_t tb_spin_loops;
+    size_t spin_yields;
 };
 
 extern TBContext tb_ctx;
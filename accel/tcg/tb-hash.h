@@ -28,11 +28,11 @@
 
 /* Only the bottom TB_JMP_PAGE_BITS of the jump cache hash bits vary for
    addresses on the same page.  The top bits are the same.  This allows
-   TLB invalidation to quickly clear a subset of the hash table.  */
-#define TB_JMP_PAGE_BITS (TB_JMP_CACHE_BITS / 2)
-#define TB_JMP_PAGE_SIZE (1 << TB_JMP_PAGE_BITS)
+   TLB invalidation to quickly clear a subset of the hash table.
+   The hash is for the largest cache; the set is the hash masked with
+   cpu->tb_jmp_cache_mask, which keeps a page within a group of sets.  */
 #define TB_JMP_ADDR_MASK (TB_JMP_PAGE_SIZE - 1)
-#define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
+#define TB_JMP_PAGE_MASK (TB_JMP_CACHE_MAX_SIZE - TB_JMP_PAGE_SIZE)
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
 {
@@ -54,7 +54,7 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 /* In user-mode we can get better hashing because we do not have a TLB */
 static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 {
-    return (pc ^ (pc >> TB_JMP_CACHE_BITS)) & (TB_JMP_CACHE_SIZE - 1);
+    return (pc ^ (pc >> TB_JMP_CACHE_MAX_BITS)) & (TB_JMP_CACHE_MAX_SIZE - 1);
 }
 
 #endif /* CONFIG_SOFTMMU */
@@ -0,0 +1,145 @@
+/*
+ * Sizing of the per-CPU TranslationBlock jump cache
+ *
+ * A guest that jumps between more code than the jump cache holds keeps
+ * falling back to the TB hash table, while a small working set only
+ * needs a small cache, which is also quicker to clear on TLB flushes.
+ * Like the softmmu TLB, the cache is thus resized per vCPU from what it
+ * measured over a window of time: it doubles when too many lookups had
+ * to go to the hash table, and halves when few did and most groups of
+ * sets were left empty.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/timer.h"
+#include "exec/exec-all.h"
+#include "tb-jmp-cache.h"
+
+/* Length of the resize window, and how often to check for its end */
+#define TB_JMP_CACHE_WINDOW_NS      (100 * SCALE_MS)
+#define TB_JMP_CACHE_CHECK_MISSES   64
+
+static void tb_jmp_cache_alloc(CPUState *cpu, int bits)
+{
+    size_t nb_sets = (size_t)1 << bits;
+
+    cpu->tb_jmp_cache = g_new0(TranslationBlock *,
+                               nb_sets * TB_JMP_CACHE_WAYS);
+    cpu->tb_jmp_cache_used = bitmap_new(nb_sets >> TB_JMP_PAGE_BITS);
+    cpu->tb_jmp_cache_mask = nb_sets - 1;
+}
+
+static void tb_jmp_cache_window_reset(CPUState *cpu, int64_t now)
+{
+    TBJmpCacheStats *s = &cpu->tb_jmp_cache_stats;
+
+    s->window_begin_ns = now;
+    s->window_lookups = s->lookups + cpu->tb_jmp_cache_hits;
+    s->window_misses = s->misses;
+}
+
+void tb_jmp_cache_init(CPUState *cpu)
+{
+    tb_jmp_cache_alloc(cpu, TB_JMP_CACHE_DEFAULT_BITS);
+    tb_jmp_cache_window_reset(cpu, get_clock_realtime());
+}
+
+void tb_jmp_cache_free(CPUState *cpu)
+{
+    g_free(cpu->tb_jmp_cache);
+    g_free(cpu->tb_jmp_cache_used);
+    cpu->tb_jmp_cache = NULL;
+    cpu->tb_jmp_cache_used = NULL;
+}
+
+/*
+ * Nobody else accesses the cache while its vCPU runs, so the old table
+ * can be freed right away.  Its valid entries move to the new one, LRU
+ * ways first so that the order within each set is kept.
+ */
+static void tb_jmp_cache_resize(CPUState *cpu, int bits)
+{
+    TranslationBlock **old = cpu->tb_jmp_cache;
+    unsigned long *old_used = cpu->tb_jmp_cache_used;
+    size_t n = cpu_tb_jmp_cache_groups(cpu);
+    size_t group = TB_JMP_PAGE_SIZE * TB_JMP_CACHE_WAYS;
+    size_t g, i;
+
+    tb_jmp_cache_alloc(cpu, bits);
+    for (g = find_first_bit(old_used, n); g < n;
+         g = find_next_bit(old_used, n, g + 1)) {
+        for (i = group; i-- > 0;) {
+            TranslationBlock *tb = old[g * group + i];
+
+            if (tb && !(tb_cflags(tb) & CF_INVALID)) {
+                tb_jmp_cache_insert(cpu, tb);
+            }
+        }
+    }
+    g_free(old);
+    g_free(old_used);
+    cpu->tb_jmp_cache_stats.resizes++;
+}
+
+static void tb_jmp_cache_window_end(CPUState *cpu, int64_t now)
+{
+    TBJmpCacheStats *s = &cpu->tb_jmp_cache_stats;
+    uint64_t lookups = s->lookups + cpu->tb_jmp_cache_hits - s->window_lookups;
+    uint64_t misses = s->misses - s->window_misses;
+    size_t n = cpu_tb_jmp_cache_groups(cpu);
+    size_t used = bitmap_count_one(cpu->tb_jmp_cache_used, n);
+    int bits = ctz32(cpu->tb_jmp_cache_mask + 1);
+
+    /*
+     * Grow above 1 miss in 32 lookups.  Shrink below 1 in 512, unless
+     * that would leave less than twice the room that is in use now.
+     */
+    if (misses * 32 > lookups && bits < TB_JMP_CACHE_MAX_BITS) {
+        tb_jmp_cache_resize(cpu, bits + 1);
+    } else if (misses * 512 < lookups && used * 4 < n &&
+               bits > TB_JMP_CACHE_MIN_BITS) {
+        tb_jmp_cache_resize(cpu, bits - 1);
+    }
+    tb_jmp_cache_window_reset(cpu, now);
+}
+
+/*
+ * Called by the vCPU thread when a lookup found its TB in the TB hash
+ * table only, i.e. a miss that a larger cache might have avoided.
+ */
+void tb_jmp_cache_miss(CPUState *cpu)
+{
+    TBJmpCacheStats *s = &cpu->tb_jmp_cache_stats;
+    int64_t now;
+
+    if (++s->misses % TB_JMP_CACHE_CHECK_MISSES) {
+        return;
+    }
+    now = get_clock_realtime();
+    if (now - s->window_begin_ns >= TB_JMP_CACHE_WINDOW_NS) {
+        tb_jmp_cache_window_end(cpu, now);
+    }
+}
+
+void tb_jmp_cache_dump_info(GString *buf)
+{
+    CPUState *cpu;
+
+    g_string_append_printf(buf, "\nJump cache:\n");
+    CPU_FOREACH(cpu) {
+        TBJmpCacheStats *s = &cpu->tb_jmp_cache_stats;
+        uint64_t lookups = s->lookups + qatomic_read(&cpu->tb_jmp_cache_hits);
+
+        g_string_append_printf(buf, "cpu %-3d %6u x %d entries, "
+                               "%" PRIu64 " lookups, %" PRIu64 " misses "
+                               "(%0.1f%%), %" PRIu64 " resizes\n",
+                               cpu->cpu_index,
+                               qatomic_read(&cpu->tb_jmp_cache_mask) + 1,
+                               TB_JMP_CACHE_WAYS, lookups, s->misses,
+                               lookups ? (double)s->misses * 100 / lookups
+                               : 0, s->resizes);
+    }
+}
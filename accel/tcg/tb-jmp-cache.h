@@ -0,0 +1,57 @@
+/*
+ * The per-CPU TranslationBlock jump cache.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef ACCEL_TCG_TB_JMP_CACHE_H
+#define ACCEL_TCG_TB_JMP_CACHE_H
+
+#include "tb-hash.h"
+
+void tb_jmp_cache_init(CPUState *cpu);
+void tb_jmp_cache_free(CPUState *cpu);
+void tb_jmp_cache_miss(CPUState *cpu);
+void tb_jmp_cache_dump_info(GString *buf);
+
+/* Return the TB_JMP_CACHE_WAYS entries that @pc may be cached in. */
+static inline TranslationBlock **tb_jmp_cache_set(CPUState *cpu,
+                                                  target_ulong pc)
+{
+    uint32_t set = tb_jmp_cache_hash_func(pc) & cpu->tb_jmp_cache_mask;
+
+    return &cpu->tb_jmp_cache[set * TB_JMP_CACHE_WAYS];
+}
+
+/* Move @tb from way @way of @set to the front, i.e. the MRU way. */
+static inline void tb_jmp_cache_move_to_front(TranslationBlock **set,
+                                              int way, TranslationBlock *tb)
+{
+    for (; way > 0; way--) {
+        qatomic_set(&set[way], qatomic_read(&set[way - 1]));
+    }
+    qatomic_set(&set[0], tb);
+}
+
+/*
+ * Add @tb as the most recently used entry of its set, in place of an
+ * older TB for the same pc if there is one, or else of the LRU entry.
+ */
+static inline void tb_jmp_cache_insert(CPUState *cpu, TranslationBlock *tb)
+{
+    uint32_t set = tb_jmp_cache_hash_func(tb->pc) & cpu->tb_jmp_cache_mask;
+    TranslationBlock **ways = &cpu->tb_jmp_cache[set * TB_JMP_CACHE_WAYS];
+    TranslationBlock *old;
+    int i;
+
+    for (i = 0; i < TB_JMP_CACHE_WAYS - 1; i++) {
+        old = qatomic_read(&ways[i]);
+        if (old == NULL || old->pc == tb->pc) {
+            break;
+        }
+    }
+    tb_jmp_cache_move_to_front(ways, i, tb);
+    set_bit(set >> TB_JMP_PAGE_BITS, cpu->tb_jmp_cache_used);
+}
+
+#endif /* ACCEL_TCG_TB_JMP_CACHE_H */
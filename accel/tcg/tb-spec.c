@@ -0,0 +1,251 @@
+/*
+ * Speculative translation
+ *
+ * When a translation block ends in direct jumps to the same guest page,
+ * the blocks at those targets are likely to be needed next.  A pool of
+ * helper threads translates them ahead of time from the ram backing the
+ * page, so that the vCPU finds them in the TB hash table instead of
+ * stopping to translate.  Translations that are never looked up by a
+ * vCPU are wasted work; both are counted for "info jit".
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "exec/exec-all.h"
+#include "exec/ram_addr.h"
+#include "hw/core/tcg-cpu-ops.h"
+#include "tcg/tcg.h"
+#include "tb-context.h"
+#include "internal.h"
+
+#define TB_SPEC_QUEUE_SIZE  256
+/* How many blocks deep to follow jumps from speculative translations */
+#define TB_SPEC_MAX_DEPTH   2
+
+typedef struct TBSpecRequest {
+    CPUState *cpu;
+    target_ulong pc;
+    target_ulong cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    tb_page_addr_t phys_pc;
+    int depth;
+} TBSpecRequest;
+
+typedef struct TBSpecStats {
+    size_t queued;
+    size_t dropped;
+    size_t present;
+    size_t aborted;
+} TBSpecStats;
+
+static struct {
+    QemuMutex lock;
+    QemuCond cond;
+    TBSpecRequest queue[TB_SPEC_QUEUE_SIZE];
+    unsigned head;
+    unsigned count;
+    TBSpecStats stats;
+    unsigned nb_threads;
+    /* held while translating; tb_flush and region eviction take it */
+    QemuMutex xlate_lock;
+} tb_spec;
+
+bool tb_spec_enabled;
+__thread sigjmp_buf *tb_spec_abort;
+/* depth of the request being translated by this thread */
+static __thread int tb_spec_depth;
+
+void tb_spec_pause(void)
+{
+    if (tb_spec_enabled) {
+        qemu_mutex_lock(&tb_spec.xlate_lock);
+    }
+}
+
+void tb_spec_resume(void)
+{
+    if (tb_spec_enabled) {
+        qemu_mutex_unlock(&tb_spec.xlate_lock);
+    }
+}
+
+/* Called with the RCU read lock held. */
+static void *tb_spec_host_addr(tb_page_addr_t phys_pc)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH(block) {
+        if (offset_in_ramblock(block, phys_pc - block->offset)) {
+            return ramblock_ptr(block, phys_pc - block->offset);
+        }
+    }
+    return NULL;
+}
+
+static void tb_spec_translate(const TBSpecRequest *req)
+{
+    TranslationBlock *tb;
+    sigjmp_buf abort_jmp;
+    void *host_pc;
+    bool aborted = false;
+
+    qemu_mutex_lock(&tb_spec.xlate_lock);
+    rcu_read_lock();
+
+    tb = tb_htable_lookup_phys(req->phys_pc, req->pc, req->cs_base,
+                               req->flags, req->cflags,
+                               *req->cpu->trace_dstate);
+    host_pc = tb ? NULL : tb_spec_host_addr(req->phys_pc);
+
+    if (host_pc) {
+        if (sigsetjmp(abort_jmp, 0) == 0) {
+            tb_spec_abort = &abort_jmp;
+            tb_spec_depth = req->depth;
+            tb_gen_code_spec(req->cpu, req->pc, req->cs_base, req->flags,
+                             req->cflags, req->phys_pc, host_pc);
+        } else {
+            aborted = true;
+        }
+        tb_spec_abort = NULL;
+        qemu_thread_jit_execute();
+    }
+
+    rcu_read_unlock();
+    qemu_mutex_unlock(&tb_spec.xlate_lock);
+
+    qemu_mutex_lock(&tb_spec.lock);
+    if (tb) {
+        tb_spec.stats.present++;
+    } else if (aborted) {
+        tb_spec.stats.aborted++;
+    }
+    qemu_mutex_unlock(&tb_spec.lock);
+}
+
+static void *tb_spec_thread(void *arg)
+{
+    TBSpecRequest req;
+    char name[16];
+
+    rcu_register_thread();
+    tcg_register_thread();
+    if (tcg_affinity_enabled) {
+        snprintf(name, sizeof(name), "TCG spec %u", (unsigned)(uintptr_t)arg);
+        tcg_affinity_pin_helper(name, (uintptr_t)arg);
+    }
+
+    for (;;) {
+        qemu_mutex_lock(&tb_spec.lock);
+        while (tb_spec.count == 0) {
+            qemu_cond_wait(&tb_spec.cond, &tb_spec.lock);
+        }
+        req = tb_spec.queue[tb_spec.head];
+        tb_spec.head = (tb_spec.head + 1) % TB_SPEC_QUEUE_SIZE;
+        tb_spec.count--;
+        qemu_mutex_unlock(&tb_spec.lock);
+
+        tb_spec_translate(&req);
+        if (tcg_affinity_enabled) {
+            tcg_affinity_sample();
+        }
+    }
+    return NULL;
+}
+
+void tb_spec_init(unsigned nb_threads)
+{
+    char name[16];
+    QemuThread thread;
+    unsigned i;
+
+    qemu_mutex_init(&tb_spec.lock);
+    qemu_mutex_init(&tb_spec.xlate_lock);
+    qemu_cond_init(&tb_spec.cond);
+    tb_spec.nb_threads = nb_threads;
+
+    for (i = 0; i < nb_threads; i++) {
+        snprintf(name, sizeof(name), "TCG spec %u", i);
+        qemu_thread_create(&thread, name, tb_spec_thread,
+                           (void *)(uintptr_t)i, QEMU_THREAD_DETACHED);
+    }
+    tb_spec_enabled = true;
+}
+
+/*
+ * Queue the @n direct jump targets @dests of the just translated @tb.
+ * Only targets on the first page of @tb are queued, since their ram
+ * address follows from that of @tb without a TLB lookup.
+ */
+void tb_spec_queue(CPUState *cpu, const TranslationBlock *tb,
+                   const target_ulong *dests, int n)
+{
+    TBSpecRequest *req;
+    uint32_t cflags = tb_cflags(tb) & ~CF_INVALID;
+    int depth = tb_spec_abort ? tb_spec_depth + 1 : 0;
+    int i;
+
+    if (depth >= TB_SPEC_MAX_DEPTH || tb->page_addr[0] == -1 ||
+        (cflags & (CF_NOIRQ | CF_SINGLE_STEP | CF_MEMI_ONLY)) ||
+        !cpu->cc->tcg_ops->translate_async) {
+        return;
+    }
+#ifdef CONFIG_PLUGIN
+    if (test_bit(QEMU_PLUGIN_EV_VCPU_TB_TRANS, cpu->plugin_mask)) {
+        return;
+    }
+#endif
+
+    qemu_mutex_lock(&tb_spec.lock);
+    for (i = 0; i < n; i++) {
+        if (tb_spec.count == TB_SPEC_QUEUE_SIZE) {
+            tb_spec.stats.dropped += n - i;
+            break;
+        }
+        req = &tb_spec.queue[(tb_spec.head + tb_spec.count) %
+                             TB_SPEC_QUEUE_SIZE];
+        req->cpu = cpu;
+        req->pc = dests[i];
+        req->cs_base = tb->cs_base;
+        req->flags = tb->flags;
+        req->cflags = cflags;
+        req->phys_pc = (tb->page_addr[0] & TARGET_PAGE_MASK) |
+                       (dests[i] & ~TARGET_PAGE_MASK);
+        req->depth = depth;
+        tb_spec.count++;
+        tb_spec.stats.queued++;
+    }
+    qemu_cond_broadcast(&tb_spec.cond);
+    qemu_mutex_unlock(&tb_spec.lock);
+}
+
+void tb_spec_dump_info(GString *buf)
+{
+    TBSpecStats s;
+    size_t translated, used;
+
+    if (!tb_spec_enabled) {
+        return;
+    }
+
+    qemu_mutex_lock(&tb_spec.lock);
+    s = tb_spec.stats;
+    qemu_mutex_unlock(&tb_spec.lock);
+    translated = qatomic_read(&tb_ctx.tb_spec_count);
+    used = qatomic_read(&tb_ctx.tb_spec_used);
+
+    g_string_append_printf(buf, "\nSpeculative translation (%u threads):\n",
+                           tb_spec.nb_threads);
+    g_string_append_printf(buf, "requests            %zu (%zu dropped)\n",
+                           s.queued, s.dropped);
+    g_string_append_printf(buf, "already translated  %zu\n", s.present);
+    g_string_append_printf(buf, "abandoned           %zu\n", s.aborted);
+    g_string_append_printf(buf, "translated          %zu\n", translated);
+    g_string_append_printf(buf, "  useful            %zu (%zu%%)\n", used,
+                           translated ? (used * 100) / translated : 0);
+    g_string_append_printf(buf, "  wasted            %zu\n",
+                           translated - MIN(used, translated));
+}
@@ -35,6 +35,7 @@
 
 #include "tcg-accel-ops.h"
 #include "tcg-accel-ops-mttcg.h"
+#include "internal.h"
 
 typedef struct MttcgForceRcuNotifier {
     Notifier notifier;
@@ -84,6 +85,9 @@ static void *mttcg_cpu_thread_fn(void *arg)
     cpu->thread_id = qemu_get_thread_id();
     cpu->can_do_io = 1;
     current_cpu = cpu;
+    if (tcg_affinity_enabled) {
+        tcg_affinity_pin_vcpu(cpu);
+    }
     cpu_thread_signal_created(cpu);
     qemu_guest_random_seed_thread_part2(cpu->random_seed);
 
@@ -95,6 +99,9 @@ static void *mttcg_cpu_thread_fn(void *arg)
             int r;
             qemu_mutex_unlock_iothread();
             r = tcg_cpus_exec(cpu);
+            if (tcg_affinity_enabled) {
+                tcg_affinity_sample();
+            }
             qemu_mutex_lock_iothread();
             switch (r) {
             case EXCP_DEBUG:
@@ -122,7 +129,11 @@ static void *mttcg_cpu_thread_fn(void *arg)
         }
 
         qatomic_mb_set(&cpu->exit_request, 0);
-        qemu_wait_io_event(cpu);
+        if (tcg_halt_poll_max_ns) {
+            tcg_halt_poll_wait(cpu);
+        } else {
+            qemu_wait_io_event(cpu);
+        }
     } while (!cpu->unplug || cpu_can_run(cpu));
 
     tcg_cpus_destroy(cpu);
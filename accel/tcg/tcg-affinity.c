@@ -0,0 +1,297 @@
+/*
+ * Host placement of TCG threads
+ *
+ * The vCPUs of a guest cluster share translated code, TLB flushes and,
+ * usually, the data the guest works on.  When their threads run on
+ * different host sockets, all of that bounces across the interconnect.
+ * Host CPUs are therefore split into domains that share a last level
+ * cache (or a package, when the cache topology is not known), and each
+ * vCPU thread is pinned to the domain its guest cluster is assigned to.
+ * The scheduler remains free to balance threads within a domain.  The
+ * main loop and the helper threads it starts stay on the first domain,
+ * the speculative translators are spread over all of them.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/thread.h"
+#include "hw/boards.h"
+#include "hw/core/tcg-cpu-ops.h"
+#include "exec/exec-all.h"
+#include "internal.h"
+
+#ifdef CONFIG_LINUX
+#include <sched.h>
+
+typedef struct TCGThreadPlacement {
+    char name[16];
+    int domain;
+    /* written by the thread itself, read by "info jit" */
+    int host_cpu;
+    size_t migrations;
+} TCGThreadPlacement;
+
+static struct {
+    QemuMutex lock;
+    cpu_set_t *domains;
+    int nb_domains;
+    /* guest clusters in start order; the i-th goes to domain i % n */
+    GArray *clusters;
+    GPtrArray *threads;
+} tcg_affinity;
+
+bool tcg_affinity_enabled;
+static __thread TCGThreadPlacement *tcg_thread_placement;
+
+/* Parse a sysfs cpu list such as "0-3,8-11" into @set. */
+static bool tcg_affinity_parse_list(const char *path, cpu_set_t *set)
+{
+    g_autofree char *buf = NULL;
+    char *p;
+    unsigned long first, last;
+
+    if (!g_file_get_contents(path, &buf, NULL, NULL)) {
+        return false;
+    }
+    CPU_ZERO(set);
+    for (p = buf; *p && *p != '\n'; p++) {
+        first = last = strtoul(p, &p, 10);
+        if (*p == '-') {
+            last = strtoul(p + 1, &p, 10);
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, set);
+        }
+        if (*p != ',') {
+            break;
+        }
+    }
+    return CPU_COUNT(set) != 0;
+}
+
+/* The host CPUs that share the last level cache, or else the package. */
+static bool tcg_affinity_host_domain(int cpu, cpu_set_t *set)
+{
+    g_autofree char *path = NULL;
+    g_autofree char *level = NULL;
+    int i;
+
+    for (i = 0; ; i++) {
+        g_free(path);
+        path = g_strdup_printf("/sys/devices/system/cpu/cpu%d/cache/"
+                               "index%d/level", cpu, i);
+        g_free(level);
+        level = NULL;
+        if (!g_file_get_contents(path, &level, NULL, NULL)) {
+            break;
+        }
+        if (atoi(level) == 3) {
+            g_free(path);
+            path = g_strdup_printf("/sys/devices/system/cpu/cpu%d/cache/"
+                                   "index%d/shared_cpu_list", cpu, i);
+            return tcg_affinity_parse_list(path, set);
+        }
+    }
+
+    g_free(path);
+    path = g_strdup_printf("/sys/devices/system/cpu/cpu%d/topology/"
+                           "core_siblings_list", cpu);
+    return tcg_affinity_parse_list(path, set);
+}
+
+static void tcg_affinity_pin(TCGThreadPlacement *t, int domain)
+{
+    t->domain = domain;
+    if (sched_setaffinity(0, sizeof(cpu_set_t),
+                          &tcg_affinity.domains[domain]) < 0) {
+        warn_report("pin-threads: cannot pin thread '%s': %s",
+                    t->name, strerror(errno));
+    }
+    t->host_cpu = sched_getcpu();
+
+    qemu_mutex_lock(&tcg_affinity.lock);
+    g_ptr_array_add(tcg_affinity.threads, t);
+    qemu_mutex_unlock(&tcg_affinity.lock);
+    tcg_thread_placement = t;
+}
+
+void tcg_affinity_init(void)
+{
+    cpu_set_t allowed, set, done;
+    TCGThreadPlacement *t;
+    int cpu, d;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        warn_report("pin-threads: cannot read the host CPUs, disabling it");
+        return;
+    }
+
+    qemu_mutex_init(&tcg_affinity.lock);
+    tcg_affinity.domains = g_new(cpu_set_t, CPU_COUNT(&allowed));
+    tcg_affinity.clusters = g_array_new(false, false, sizeof(int64_t));
+    tcg_affinity.threads = g_ptr_array_new();
+
+    CPU_ZERO(&done);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || CPU_ISSET(cpu, &done)) {
+            continue;
+        }
+        if (!tcg_affinity_host_domain(cpu, &set)) {
+            CPU_ZERO(&set);
+        }
+        CPU_AND(&set, &set, &allowed);
+        CPU_SET(cpu, &set);
+        CPU_OR(&done, &done, &set);
+        d = tcg_affinity.nb_domains++;
+        tcg_affinity.domains[d] = set;
+    }
+    tcg_affinity_enabled = true;
+
+    t = g_new0(TCGThreadPlacement, 1);
+    pstrcpy(t->name, sizeof(t->name), "main");
+    tcg_affinity_pin(t, 0);
+}
+
+/*
+ * The guest cluster of @cpu: what the target reports, or else the
+ * CPUs counted by -smp cores and threads.
+ */
+static int64_t tcg_affinity_cluster(CPUState *cpu)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    unsigned per_cluster = current_machine->smp.cores *
+                           current_machine->smp.threads;
+
+    if (cc->tcg_ops->topology_cluster) {
+        return cc->tcg_ops->topology_cluster(cpu);
+    }
+    return cpu->cpu_index / MAX(per_cluster, 1);
+}
+
+/* Called by the vCPU thread of @cpu when it starts. */
+void tcg_affinity_pin_vcpu(CPUState *cpu)
+{
+    TCGThreadPlacement *t = g_new0(TCGThreadPlacement, 1);
+    int64_t cluster = tcg_affinity_cluster(cpu);
+    guint i;
+
+    qemu_mutex_lock(&tcg_affinity.lock);
+    for (i = 0; i < tcg_affinity.clusters->len; i++) {
+        if (g_array_index(tcg_affinity.clusters, int64_t, i) == cluster) {
+            break;
+        }
+    }
+    if (i == tcg_affinity.clusters->len) {
+        g_array_append_val(tcg_affinity.clusters, cluster);
+    }
+    qemu_mutex_unlock(&tcg_affinity.lock);
+
+    snprintf(t->name, sizeof(t->name), "CPU %d/TCG", cpu->cpu_index);
+    tcg_affinity_pin(t, i % tcg_affinity.nb_domains);
+}
+
+/* Called by helper thread @n, named @name, when it starts. */
+void tcg_affinity_pin_helper(const char *name, unsigned n)
+{
+    TCGThreadPlacement *t = g_new0(TCGThreadPlacement, 1);
+
+    pstrcpy(t->name, sizeof(t->name), name);
+    tcg_affinity_pin(t, n % tcg_affinity.nb_domains);
+}
+
+/* Count the moves of the calling thread to another host CPU. */
+void tcg_affinity_sample(void)
+{
+    TCGThreadPlacement *t = tcg_thread_placement;
+    int host_cpu;
+
+    if (t) {
+        host_cpu = sched_getcpu();
+        if (host_cpu != t->host_cpu) {
+            qatomic_set(&t->host_cpu, host_cpu);
+            qatomic_set(&t->migrations, t->migrations + 1);
+        }
+    }
+}
+
+static void tcg_affinity_format(GString *buf, const cpu_set_t *set)
+{
+    const char *sep = "";
+    int first, last;
+
+    for (first = 0; first < CPU_SETSIZE; first = last + 1) {
+        if (!CPU_ISSET(first, set)) {
+            last = first;
+            continue;
+        }
+        for (last = first; last + 1 < CPU_SETSIZE &&
+             CPU_ISSET(last + 1, set); last++) {
+            continue;
+        }
+        if (first == last) {
+            g_string_append_printf(buf, "%s%d", sep, first);
+        } else {
+            g_string_append_printf(buf, "%s%d-%d", sep, first, last);
+        }
+        sep = ",";
+    }
+}
+
+void tcg_affinity_dump_info(GString *buf)
+{
+    TCGThreadPlacement *t;
+    guint i;
+    int d;
+
+    if (!tcg_affinity_enabled) {
+        return;
+    }
+
+    g_string_append_printf(buf, "\nThread placement:\n");
+    for (d = 0; d < tcg_affinity.nb_domains; d++) {
+        g_string_append_printf(buf, "domain %-3d host cpus ", d);
+        tcg_affinity_format(buf, &tcg_affinity.domains[d]);
+        g_string_append_c(buf, '\n');
+    }
+
+    qemu_mutex_lock(&tcg_affinity.lock);
+    for (i = 0; i < tcg_affinity.threads->len; i++) {
+        t = g_ptr_array_index(tcg_affinity.threads, i);
+        g_string_append_printf(buf, "%-15s domain %-3d host cpu %-4d "
+                               "%zu migrations\n",
+                               t->name, t->domain,
+                               qatomic_read(&t->host_cpu),
+                               qatomic_read(&t->migrations));
+    }
+    qemu_mutex_unlock(&tcg_affinity.lock);
+}
+
+#else /* !CONFIG_LINUX */
+
+bool tcg_affinity_enabled;
+
+void tcg_affinity_init(void)
+{
+    warn_report("pin-threads is not supported on this host, disabling it");
+}
+
+void tcg_affinity_pin_vcpu(CPUState *cpu)
+{
+}
+
+void tcg_affinity_pin_helper(const char *name, unsigned n)
+{
+}
+
+void tcg_affinity_sample(void)
+{
+}
+
+void tcg_affinity_dump_info(GString *buf)
+{
+}
+
+#endif /* CONFIG_LINUX */
@@ -43,6 +43,16 @@ struct TCGState {
     bool mttcg_enabled;
     int splitwx_enabled;
     unsigned long tb_size;
+    uint32_t hot_threshold;
+    uint32_t spin_threshold;
+    bool ras_enabled;
+    char *tb_cache;
+    uint32_t spec_threads;
+    uint32_t smc_threshold;
+    uint32_t tlb_tags;
+    bool tlb_shared;
+    bool pin_threads;
+    uint32_t halt_poll_ns;
 };
 typedef struct TCGState TCGState;
 
@@ -98,6 +108,7 @@ static void tcg_accel_instance_init(Object *obj)
     TCGState *s = TCG_STATE(obj);
 
     s->mttcg_enabled = default_mttcg_enabled();
+    s->ras_enabled = true;
 
     /* If debugging enabled, default "auto on", otherwise off. */
 #if defined(CONFIG_DEBUG_TCG) && !defined(CONFIG_USER_ONLY)
@@ -108,6 +119,9 @@ static void tcg_accel_instance_init(Object *obj)
 }
 
 bool mttcg_enabled;
+uint32_t tb_hot_threshold;
+bool tb_ras_enabled;
+uint32_t tb_spin_threshold;
 
 static int tcg_init_machine(MachineState *ms)
 {
@@ -120,6 +134,40 @@ static int tcg_init_machine(MachineState *ms)
 
     tcg_allowed = true;
     mttcg_enabled = s->mttcg_enabled;
+    tb_hot_threshold = s->hot_threshold;
+    tb_ras_enabled = s->ras_enabled;
+    tb_spin_threshold = s->spin_threshold;
+
+#if !defined(CONFIG_USER_ONLY)
+    if (s->spec_threads && !mttcg_enabled) {
+        warn_report("spec-translate requires thread=multi, disabling it");
+        s->spec_threads = 0;
+    }
+    /* Each translator thread needs its own TCGContext and region. */
+    max_cpus += s->spec_threads;
+    tlb_tag_sets = s->tlb_tags;
+#ifdef TARGET_HAS_PRECISE_SMC
+    if (s->smc_threshold) {
+        warn_report("smc-threshold is not supported by this target, "
+                    "disabling it");
+        s->smc_threshold = 0;
+    }
+#endif
+    tb_smc_threshold = s->smc_threshold;
+    if (s->tlb_shared && !s->tlb_tags) {
+        warn_report("tlb-shared requires tlb-tags, disabling it");
+        s->tlb_shared = false;
+    }
+    if (s->pin_threads && !mttcg_enabled) {
+        warn_report("pin-threads requires thread=multi, disabling it");
+        s->pin_threads = false;
+    }
+    if (s->halt_poll_ns && !mttcg_enabled) {
+        warn_report("halt-poll-ns requires thread=multi, disabling it");
+        s->halt_poll_ns = 0;
+    }
+    tcg_halt_poll_max_ns = s->halt_poll_ns;
+#endif
 
     page_init();
     tb_htable_init();
@@ -131,6 +179,20 @@ static int tcg_init_machine(MachineState *ms)
      * initialize the prologue now.
      */
     tcg_prologue_init(tcg_ctx);
+
+    /* Before starting any thread, so that they start on the first domain */
+    if (s->pin_threads) {
+        tcg_affinity_init();
+    }
+    if (s->tb_cache) {
+        tb_cache_init(s->tb_cache);
+    }
+    if (s->spec_threads) {
+        tb_spec_init(s->spec_threads);
+    }
+    if (s->tlb_shared) {
+        tlb_shared_init();
+    }
 #endif
 
     return 0;
@@ -195,6 +257,70 @@ static void tcg_set_tb_size(Object *obj, Visitor *v,
     s->tb_size = value;
 }
 
+static void tcg_get_hot_threshold(Object *obj, Visitor *v,
+                                  const char *name, void *opaque,
+                                  Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->hot_threshold;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_hot_threshold(Object *obj, Visitor *v,
+                                  const char *name, void *opaque,
+                                  Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value > INT32_MAX) {
+        error_setg(errp, "hot-threshold must be at most %d", INT32_MAX);
+        return;
+    }
+
+    s->hot_threshold = value;
+}
+
+static void tcg_get_spin_threshold(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->spin_threshold;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_spin_threshold(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+
+    s->spin_threshold = value;
+}
+
+static bool tcg_get_return_stack(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->ras_enabled;
+}
+
+static void tcg_set_return_stack(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->ras_enabled = value;
+}
+
 static bool tcg_get_splitwx(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -207,6 +333,155 @@ static void tcg_set_splitwx(Object *obj, bool value, Error **errp)
     s->splitwx_enabled = value;
 }
 
+#if !defined(CONFIG_USER_ONLY)
+static char *tcg_get_tb_cache(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    return g_strdup(s->tb_cache);
+}
+
+static void tcg_set_tb_cache(Object *obj, const char *value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    g_free(s->tb_cache);
+    s->tb_cache = g_strdup(value);
+}
+
+static void tcg_get_spec_translate(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->spec_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_spec_translate(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value > 64) {
+        error_setg(errp, "spec-translate must be at most 64");
+        return;
+    }
+
+    s->spec_threads = value;
+}
+
+static void tcg_get_smc_threshold(Object *obj, Visitor *v,
+                                  const char *name, void *opaque,
+                                  Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->smc_threshold;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_smc_threshold(Object *obj, Visitor *v,
+                                  const char *name, void *opaque,
+                                  Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+
+    s->smc_threshold = value;
+}
+
+static void tcg_get_tlb_tags(Object *obj, Visitor *v,
+                             const char *name, void *opaque,
+                             Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->tlb_tags;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_tlb_tags(Object *obj, Visitor *v,
+                             const char *name, void *opaque,
+                             Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value > 16) {
+        error_setg(errp, "tlb-tags must be at most 16");
+        return;
+    }
+
+    s->tlb_tags = value;
+}
+
+static bool tcg_get_tlb_shared(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->tlb_shared;
+}
+
+static void tcg_set_tlb_shared(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->tlb_shared = value;
+}
+
+static bool tcg_get_pin_threads(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    return s->pin_threads;
+}
+
+static void tcg_set_pin_threads(Object *obj, bool value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    s->pin_threads = value;
+}
+
+static void tcg_get_halt_poll_ns(Object *obj, Visitor *v,
+                                 const char *name, void *opaque,
+                                 Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->halt_poll_ns;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_halt_poll_ns(Object *obj, Visitor *v,
+                                 const char *name, void *opaque,
+                                 Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value > 1000000000) {
+        error_setg(errp, "halt-poll-ns must be at most one second");
+        return;
+    }
+
+    s->halt_poll_ns = value;
+}
+#endif
+
 static void tcg_accel_class_init(ObjectClass *oc, void *data)
 {
     AccelClass *ac = ACCEL_CLASS(oc);
@@ -224,10 +499,76 @@ static void tcg_accel_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "tb-size",
         "TCG translation block cache size");
 
+    object_class_property_add(oc, "hot-threshold", "int",
+        tcg_get_hot_threshold, tcg_set_hot_threshold,
+        NULL, NULL);
+    object_class_property_set_description(oc, "hot-threshold",
+        "Executions after which a TB is retranslated with more "
+        "optimization (0 disables)");
+
+    object_class_property_add(oc, "spin-threshold", "int",
+        tcg_get_spin_threshold, tcg_set_spin_threshold,
+        NULL, NULL);
+    object_class_property_set_description(oc, "spin-threshold",
+        "Iterations of a guest spin loop after which the vCPU thread "
+        "yields (0 disables)");
+
+    object_class_property_add_bool(oc, "return-stack",
+        tcg_get_return_stack, tcg_set_return_stack);
+    object_class_property_set_description(oc, "return-stack",
+        "Predict guest function returns with a return address stack");
+
     object_class_property_add_bool(oc, "split-wx",
         tcg_get_splitwx, tcg_set_splitwx);
     object_class_property_set_description(oc, "split-wx",
         "Map jit pages into separate RW and RX regions");
+
+#if !defined(CONFIG_USER_ONLY)
+    object_class_property_add_str(oc, "tb-cache",
+                                  tcg_get_tb_cache,
+                                  tcg_set_tb_cache);
+    object_class_property_set_description(oc, "tb-cache",
+        "File recording translated blocks across runs (see 'info jit')");
+
+    object_class_property_add(oc, "spec-translate", "int",
+        tcg_get_spec_translate, tcg_set_spec_translate,
+        NULL, NULL);
+    object_class_property_set_description(oc, "spec-translate",
+        "Number of threads translating jump targets ahead of time "
+        "(0 disables)");
+
+    object_class_property_add(oc, "smc-threshold", "int",
+        tcg_get_smc_threshold, tcg_set_smc_threshold,
+        NULL, NULL);
+    object_class_property_set_description(oc, "smc-threshold",
+        "Writes missing the code of a page after which its blocks check "
+        "their code instead of write protecting it (0 disables)");
+
+    object_class_property_add(oc, "tlb-tags", "int",
+        tcg_get_tlb_tags, tcg_set_tlb_tags,
+        NULL, NULL);
+    object_class_property_set_description(oc, "tlb-tags",
+        "Number of guest address spaces whose TLB entries are kept "
+        "across switches, per MMU mode (0 disables)");
+
+    object_class_property_add_bool(oc, "tlb-shared",
+        tcg_get_tlb_shared, tcg_set_tlb_shared);
+    object_class_property_set_description(oc, "tlb-shared",
+        "Share the TLB entries of tagged address spaces between vCPUs");
+
+    object_class_property_add_bool(oc, "pin-threads",
+        tcg_get_pin_threads, tcg_set_pin_threads);
+    object_class_property_set_description(oc, "pin-threads",
+        "Pin the vCPU threads of each guest cluster to one host cache "
+        "domain");
+
+    object_class_property_add(oc, "halt-poll-ns", "int",
+        tcg_get_halt_poll_ns, tcg_set_halt_poll_ns,
+        NULL, NULL);
+    object_class_property_set_description(oc, "halt-poll-ns",
+        "Maximum time a halted vCPU polls for work before sleeping "
+        "(0 disables)");
+#endif
 }
 
 static const TypeInfo tcg_accel_type = {
@@ -0,0 +1,139 @@
+/*
+ * Halt polling for TCG vCPU threads
+ *
+ * A halted vCPU thread sleeps on its halt condition variable, so the
+ * interrupt that ends the halt pays for a futex wakeup and a reschedule
+ * of the thread before the guest runs again.  When halts are short, as
+ * with a guest waiting a few microseconds for a reply, the thread does
+ * better to poll for work for a while before it goes to sleep.  Like KVM
+ * halt polling, the window is adapted per vCPU to the halt times seen:
+ * it grows while halts end after the window but within the maximum, and
+ * shrinks when a halt lasts longer than the maximum.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "sysemu/cpus.h"
+#include "exec/exec-all.h"
+#include "internal.h"
+
+/* First window after a halt that polling would have caught */
+#define TCG_HALT_POLL_START_NS  (2 * SCALE_US)
+
+uint32_t tcg_halt_poll_max_ns;
+
+static void tcg_halt_poll_grow(CPUState *cpu)
+{
+    uint64_t ns = cpu->halt_poll_ns ? (uint64_t)cpu->halt_poll_ns * 2
+                                    : TCG_HALT_POLL_START_NS;
+
+    qatomic_set(&cpu->halt_poll_ns, MIN(ns, tcg_halt_poll_max_ns));
+    cpu->halt_poll_stats.grows++;
+}
+
+static void tcg_halt_poll_shrink(CPUState *cpu)
+{
+    uint32_t ns = cpu->halt_poll_ns / 2;
+
+    qatomic_set(&cpu->halt_poll_ns, ns < TCG_HALT_POLL_START_NS ? 0 : ns);
+    cpu->halt_poll_stats.shrinks++;
+}
+
+/*
+ * Poll for work with the BQL released, for up to the window of @cpu.
+ * Return true if the vCPU has something to do.
+ */
+static bool tcg_halt_poll_spin(CPUState *cpu, int64_t start)
+{
+    int64_t deadline = start + cpu->halt_poll_ns;
+    bool woken = false;
+
+    qemu_mutex_unlock_iothread();
+    do {
+        if (!cpu_thread_is_idle(cpu)) {
+            woken = true;
+            break;
+        }
+        cpu_relax();
+    } while (get_clock() < deadline);
+    qemu_mutex_lock_iothread();
+
+    return woken || !cpu_thread_is_idle(cpu);
+}
+
+/*
+ * Called by the vCPU thread in place of qemu_wait_io_event(), with the
+ * BQL held.
+ */
+void tcg_halt_poll_wait(CPUState *cpu)
+{
+    TCGHaltPollStats *s = &cpu->halt_poll_stats;
+    int64_t start, halt_ns;
+    bool polled;
+
+    if (!cpu->halted || !cpu_thread_is_idle(cpu)) {
+        qemu_wait_io_event(cpu);
+        return;
+    }
+
+    start = get_clock();
+    polled = cpu->halt_poll_ns && tcg_halt_poll_spin(cpu, start);
+    /* Does not sleep if polling found work. */
+    qemu_wait_io_event(cpu);
+    halt_ns = get_clock() - start;
+    if (polled) {
+        s->poll_hits++;
+        s->poll_hit_ns += halt_ns;
+    } else {
+        s->sleeps++;
+        s->sleep_ns += halt_ns;
+        s->wasted_poll_ns += cpu->halt_poll_ns;
+    }
+
+    if (halt_ns <= cpu->halt_poll_ns) {
+        return;
+    } else if (cpu->halt_poll_ns && halt_ns > tcg_halt_poll_max_ns) {
+        tcg_halt_poll_shrink(cpu);
+    } else if (cpu->halt_poll_ns < tcg_halt_poll_max_ns &&
+               halt_ns < tcg_halt_poll_max_ns) {
+        tcg_halt_poll_grow(cpu);
+    }
+}
+
+void tcg_halt_poll_dump_info(GString *buf)
+{
+    CPUState *cpu;
+
+    if (!tcg_halt_poll_max_ns) {
+        return;
+    }
+
+    g_string_append_printf(buf, "\nHalt polling (max %u ns):\n",
+                           tcg_halt_poll_max_ns);
+    CPU_FOREACH(cpu) {
+        TCGHaltPollStats *s = &cpu->halt_poll_stats;
+        uint64_t halts = s->poll_hits + s->sleeps;
+
+        g_string_append_printf(buf, "cpu %-3d window %u ns, "
+                               "%" PRIu64 " halts, %" PRIu64 " polled "
+                               "(%0.1f%%, avg %" PRId64 " ns), "
+                               "%" PRIu64 " slept (avg %" PRId64 " us), "
+                               "%" PRId64 " us polled in vain, "
+                               "%" PRIu64 " grows, %" PRIu64 " shrinks\n",
+                               cpu->cpu_index,
+                               qatomic_read(&cpu->halt_poll_ns), halts,
+                               s->poll_hits,
+                               halts ? (double)s->poll_hits * 100 / halts
+                               : 0,
+                               s->poll_hits ? s->poll_hit_ns / s->poll_hits
+                               : 0,
+                               s->sleeps,
+                               s->sleeps ? s->sleep_ns / s->sleeps / SCALE_US
+                               : 0,
+                               s->wasted_poll_ns / SCALE_US,
+                               s->grows, s->shrinks);
+    }
+}
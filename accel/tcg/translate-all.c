@@ -52,13 +52,15 @@
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
 #include "qemu/cacheinfo.h"
+#include "qemu/units.h"
 #include "exec/log.h"
 #include "sysemu/cpus.h"
 #include "sysemu/cpu-timers.h"
 #include "sysemu/tcg.h"
 #include "qapi/error.h"
 #include "hw/core/tcg-cpu-ops.h"
-#include "tb-hash.h"
+#include "exec/helper-proto.h"
+#include "tb-jmp-cache.h"
 #include "tb-context.h"
 #include "internal.h"
 
@@ -112,6 +114,10 @@ typedef struct PageDesc {
        of lookups we do to a given page to use a bitmap */
     unsigned long *code_bitmap;
     unsigned int code_write_count;
+    /* writes that missed the code of the page since it was protected */
+    unsigned int smc_clean_writes;
+    /* not write protected, the TBs of the page check their code instead */
+    bool self_check;
 #else
     unsigned long flags;
     void *target_data;
@@ -140,20 +146,26 @@ struct page_entry {
     bool locked;
 };
 
+#define PAGE_COLLECTION_INLINE 8
+
 /**
  * struct page_collection - tracks a set of pages (i.e. &struct page_entry's)
- * @tree:   Binary search tree (BST) of the pages, with key == page index
- * @max:    Pointer to the page in @tree with the highest page index
+ * @entries:    The pages, sorted by page index, while there are at most
+ *              %PAGE_COLLECTION_INLINE of them
+ * @nb_entries: Number of pages in @entries
+ * @tree:       Binary search tree (BST) of the pages, with key == page index,
+ *              used instead of @entries once the set outgrows it
+ * @max:        The highest page index in the set, or -1 if it is empty
+ * @on_heap:    Whether the collection was allocated with g_malloc()
  *
  * To avoid deadlock we lock pages in ascending order of page index.
  * When operating on a set of pages, we need to keep track of them so that
  * we can lock them in order and also unlock them later. For this we collect
- * pages (i.e. &struct page_entry's) in a binary search @tree. Given that the
- * @tree implementation we use does not provide an O(1) operation to obtain the
- * highest-ranked element, we use @max to keep track of the inserted page
- * with the highest index. This is valuable because if a page is not in
- * the tree and its index is higher than @max's, then we can lock it
- * without breaking the locking order rule.
+ * pages (i.e. &struct page_entry's) in a sorted array, which is enough for
+ * the few pages of most invalidations, or else in a binary search @tree.
+ * We keep track of the highest page index in @max.  This is valuable
+ * because if a page is not in the set and its index is higher than @max,
+ * then we can lock it without breaking the locking order rule.
  *
  * Note on naming: 'struct page_set' would be shorter, but we already have a few
  * page_set_*() helpers, so page_collection is used instead to avoid confusion.
@@ -161,8 +173,11 @@ struct page_entry {
  * See also: page_collection_lock().
  */
 struct page_collection {
+    struct page_entry entries[PAGE_COLLECTION_INLINE];
+    int nb_entries;
     GTree *tree;
-    struct page_entry *max;
+    tb_page_addr_t max;
+    bool on_heap;
 };
 
 /* list iterators for lists of tagged pointers in TranslationBlock */
@@ -219,6 +234,22 @@ static int v_l2_levels;
 
 static void *l1_map[V_L1_MAX_SIZE];
 
+/*
+ * The bottom level arrays of l1_map that this thread used last, indexed
+ * by the low bits of (page index >> V_L2_BITS).  They are never freed,
+ * so that page_find() needs a single compare when it hits here instead
+ * of walking all levels.
+ */
+#define PAGE_LEAF_CACHE_BITS 3
+#define PAGE_LEAF_CACHE_SIZE (1 << PAGE_LEAF_CACHE_BITS)
+
+typedef struct PageLeafCacheEntry {
+    tb_page_addr_t key;
+    PageDesc *leaf;
+} PageLeafCacheEntry;
+
+static __thread PageLeafCacheEntry page_leaf_cache[PAGE_LEAF_CACHE_SIZE];
+
 TBContext tb_ctx;
 
 static void page_table_config_init(void)
@@ -474,10 +505,17 @@ void page_init(void)
 
 static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
 {
+    tb_page_addr_t key = index >> V_L2_BITS;
+    PageLeafCacheEntry *e =
+        &page_leaf_cache[key & (PAGE_LEAF_CACHE_SIZE - 1)];
     PageDesc *pd;
     void **lp;
     int i;
 
+    if (likely(e->leaf && e->key == key)) {
+        return e->leaf + (index & (V_L2_SIZE - 1));
+    }
+
     /* Level 1.  Always allocated.  */
     lp = l1_map + ((index >> v_l1_shift) & (v_l1_size - 1));
 
@@ -535,6 +573,8 @@ static PageDesc *page_find_alloc(tb_page_addr_t index, int alloc)
         }
     }
 
+    e->key = key;
+    e->leaf = pd;
     return pd + (index & (V_L2_SIZE - 1));
 }
 
@@ -735,6 +775,89 @@ static gboolean page_entry_unlock(gpointer key, gpointer value, gpointer data)
     return FALSE;
 }
 
+static gint tb_page_addr_cmp(gconstpointer ap, gconstpointer bp, gpointer udata)
+{
+    tb_page_addr_t a = *(const tb_page_addr_t *)ap;
+    tb_page_addr_t b = *(const tb_page_addr_t *)bp;
+
+    if (a == b) {
+        return 0;
+    } else if (a < b) {
+        return -1;
+    }
+    return 1;
+}
+
+static struct page_entry *
+page_collection_find(struct page_collection *set, tb_page_addr_t index)
+{
+    int i;
+
+    if (set->tree) {
+        return g_tree_lookup(set->tree, &index);
+    }
+    for (i = 0; i < set->nb_entries; i++) {
+        if (set->entries[i].index == index) {
+            return &set->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Add the unlocked page @pd to @set.  The returned entry is only valid
+ * until the next addition.
+ */
+static struct page_entry *
+page_collection_add(struct page_collection *set, PageDesc *pd,
+                    tb_page_addr_t index)
+{
+    struct page_entry *pe;
+    int i;
+
+    if (!set->tree && set->nb_entries == PAGE_COLLECTION_INLINE) {
+        set->tree = g_tree_new_full(tb_page_addr_cmp, NULL, NULL,
+                                    page_entry_destroy);
+        for (i = 0; i < set->nb_entries; i++) {
+            pe = page_entry_new(set->entries[i].pd, set->entries[i].index);
+            pe->locked = set->entries[i].locked;
+            g_tree_insert(set->tree, &pe->index, pe);
+        }
+    }
+    if (set->tree) {
+        pe = page_entry_new(pd, index);
+        g_tree_insert(set->tree, &pe->index, pe);
+        return pe;
+    }
+
+    /* Keep the array sorted, to lock it in order like the tree. */
+    for (i = set->nb_entries; i > 0 && set->entries[i - 1].index > index;
+         i--) {
+        set->entries[i] = set->entries[i - 1];
+    }
+    pe = &set->entries[i];
+    pe->pd = pd;
+    pe->index = index;
+    pe->locked = false;
+    set->nb_entries++;
+    return pe;
+}
+
+/* Call @func on the pages of @set in ascending order of page index. */
+static void page_collection_foreach(struct page_collection *set,
+                                    GTraverseFunc func)
+{
+    int i;
+
+    if (set->tree) {
+        g_tree_foreach(set->tree, func, NULL);
+        return;
+    }
+    for (i = 0; i < set->nb_entries; i++) {
+        func(&set->entries[i].index, &set->entries[i], NULL);
+    }
+}
+
 /*
  * Trylock a page, and if successful, add the page to a collection.
  * Returns true ("busy") if the page could not be locked; false otherwise.
@@ -745,7 +868,7 @@ static bool page_trylock_add(struct page_collection *set, tb_page_addr_t addr)
     struct page_entry *pe;
     PageDesc *pd;
 
-    pe = g_tree_lookup(set->tree, &index);
+    pe = page_collection_find(set, index);
     if (pe) {
         return false;
     }
@@ -755,15 +878,14 @@ static bool page_trylock_add(struct page_collection *set, tb_page_addr_t addr)
         return false;
     }
 
-    pe = page_entry_new(pd, index);
-    g_tree_insert(set->tree, &pe->index, pe);
+    pe = page_collection_add(set, pd, index);
 
     /*
      * If this is either (1) the first insertion or (2) a page whose index
      * is higher than any other so far, just lock the page and move on.
      */
-    if (set->max == NULL || pe->index > set->max->index) {
-        set->max = pe;
+    if (set->max == -1 || index > set->max) {
+        set->max = index;
         do_page_entry_lock(pe);
         return false;
     }
@@ -774,18 +896,9 @@ static bool page_trylock_add(struct page_collection *set, tb_page_addr_t addr)
     return page_entry_trylock(pe);
 }
 
-static gint tb_page_addr_cmp(gconstpointer ap, gconstpointer bp, gpointer udata)
-{
-    tb_page_addr_t a = *(const tb_page_addr_t *)ap;
-    tb_page_addr_t b = *(const tb_page_addr_t *)bp;
-
-    if (a == b) {
-        return 0;
-    } else if (a < b) {
-        return -1;
-    }
-    return 1;
-}
+/* Collection used by this thread, unless it is already in use */
+static __thread struct page_collection page_collection_local;
+static __thread bool page_collection_local_busy;
 
 /*
  * Lock a range of pages ([@start,@end[) as well as the pages of all
@@ -795,7 +908,7 @@ static gint tb_page_addr_cmp(gconstpointer ap, gconstpointer bp, gpointer udata)
 struct page_collection *
 page_collection_lock(tb_page_addr_t start, tb_page_addr_t end)
 {
-    struct page_collection *set = g_malloc(sizeof(*set));
+    struct page_collection *set;
     tb_page_addr_t index;
     PageDesc *pd;
 
@@ -803,13 +916,21 @@ page_collection_lock(tb_page_addr_t start, tb_page_addr_t end)
     end   >>= TARGET_PAGE_BITS;
     g_assert(start <= end);
 
-    set->tree = g_tree_new_full(tb_page_addr_cmp, NULL, NULL,
-                                page_entry_destroy);
-    set->max = NULL;
+    if (likely(!page_collection_local_busy)) {
+        page_collection_local_busy = true;
+        set = &page_collection_local;
+        set->on_heap = false;
+    } else {
+        set = g_new(struct page_collection, 1);
+        set->on_heap = true;
+    }
+    set->nb_entries = 0;
+    set->tree = NULL;
+    set->max = -1;
     assert_no_pages_locked();
 
  retry:
-    g_tree_foreach(set->tree, page_entry_lock, NULL);
+    page_collection_foreach(set, page_entry_lock);
 
     for (index = start; index <= end; index++) {
         TranslationBlock *tb;
@@ -820,7 +941,7 @@ page_collection_lock(tb_page_addr_t start, tb_page_addr_t end)
             continue;
         }
         if (page_trylock_add(set, index << TARGET_PAGE_BITS)) {
-            g_tree_foreach(set->tree, page_entry_unlock, NULL);
+            page_collection_foreach(set, page_entry_unlock);
             goto retry;
         }
         assert_page_locked(pd);
@@ -829,7 +950,7 @@ page_collection_lock(tb_page_addr_t start, tb_page_addr_t end)
                 (tb->page_addr[1] != -1 &&
                  page_trylock_add(set, tb->page_addr[1]))) {
                 /* drop all locks, and reacquire in order */
-                g_tree_foreach(set->tree, page_entry_unlock, NULL);
+                page_collection_foreach(set, page_entry_unlock);
                 goto retry;
             }
         }
@@ -839,9 +960,22 @@ page_collection_lock(tb_page_addr_t start, tb_page_addr_t end)
 
 void page_collection_unlock(struct page_collection *set)
 {
-    /* entries are unlocked and freed via page_entry_destroy */
-    g_tree_destroy(set->tree);
-    g_free(set);
+    int i;
+
+    if (set->tree) {
+        /* entries are unlocked and freed via page_entry_destroy */
+        g_tree_destroy(set->tree);
+    } else {
+        for (i = 0; i < set->nb_entries; i++) {
+            g_assert(set->entries[i].locked);
+            page_unlock(set->entries[i].pd);
+        }
+    }
+    if (set->on_heap) {
+        g_free(set);
+    } else {
+        page_collection_local_busy = false;
+    }
 }
 
 #endif /* !CONFIG_USER_ONLY */
@@ -900,11 +1034,48 @@ static bool tb_cmp(const void *ap, const void *bp)
         a->page_addr[1] == b->page_addr[1];
 }
 
+/*
+ * Hashes of the TBs evicted with their code region, so that translating
+ * the same code again can be accounted as a retranslation.
+ */
+#define TB_EVICTED_MAX (1 << 20)
+#define TB_EVICTED_FILTER_BITS (TB_EVICTED_MAX * 2)
+
+static struct {
+    QemuMutex lock;
+    GHashTable *hashes;
+    /*
+     * Bit h % TB_EVICTED_FILTER_BITS is set for every hash h in @hashes,
+     * so that translations of code that was never evicted skip the lock.
+     * Only set or cleared in the exclusive context.
+     */
+    unsigned long *filter;
+} tb_evicted;
+
+/* exclusive steps as of the previous "info jit", for the rate */
+static struct {
+    int64_t ns;
+    size_t count;
+} exclusive_steps_stamp;
+
 void tb_htable_init(void)
 {
     unsigned int mode = QHT_MODE_AUTO_RESIZE;
 
+    exclusive_steps_stamp.ns = get_clock_realtime();
+
     qht_init(&tb_ctx.htable, tb_cmp, CODE_GEN_HTABLE_SIZE, mode);
+
+    qemu_mutex_init(&tb_evicted.lock);
+    tb_evicted.hashes = g_hash_table_new(NULL, NULL);
+    tb_evicted.filter = bitmap_new(TB_EVICTED_FILTER_BITS);
+}
+
+/* call with tb_evicted.lock held */
+static void tb_evicted_reset(void)
+{
+    g_hash_table_remove_all(tb_evicted.hashes);
+    bitmap_zero(tb_evicted.filter, TB_EVICTED_FILTER_BITS);
 }
 
 /* call with @p->lock held */
@@ -933,6 +1104,10 @@ static void page_flush_tb_1(int level, void **lp)
             page_lock(&pd[i]);
             pd[i].first_tb = (uintptr_t)NULL;
             invalidate_page_bitmap(pd + i);
+#ifdef CONFIG_SOFTMMU
+            pd[i].smc_clean_writes = 0;
+            pd[i].self_check = false;
+#endif
             page_unlock(&pd[i]);
         }
     } else {
@@ -975,6 +1150,9 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
         goto done;
     }
     did_flush = true;
+#ifdef CONFIG_SOFTMMU
+    tb_spec_pause();
+#endif
 
     if (DEBUG_TB_FLUSH_GATE) {
         size_t nb_tbs = tcg_nb_tbs();
@@ -993,9 +1171,16 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
     page_flush_tb();
 
     tcg_region_reset_all();
+
+    qemu_mutex_lock(&tb_evicted.lock);
+    tb_evicted_reset();
+    qemu_mutex_unlock(&tb_evicted.lock);
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     qatomic_mb_set(&tb_ctx.tb_flush_count, tb_ctx.tb_flush_count + 1);
+#ifdef CONFIG_SOFTMMU
+    tb_spec_resume();
+#endif
 
 done:
     mmap_unlock();
@@ -1018,6 +1203,116 @@ void tb_flush(CPUState *cpu)
     }
 }
 
+static uint32_t tb_evicted_hash(const TranslationBlock *tb)
+{
+    tb_page_addr_t phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+
+    return tb_hash_func(phys_pc, tb->pc, tb->flags,
+                        tb_cflags(tb) & ~CF_INVALID, tb->trace_vcpu_dstate);
+}
+
+static gboolean tb_evict_iter(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+
+    tb_ctx.tb_evict_tbs++;
+    tb_ctx.tb_evict_bytes += tb->tc.size;
+
+    /* TBs that were invalidated before are unreachable already. */
+    if (!(tb_cflags(tb) & CF_INVALID)) {
+        uint32_t h = tb_evicted_hash(tb);
+
+        if (g_hash_table_size(tb_evicted.hashes) >= TB_EVICTED_MAX) {
+            tb_evicted_reset();
+        }
+        g_hash_table_add(tb_evicted.hashes, GUINT_TO_POINTER(h));
+        set_bit(h % TB_EVICTED_FILTER_BITS, tb_evicted.filter);
+        tb_phys_invalidate(tb, -1);
+    }
+    return false;
+}
+
+/*
+ * Make room in code_gen_buffer by evicting the oldest code region, or
+ * by flushing everything if no region can be evicted.
+ */
+static void do_tb_evict(CPUState *cpu, run_on_cpu_data tb_reclaim_count)
+{
+    CPUState *other;
+    bool evicted;
+
+    mmap_lock();
+    /* If another CPU already made room, just retry. */
+    if (tb_ctx.tb_flush_count + tb_ctx.tb_evict_count !=
+        tb_reclaim_count.host_int) {
+        mmap_unlock();
+        return;
+    }
+
+#ifdef CONFIG_SOFTMMU
+    tb_spec_pause();
+#endif
+    qemu_thread_jit_write();
+    qemu_mutex_lock(&tb_evicted.lock);
+    evicted = tcg_region_evict(tb_evict_iter, NULL);
+    qemu_mutex_unlock(&tb_evicted.lock);
+    qemu_thread_jit_execute();
+
+    if (evicted) {
+        /*
+         * The jump caches and return stacks of the vCPUs may still
+         * point to TBs of the region that were invalidated earlier.
+         */
+        CPU_FOREACH(other) {
+            cpu_tb_jmp_cache_clear(other);
+        }
+        qatomic_mb_set(&tb_ctx.tb_evict_count, tb_ctx.tb_evict_count + 1);
+    }
+#ifdef CONFIG_SOFTMMU
+    tb_spec_resume();
+#endif
+    mmap_unlock();
+
+    if (!evicted) {
+        do_tb_flush(cpu, RUN_ON_CPU_HOST_INT(tb_ctx.tb_flush_count));
+    }
+}
+
+/* Changes whenever code_gen_buffer was flushed or a region evicted */
+static unsigned tb_reclaim_count(void)
+{
+    return qatomic_mb_read(&tb_ctx.tb_flush_count) +
+           qatomic_mb_read(&tb_ctx.tb_evict_count);
+}
+
+static void tb_evict(CPUState *cpu)
+{
+    if (cpu_in_exclusive_context(cpu)) {
+        do_tb_evict(cpu, RUN_ON_CPU_HOST_INT(tb_reclaim_count()));
+    } else {
+        async_safe_run_on_cpu(cpu, do_tb_evict,
+                              RUN_ON_CPU_HOST_INT(tb_reclaim_count()));
+    }
+}
+
+/* Account the translation of @tb if its code was evicted before. */
+static void tb_evicted_retranslate(const TranslationBlock *tb, int64_t ns)
+{
+    uint32_t h = tb_evicted_hash(tb);
+
+    /* Most translations are of code that was not evicted. */
+    if (!test_bit(h % TB_EVICTED_FILTER_BITS, tb_evicted.filter)) {
+        return;
+    }
+
+    qemu_mutex_lock(&tb_evicted.lock);
+    if (g_hash_table_remove(tb_evicted.hashes, GUINT_TO_POINTER(h))) {
+        tb_ctx.tb_retranslate_count++;
+        tb_ctx.tb_retranslate_ns += ns;
+    }
+    qemu_mutex_unlock(&tb_evicted.lock);
+}
+
 /*
  * Formerly ifdef DEBUG_TB_CHECK. These debug functions are user-mode-only,
  * so in order to prevent bit rot we compile them unconditionally in user-mode,
@@ -1172,7 +1467,6 @@ static inline void tb_jmp_unlink(TranslationBlock *dest)
  */
 static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
 {
-    CPUState *cpu;
     PageDesc *p;
     uint32_t h;
     tb_page_addr_t phys_pc;
@@ -1205,13 +1499,10 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
         }
     }
 
-    /* remove the TB from the hash list */
-    h = tb_jmp_cache_hash_func(tb->pc);
-    CPU_FOREACH(cpu) {
-        if (qatomic_read(&cpu->tb_jmp_cache[h]) == tb) {
-            qatomic_set(&cpu->tb_jmp_cache[h], NULL);
-        }
-    }
+    /*
+     * The TB is left in the jump caches: lookups there check cflags, which
+     * now has CF_INVALID, and the caches are cleared before it is freed.
+     */
 
     /* suppress this TB from the two jump lists */
     tb_remove_from_jmp_list(tb, 0);
@@ -1273,6 +1564,63 @@ static void build_page_bitmap(PageDesc *p)
         bitmap_set(p->code_bitmap, tb_start, tb_end - tb_start);
     }
 }
+
+/* Writes missing the code of a page after which it is no longer protected */
+uint32_t tb_smc_threshold;
+
+static bool tb_page_self_checks(tb_page_addr_t phys_pc)
+{
+    PageDesc *p;
+
+    if (!tb_smc_threshold || phys_pc == -1) {
+        return false;
+    }
+    p = page_find(phys_pc >> TARGET_PAGE_BITS);
+    return p && qatomic_read(&p->self_check);
+}
+
+static uint64_t tb_code_hash_bytes(uint64_t h, const uint8_t *p, size_t len)
+{
+    uint64_t w[3];
+    size_t i, chunk;
+
+    for (i = 0; i < len; i += sizeof(w)) {
+        chunk = MIN(sizeof(w), len - i);
+        memset(w, 0, sizeof(w));
+        memcpy(w, p + i, chunk);
+        h = qemu_xxhash64_4(h, w[0], w[1], w[2]);
+    }
+    return h;
+}
+
+/* Hash the guest code of @tb as it is in RAM now.  Call under RCU. */
+static uint64_t tb_code_hash(const TranslationBlock *tb)
+{
+    ram_addr_t ofs = tb->pc & ~TARGET_PAGE_MASK;
+    size_t len = MIN(tb->size, TARGET_PAGE_SIZE - ofs);
+    uint64_t h;
+
+    h = tb_code_hash_bytes(tb->size, qemu_map_ram_ptr(NULL,
+                           (tb->page_addr[0] & TARGET_PAGE_MASK) + ofs), len);
+    if (len < tb->size) {
+        h = tb_code_hash_bytes(h, qemu_map_ram_ptr(NULL, tb->page_addr[1]),
+                               tb->size - len);
+    }
+    return h;
+}
+
+/*
+ * Hash the guest code from @phys_pc to the end of its page, which holds
+ * the first page part of any TB starting there.  Call under RCU.
+ */
+static uint64_t tb_code_hash_page(tb_page_addr_t phys_pc)
+{
+    return tb_code_hash_bytes(0, qemu_map_ram_ptr(NULL, phys_pc),
+                              TARGET_PAGE_SIZE - (phys_pc & ~TARGET_PAGE_MASK));
+}
+
+/* Translations of a self-checking TB whose code kept changing under it */
+#define TB_SELF_CHECK_RETRIES 3
 #endif
 
 /* add the tb in the target page and protect it if necessary
@@ -1301,6 +1649,19 @@ static inline void tb_page_add(PageDesc *p, TranslationBlock *tb,
     /* translator_loop() must have made all TB pages non-writable */
     assert(!(p->flags & PAGE_WRITE));
 #else
+    /*
+     * A TB that does not check its code needs the page protected again,
+     * which its other TBs do not mind.
+     */
+    if (p->self_check) {
+        if (tb->self_check) {
+            return;
+        }
+        p->self_check = false;
+        p->smc_clean_writes = 0;
+        page_already_protected = false;
+        qatomic_inc(&tb_ctx.tb_smc_reprotected);
+    }
     /* if some code is already present, then the pages are already
        protected. So we handle the case where only the first TB is
        allocated in a physical page */
@@ -1378,26 +1739,48 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     return tb;
 }
 
-/* Called with mmap_lock held for user mode emulation.  */
-TranslationBlock *tb_gen_code(CPUState *cpu,
-                              target_ulong pc, target_ulong cs_base,
-                              uint32_t flags, int cflags)
+/*
+ * Called with mmap_lock held for user mode emulation.
+ *
+ * A speculative translation (@spec) runs outside of the vCPU thread,
+ * so it cannot use the TLB: the code must be at @phys_pc and @host_pc.
+ * It returns NULL rather than exit to the main loop.
+ */
+static TranslationBlock *tb_gen_code_tier(CPUState *cpu,
+                                          target_ulong pc,
+                                          target_ulong cs_base,
+                                          uint32_t flags, int cflags,
+                                          int tier, bool spec,
+                                          tb_page_addr_t phys_pc,
+                                          void *host_pc)
 {
     CPUArchState *env = cpu->env_ptr;
     TranslationBlock *tb, *existing_tb;
-    tb_page_addr_t phys_pc;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size, max_insns;
 #ifdef CONFIG_PROFILER
     TCGProfile *prof = &tcg_ctx->prof;
     int64_t ti;
 #endif
-    void *host_pc;
+    bool evicted = qatomic_read(&tb_ctx.tb_evict_count) != 0;
+    bool timed = evicted;
+    int64_t xlate_start;
+#ifdef CONFIG_SOFTMMU
+    uint64_t page_hash = 0;
+    int self_check_retries = 0;
+#endif
+
+#ifdef CONFIG_SOFTMMU
+    timed |= tb_cache_enabled;
+#endif
+    xlate_start = timed ? get_clock() : 0;
 
     assert_memory_lock();
     qemu_thread_jit_write();
 
-    phys_pc = get_page_addr_code_hostp(env, pc, &host_pc);
+    if (!spec) {
+        phys_pc = get_page_addr_code_hostp(env, pc, &host_pc);
+    }
 
     if (phys_pc == -1) {
         /* Generate a one-shot TB with 1 insn in it */
@@ -1413,8 +1796,14 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
  buffer_overflow:
     tb = tcg_tb_alloc(tcg_ctx);
     if (unlikely(!tb)) {
-        /* flush must be done */
-        tb_flush(cpu);
+        if (spec) {
+            /* Let the vCPU make room; the code is translated on demand. */
+            async_safe_run_on_cpu(cpu, do_tb_evict,
+                                  RUN_ON_CPU_HOST_INT(tb_reclaim_count()));
+            return NULL;
+        }
+        /* eviction or flush must be done */
+        tb_evict(cpu);
         mmap_unlock();
         /* Make the execution loop process the flush as soon as possible.  */
         cpu->exception_index = EXCP_INTERRUPT;
@@ -1430,6 +1819,16 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
     tb->page_addr[0] = phys_pc;
     tb->page_addr[1] = -1;
+    tb->tier = tier;
+    tb->exec_count = tb_hot_threshold;
+    tb->spec = spec;
+    tb->self_check = false;
+#ifdef CONFIG_SOFTMMU
+    /* Only TBs that can be left at their start can check their code. */
+    if (!(cflags & (CF_COUNT_MASK | CF_USE_ICOUNT | CF_NOIRQ))) {
+        tb->self_check = tb_page_self_checks(phys_pc);
+    }
+#endif
     tcg_ctx->tb_cflags = cflags;
  tb_overflow:
 
@@ -1446,11 +1845,39 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
 
     tcg_func_start(tcg_ctx);
 
+#ifdef CONFIG_SOFTMMU
+    /*
+     * The page of a self-checking TB is not write protected, so other
+     * vCPUs may change the code while it is translated.  Hash it before
+     * and after: code_hash must be that of the code that was translated.
+     */
+    if (tb->self_check) {
+        page_hash = tb_code_hash_page(phys_pc);
+    }
+#endif
     tcg_ctx->cpu = env_cpu(env);
     gen_intermediate_code(cpu, tb, max_insns, pc, host_pc);
     assert(tb->size != 0);
     tcg_ctx->cpu = NULL;
     max_insns = tb->icount;
+#ifdef CONFIG_SOFTMMU
+    if (tb->self_check) {
+        tb->code_hash = tb_code_hash(tb);
+        if (unlikely(tb_code_hash_page(phys_pc) != page_hash)) {
+            /*
+             * Translate again.  If the code keeps changing, fall back to
+             * a TB that does not check, which protects the page again.
+             */
+            if (++self_check_retries == TB_SELF_CHECK_RETRIES) {
+                tb->self_check = false;
+            }
+            qemu_log_mask(CPU_LOG_TB_OP | CPU_LOG_TB_OP_OPT,
+                          "Restarting code generation for "
+                          "code changed during translation\n");
+            goto tb_overflow;
+        }
+    }
+#endif
 
     trace_translate_block(tb, tb->pc, tb->tc.ptr);
 
@@ -1652,9 +2079,70 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         tcg_tb_remove(tb);
         return existing_tb;
     }
+#ifdef CONFIG_SOFTMMU
+    if (tb_cache_enabled) {
+        tb_cache_record(cpu, tb, host_pc, get_clock() - xlate_start);
+    }
+#endif
+    if (evicted) {
+        tb_evicted_retranslate(tb, get_clock() - xlate_start);
+    }
+    if (spec) {
+        qatomic_inc(&tb_ctx.tb_spec_count);
+    }
     return tb;
 }
 
+/* Called with mmap_lock held for user mode emulation.  */
+TranslationBlock *tb_gen_code(CPUState *cpu,
+                              target_ulong pc, target_ulong cs_base,
+                              uint32_t flags, int cflags)
+{
+    return tb_gen_code_tier(cpu, pc, cs_base, flags, cflags, TB_TIER_BASE,
+                            false, -1, NULL);
+}
+
+#ifdef CONFIG_SOFTMMU
+/*
+ * Translate @pc on a speculative translation thread, from the code at
+ * ram address @phys_pc and host address @host_pc.  The code must not
+ * cross a page; translation is abandoned through tb_spec_abort if it
+ * does.  Returns NULL if code_gen_buffer is full.
+ */
+TranslationBlock *tb_gen_code_spec(CPUState *cpu, target_ulong pc,
+                                   target_ulong cs_base, uint32_t flags,
+                                   int cflags, tb_page_addr_t phys_pc,
+                                   void *host_pc)
+{
+    return tb_gen_code_tier(cpu, pc, cs_base, flags, cflags, TB_TIER_BASE,
+                            true, phys_pc, host_pc);
+}
+#endif
+
+/*
+ * Replace @tb, whose execution count ran out, with a TB_TIER_HOT
+ * translation of the same code.  Invalidating @tb unchains every jump
+ * into it, so that predecessors get relinked to the new TB through
+ * tb_add_jump() the next time they exit to the main loop.
+ *
+ * The CPU state must be the one at the start of @tb.
+ */
+TranslationBlock *tb_promote(CPUState *cpu, TranslationBlock *tb)
+{
+    TranslationBlock *hot;
+
+    mmap_lock();
+    tb_phys_invalidate(tb, -1);
+    hot = tb_gen_code_tier(cpu, tb->pc, tb->cs_base, tb->flags,
+                           tb_cflags(tb) & ~CF_INVALID, TB_TIER_HOT,
+                           false, -1, NULL);
+    mmap_unlock();
+
+    qatomic_inc(&tb_ctx.tb_promote_count);
+    tb_jmp_cache_insert(cpu, hot);
+    return hot;
+}
+
 /*
  * @p must be non-NULL.
  * user-mode: call with mmap_lock held.
@@ -1807,6 +2295,32 @@ void tb_invalidate_phys_range(target_ulong start, target_ulong end)
 }
 
 #ifdef CONFIG_SOFTMMU
+/*
+ * Count a write to the page of @p that missed its code.  Once there were
+ * tb_smc_threshold of them, the page is likely to mix code with data that
+ * is written often: stop protecting it by invalidating its TBs, and let
+ * their replacements check their code on entry instead.
+ *
+ * Call with all @pages of the page of @p locked.
+ */
+static void tb_smc_clean_write(struct page_collection *pages, PageDesc *p,
+                               tb_page_addr_t addr)
+{
+    tb_page_addr_t start = addr & TARGET_PAGE_MASK;
+
+    qatomic_inc(&tb_ctx.tb_smc_clean_writes);
+    /* With icount, no TB could check its code. */
+    if (!tb_smc_threshold || icount_enabled() ||
+        ++p->smc_clean_writes < tb_smc_threshold) {
+        return;
+    }
+    qatomic_set(&p->self_check, true);
+    qatomic_inc(&tb_ctx.tb_smc_self_check_pages);
+    /* Unprotects the page once the last TB is gone. */
+    tb_invalidate_phys_page_range__locked(pages, p, start,
+                                          start + TARGET_PAGE_SIZE, 0);
+}
+
 /* len must be <= 8 and start must be a multiple of len.
  * Called via softmmu_template.h when code areas are written to with
  * iothread mutex not held.
@@ -1827,6 +2341,7 @@ void tb_invalidate_phys_page_fast(struct page_collection *pages,
     }
 
     assert_page_locked(p);
+    qatomic_inc(&tb_ctx.tb_smc_writes);
     if (!p->code_bitmap &&
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD) {
         build_page_bitmap(p);
@@ -1840,13 +2355,34 @@ void tb_invalidate_phys_page_fast(struct page_collection *pages,
         if (b & ((1 << len) - 1)) {
             goto do_invalidate;
         }
+        tb_smc_clean_write(pages, p, start);
     } else {
     do_invalidate:
         tb_invalidate_phys_page_range__locked(pages, p, start, start + len,
                                               retaddr);
     }
 }
+/*
+ * Called on entry to a self-checking TB: if its guest code changed since
+ * it was translated, invalidate it and return nonzero to leave it.
+ */
+uint32_t HELPER(tb_self_check)(void *ptr)
+{
+    TranslationBlock *tb = ptr;
+
+    if (likely(tb_code_hash(tb) == tb->code_hash)) {
+        return 0;
+    }
+    qatomic_inc(&tb_ctx.tb_smc_check_fails);
+    tb_phys_invalidate(tb, -1);
+    return 1;
+}
 #else
+uint32_t HELPER(tb_self_check)(void *ptr)
+{
+    g_assert_not_reached();
+}
+
 /* Called with mmap_lock held. If pc is not 0 then it indicates the
  * host PC of the faulting store instruction that caused this invalidate.
  * Returns true if the caller needs to abort execution of the current
@@ -2071,6 +2607,14 @@ void dump_exec_info(GString *buf)
     struct tb_tree_stats tst = {};
     struct qht_stats hst;
     size_t nb_tbs, flush_full, flush_part, flush_elide;
+    size_t shootdown_posted, shootdown_waited;
+    size_t tag_switches, tag_restores;
+    size_t lptlb_fills, lptlb_flushes;
+    size_t jc_hits = 0, jc_misses = 0;
+    size_t ras_hits = 0, ras_misses = 0;
+    size_t steps;
+    int64_t now;
+    CPUState *cpu;
 
     tcg_tb_foreach(tb_tree_stats_iter, &tst);
     nb_tbs = tst.nb_tbs;
@@ -2111,11 +2655,86 @@ void dump_exec_info(GString *buf)
                            qatomic_read(&tb_ctx.tb_flush_count));
     g_string_append_printf(buf, "TB invalidate count %u\n",
                            qatomic_read(&tb_ctx.tb_phys_invalidate_count));
+    g_string_append_printf(buf, "TB promote count    %u\n",
+                           qatomic_read(&tb_ctx.tb_promote_count));
+    g_string_append_printf(buf, "TB region evictions %u (%zu TBs, %zu KiB)\n",
+                           qatomic_read(&tb_ctx.tb_evict_count),
+                           tb_ctx.tb_evict_tbs, tb_ctx.tb_evict_bytes / KiB);
+    g_string_append_printf(buf, "TB retranslations   %zu (%" PRId64 " us)\n",
+                           tb_ctx.tb_retranslate_count,
+                           tb_ctx.tb_retranslate_ns / SCALE_US);
 
     tlb_flush_counts(&flush_full, &flush_part, &flush_elide);
     g_string_append_printf(buf, "TLB full flushes    %zu\n", flush_full);
     g_string_append_printf(buf, "TLB partial flushes %zu\n", flush_part);
     g_string_append_printf(buf, "TLB elided flushes  %zu\n", flush_elide);
+    tlb_shootdown_counts(&shootdown_posted, &shootdown_waited);
+    g_string_append_printf(buf, "TLB shootdowns      %zu (%zu waits)\n",
+                           shootdown_posted, shootdown_waited);
+    tlb_lptlb_counts(&lptlb_fills, &lptlb_flushes);
+    g_string_append_printf(buf, "TLB block fills     %zu (%zu block flushes)\n",
+                           lptlb_fills, lptlb_flushes);
+    tlb_tag_counts(&tag_switches, &tag_restores);
+    if (tag_switches) {
+        g_string_append_printf(buf, "TLB tag switches    %zu (%zu restored)\n",
+                               tag_switches, tag_restores);
+    }
+
+    CPU_FOREACH(cpu) {
+        jc_hits += qatomic_read(&cpu->tb_jmp_cache_hits);
+        jc_misses += qatomic_read(&cpu->tb_jmp_cache_misses);
+        ras_hits += qatomic_read(&cpu->tb_ras_hits);
+        ras_misses += qatomic_read(&cpu->tb_ras_misses);
+    }
+    g_string_append_printf(buf, "inline jmp cache    %zu hits, "
+                           "%zu misses (%0.1f%% hit)\n",
+                           jc_hits, jc_misses,
+                           jc_hits + jc_misses ?
+                           (double)jc_hits * 100 / (jc_hits + jc_misses) : 0);
+    g_string_append_printf(buf, "return stack        %zu hits, "
+                           "%zu misses (%0.1f%% hit)\n",
+                           ras_hits, ras_misses,
+                           ras_hits + ras_misses ?
+                           (double)ras_hits * 100 / (ras_hits + ras_misses)
+                           : 0);
+    g_string_append_printf(buf, "SMC slow writes     %zu (%zu missed code)\n",
+                           qatomic_read(&tb_ctx.tb_smc_writes),
+                           qatomic_read(&tb_ctx.tb_smc_clean_writes));
+    if (tb_smc_threshold) {
+        g_string_append_printf(buf, "SMC self-check      %zu pages "
+                               "(%zu reprotected, %zu code changes)\n",
+                               qatomic_read(&tb_ctx.tb_smc_self_check_pages),
+                               qatomic_read(&tb_ctx.tb_smc_reprotected),
+                               qatomic_read(&tb_ctx.tb_smc_check_fails));
+    }
+    now = get_clock_realtime();
+    steps = qatomic_read(&tb_ctx.exclusive_steps);
+    g_string_append_printf(buf, "exclusive steps     %zu (%0.1f/s since "
+                           "last report)\n", steps,
+                           now > exclusive_steps_stamp.ns ?
+                           (double)(steps - exclusive_steps_stamp.count) *
+                           NANOSECONDS_PER_SECOND /
+                           (now - exclusive_steps_stamp.ns) : 0);
+    exclusive_steps_stamp.ns = now;
+    exclusive_steps_stamp.count = steps;
+    if (qatomic_read(&tb_ctx.htm_steps) || qatomic_read(&tb_ctx.htm_aborts)) {
+        g_string_append_printf(buf, "transactional steps %zu (%zu fell back "
+                               "to exclusive)\n",
+                               qatomic_read(&tb_ctx.htm_steps),
+                               qatomic_read(&tb_ctx.htm_aborts));
+    }
+    if (tb_spin_threshold) {
+        g_string_append_printf(buf, "spin loops          %zu TBs "
+                               "(%zu yields)\n",
+                               qatomic_read(&tb_ctx.tb_spin_loops),
+                               qatomic_read(&tb_ctx.spin_yields));
+    }
+    tb_jmp_cache_dump_info(buf);
+    tb_cache_dump_info(buf);
+    tb_spec_dump_info(buf);
+    tlb_shared_dump_info(buf);
+    tcg_affinity_dump_info(buf);
+    tcg_halt_poll_dump_info(buf);
     tcg_dump_info(buf);
 }
 
@@ -17,6 +17,9 @@
 #include "exec/translator.h"
 #include "exec/plugin-gen.h"
 #include "sysemu/replay.h"
+#include "tb-hash.h"
+#include "tb-context.h"
+#include "internal.h"
 
 /* Pairs with tcg_clear_temp_count.
    To be called by #TranslatorOps.{translate_insn,tb_stop} if
@@ -39,7 +42,344 @@ bool translator_use_goto_tb(DisasContextBase *db, target_ulong dest)
     }
 
     /* Check for the dest on the same page as the start of the TB.  */
-    return ((db->pc_first ^ dest) & TARGET_PAGE_MASK) == 0;
+    if ((db->pc_first ^ dest) & TARGET_PAGE_MASK) {
+        return false;
+    }
+
+    /* Remember the target for speculative translation.  */
+    if (db->nb_goto_tb_dest < ARRAY_SIZE(db->goto_tb_dest) &&
+        (db->nb_goto_tb_dest == 0 || db->goto_tb_dest[0] != dest)) {
+        db->goto_tb_dest[db->nb_goto_tb_dest++] = dest;
+    }
+    return true;
+}
+
+void translator_no_speculation(void)
+{
+#ifdef CONFIG_SOFTMMU
+    if (tb_spec_abort) {
+        siglongjmp(*tb_spec_abort, 1);
+    }
+#endif
+}
+
+#define CPU_ENV_OFFSET(field) \
+    (offsetof(ArchCPU, parent_obj.field) - offsetof(ArchCPU, env))
+
+/*
+ * Increment the size_t counter at @ofs in CPUState.  Only this vCPU
+ * writes it, with a single host word store, so that other threads can
+ * qatomic_read() it.
+ */
+static void gen_cpu_count(intptr_t ofs)
+{
+    TCGv_ptr t = tcg_temp_new_ptr();
+
+    tcg_gen_ld_ptr(t, cpu_env, ofs);
+    tcg_gen_addi_ptr(t, t, 1);
+    tcg_gen_st_ptr(t, cpu_env, ofs);
+    tcg_temp_free_ptr(t);
+}
+
+/* Emit tb_jmp_cache_hash_func(@pc) into @h.  */
+static void gen_jmp_cache_hash(TCGv h, TCGv pc)
+{
+    TCGv t = tcg_temp_new();
+
+#ifdef CONFIG_SOFTMMU
+    tcg_gen_shri_tl(t, pc, TARGET_PAGE_BITS - TB_JMP_PAGE_BITS);
+    tcg_gen_xor_tl(t, t, pc);
+    tcg_gen_shri_tl(h, t, TARGET_PAGE_BITS - TB_JMP_PAGE_BITS);
+    tcg_gen_andi_tl(h, h, TB_JMP_PAGE_MASK);
+    tcg_gen_andi_tl(t, t, TB_JMP_ADDR_MASK);
+    tcg_gen_or_tl(h, h, t);
+#else
+    tcg_gen_shri_tl(t, pc, TB_JMP_CACHE_MAX_BITS);
+    tcg_gen_xor_tl(t, t, pc);
+    tcg_gen_andi_tl(h, t, TB_JMP_CACHE_MAX_SIZE - 1);
+#endif
+    tcg_temp_free(t);
+}
+
+/*
+ * Leave a TB whose code is on a page that is not write protected through
+ * the exit request path, which gen_tb_start() emitted for it, if the code
+ * changed since translation.
+ */
+static void gen_tb_self_check(TranslationBlock *tb)
+{
+    TCGv_i32 changed = tcg_temp_new_i32();
+
+    gen_helper_tb_self_check(changed, tcg_constant_ptr(tb));
+    tcg_gen_brcondi_i32(TCG_COND_NE, changed, 0, tcg_ctx->exitreq_label);
+    tcg_temp_free_i32(changed);
+}
+
+/*
+ * The next TB is looked up with curr_cflags(), which we only know
+ * to match ours if they were not special for this TB.  Keep the
+ * helper for -d exec as well, so that every TB entry is logged.
+ */
+static bool translator_inline_lookup_ok(DisasContextBase *db)
+{
+    return !(tb_cflags(db->tb) & (CF_NO_GOTO_PTR | CF_COUNT_MASK |
+                                  CF_LAST_IO | CF_MEMI_ONLY | CF_NOIRQ |
+                                  CF_SINGLE_STEP)) &&
+           !qemu_loglevel_mask(CPU_LOG_EXEC | CPU_LOG_TB_CPU);
+}
+
+/*
+ * Branch to @miss unless @tb is what tb_lookup() would return for
+ * @pc, @cs_base, @flags and the cflags of the current TB.  Also miss
+ * while the vCPU has breakpoints, so that helper_lookup_tb_ptr() gets
+ * to check for them at @pc.
+ */
+static void gen_tb_check(DisasContextBase *db, TCGv_ptr tb, TCGv pc,
+                         target_ulong cs_base, uint32_t flags,
+                         TCGLabel *miss)
+{
+    TCGv t = tcg_temp_new();
+    TCGv_i32 t32 = tcg_temp_new_i32();
+    TCGv_ptr bp = tcg_temp_new_ptr();
+
+    /* !QTAILQ_EMPTY(&cpu->breakpoints) */
+    tcg_gen_ld_ptr(bp, cpu_env, CPU_ENV_OFFSET(breakpoints.tqh_first));
+    tcg_gen_brcondi_ptr(TCG_COND_NE, bp, 0, miss);
+    tcg_temp_free_ptr(bp);
+
+    tcg_gen_brcondi_ptr(TCG_COND_EQ, tb, 0, miss);
+    tcg_gen_ld_tl(t, tb, offsetof(TranslationBlock, pc));
+    tcg_gen_brcond_tl(TCG_COND_NE, t, pc, miss);
+    tcg_gen_ld_tl(t, tb, offsetof(TranslationBlock, cs_base));
+    tcg_gen_brcondi_tl(TCG_COND_NE, t, cs_base, miss);
+    tcg_gen_ld_i32(t32, tb, offsetof(TranslationBlock, flags));
+    tcg_gen_brcondi_i32(TCG_COND_NE, t32, flags, miss);
+    tcg_gen_ld_i32(t32, tb, offsetof(TranslationBlock, trace_vcpu_dstate));
+    tcg_gen_brcondi_i32(TCG_COND_NE, t32, db->tb->trace_vcpu_dstate, miss);
+    /* An invalidated TB fails here, as it has CF_INVALID set. */
+    tcg_gen_ld_i32(t32, tb, offsetof(TranslationBlock, cflags));
+    tcg_gen_brcondi_i32(TCG_COND_NE, t32, tb_cflags(db->tb), miss);
+
+    tcg_temp_free_i32(t32);
+    tcg_temp_free(t);
+}
+
+static void gen_goto_tb_ptr(TCGv_ptr tb)
+{
+    TCGv_ptr ptr = tcg_temp_new_ptr();
+
+    tcg_gen_ld_ptr(ptr, tb, offsetof(TranslationBlock, tc.ptr));
+    tcg_gen_op1i(INDEX_op_goto_ptr, tcgv_ptr_arg(ptr));
+    tcg_temp_free_ptr(ptr);
+}
+
+/*
+ * Probe tb_jmp_cache for @pc and jump to the TB found there, or call
+ * the helper on a miss.  On a hit, the TB is also recorded in the
+ * return stack entry at @ras_slot unless that is NULL.
+ */
+static void gen_jmp_cache_lookup_and_goto_ptr(DisasContextBase *db, TCGv pc,
+                                              target_ulong cs_base,
+                                              uint32_t flags,
+                                              TCGv_ptr ras_slot)
+{
+    TCGLabel *miss = gen_new_label();
+    TCGv_ptr tb = tcg_temp_local_new_ptr();
+    TCGv_ptr ptr = tcg_temp_new_ptr();
+    TCGv_ptr base = tcg_temp_new_ptr();
+    TCGv t = tcg_temp_new();
+    TCGv mask = tcg_temp_new();
+
+    /*
+     * tb = the most recently used way of the set of @pc, the other ways
+     * are left to tb_lookup():
+     * cpu->tb_jmp_cache[(hash(pc) & cpu->tb_jmp_cache_mask) * ways]
+     */
+    gen_jmp_cache_hash(t, pc);
+    tcg_gen_ld32u_tl(mask, cpu_env, CPU_ENV_OFFSET(tb_jmp_cache_mask));
+    tcg_gen_and_tl(t, t, mask);
+    tcg_gen_shli_tl(t, t, ctz32(sizeof(TranslationBlock *) *
+                                TB_JMP_CACHE_WAYS));
+#if TARGET_LONG_BITS == 64
+    tcg_gen_trunc_i64_ptr(ptr, t);
+#else
+    tcg_gen_ext_i32_ptr(ptr, t);
+#endif
+    tcg_gen_ld_ptr(base, cpu_env, CPU_ENV_OFFSET(tb_jmp_cache));
+    tcg_gen_add_ptr(ptr, ptr, base);
+    tcg_gen_ld_ptr(tb, ptr, 0);
+    tcg_temp_free(mask);
+    tcg_temp_free(t);
+    tcg_temp_free_ptr(base);
+    tcg_temp_free_ptr(ptr);
+
+    gen_tb_check(db, tb, pc, cs_base, flags, miss);
+    if (ras_slot) {
+        tcg_gen_st_ptr(tb, ras_slot, CPU_ENV_OFFSET(tb_ras[0].tb));
+    }
+    gen_cpu_count(CPU_ENV_OFFSET(tb_jmp_cache_hits));
+    gen_goto_tb_ptr(tb);
+    tcg_temp_free_ptr(tb);
+
+    gen_set_label(miss);
+    gen_cpu_count(CPU_ENV_OFFSET(tb_jmp_cache_misses));
+    tcg_gen_lookup_and_goto_ptr();
+}
+
+void translator_lookup_and_goto_ptr(DisasContextBase *db, TCGv pc,
+                                    target_ulong cs_base, uint32_t flags)
+{
+    if (!translator_inline_lookup_ok(db)) {
+        tcg_gen_lookup_and_goto_ptr();
+        return;
+    }
+
+    plugin_gen_disable_mem_helpers();
+    gen_jmp_cache_lookup_and_goto_ptr(db, pc, cs_base, flags, NULL);
+}
+
+/*
+ * Move the top of the return stack one entry up for a push or down for
+ * a pop, and return env plus the offset of the pushed or popped entry
+ * within cpu->tb_ras, to be used with CPU_ENV_OFFSET(tb_ras[0].field).
+ */
+static TCGv_ptr gen_ras_slot(bool push)
+{
+    TCGv_ptr slot = tcg_temp_local_new_ptr();
+    TCGv_i32 top = tcg_temp_new_i32();
+    TCGv_i32 next = tcg_temp_new_i32();
+
+    tcg_gen_ld_i32(top, cpu_env, CPU_ENV_OFFSET(tb_ras_top));
+    tcg_gen_addi_i32(next, top, push ? 1 : -1);
+    tcg_gen_andi_i32(next, next, TB_RAS_SIZE - 1);
+    tcg_gen_st_i32(next, cpu_env, CPU_ENV_OFFSET(tb_ras_top));
+    tcg_gen_muli_i32(top, push ? next : top, sizeof(TBReturnEntry));
+    tcg_gen_ext_i32_ptr(slot, top);
+    tcg_gen_add_ptr(slot, slot, cpu_env);
+
+    tcg_temp_free_i32(next);
+    tcg_temp_free_i32(top);
+    return slot;
+}
+
+void translator_ras_push(DisasContextBase *db, target_ulong ret_pc)
+{
+    TCGLabel *done;
+    TCGv_ptr slot;
+    TCGv_i64 t;
+
+    if (!tb_ras_enabled || !translator_inline_lookup_ok(db)) {
+        return;
+    }
+
+    done = gen_new_label();
+    slot = gen_ras_slot(true);
+    t = tcg_temp_new_i64();
+
+    /*
+     * Calls from the same site keep finding the same entry; keep the
+     * TB that was found for its return last time.
+     */
+    tcg_gen_ld_i64(t, slot, CPU_ENV_OFFSET(tb_ras[0].pc));
+    tcg_gen_brcondi_i64(TCG_COND_EQ, t, ret_pc, done);
+    tcg_gen_st_i64(tcg_constant_i64(ret_pc), slot,
+                   CPU_ENV_OFFSET(tb_ras[0].pc));
+    tcg_gen_st_ptr(tcg_constant_ptr(0), slot, CPU_ENV_OFFSET(tb_ras[0].tb));
+    gen_set_label(done);
+
+    tcg_temp_free_i64(t);
+    tcg_temp_free_ptr(slot);
+}
+
+void translator_ras_return(DisasContextBase *db, TCGv pc,
+                           target_ulong cs_base, uint32_t flags)
+{
+    TCGLabel *miss;
+    TCGv_ptr slot, tb;
+    TCGv_i64 t, pc64;
+
+    if (!tb_ras_enabled || !translator_inline_lookup_ok(db)) {
+        translator_lookup_and_goto_ptr(db, pc, cs_base, flags);
+        return;
+    }
+
+    plugin_gen_disable_mem_helpers();
+
+    miss = gen_new_label();
+    slot = gen_ras_slot(false);
+    tb = tcg_temp_local_new_ptr();
+    t = tcg_temp_new_i64();
+    pc64 = tcg_temp_new_i64();
+
+    /*
+     * The popped entry is only a prediction: the TB it holds must pass
+     * the same checks as one found in tb_jmp_cache.
+     */
+    tcg_gen_ld_i64(t, slot, CPU_ENV_OFFSET(tb_ras[0].pc));
+    tcg_gen_extu_tl_i64(pc64, pc);
+    tcg_gen_brcond_i64(TCG_COND_NE, t, pc64, miss);
+    tcg_temp_free_i64(pc64);
+    tcg_temp_free_i64(t);
+
+    tcg_gen_ld_ptr(tb, slot, CPU_ENV_OFFSET(tb_ras[0].tb));
+    gen_tb_check(db, tb, pc, cs_base, flags, miss);
+    gen_cpu_count(CPU_ENV_OFFSET(tb_ras_hits));
+    gen_goto_tb_ptr(tb);
+    tcg_temp_free_ptr(tb);
+
+    /* Fill the entry from tb_jmp_cache, for the next return through it. */
+    gen_set_label(miss);
+    gen_cpu_count(CPU_ENV_OFFSET(tb_ras_misses));
+    gen_jmp_cache_lookup_and_goto_ptr(db, pc, cs_base, flags, slot);
+    tcg_temp_free_ptr(slot);
+}
+
+/* Longest guest loop that is considered for spin loop detection */
+#define TB_SPIN_MAX_INSNS 8
+
+/*
+ * Whether the TB is a short loop back to its own start in which the
+ * guest only loads, compares and branches: it cannot make progress
+ * until something else stores to what it loads.  Any store or helper
+ * call rules the TB out, which includes atomic operations.
+ */
+static bool translator_is_spin_loop(DisasContextBase *db)
+{
+    bool loads = false;
+    TCGOp *op;
+    int i;
+
+    /* Exact-count and icount TBs must run as they are; so must replay. */
+    if (db->num_insns > TB_SPIN_MAX_INSNS ||
+        (tb_cflags(db->tb) & (CF_COUNT_MASK | CF_USE_ICOUNT | CF_NOIRQ |
+                              CF_SINGLE_STEP))) {
+        return false;
+    }
+    for (i = 0; i < db->nb_goto_tb_dest; i++) {
+        if (db->goto_tb_dest[i] == db->pc_first) {
+            break;
+        }
+    }
+    if (i == db->nb_goto_tb_dest) {
+        return false;
+    }
+
+    QTAILQ_FOREACH(op, &tcg_ctx->ops, link) {
+        switch (op->opc) {
+        case INDEX_op_qemu_ld_i32:
+        case INDEX_op_qemu_ld_i64:
+            loads = true;
+            break;
+        case INDEX_op_qemu_st_i32:
+        case INDEX_op_qemu_st8_i32:
+        case INDEX_op_qemu_st_i64:
+        case INDEX_op_call:
+            return false;
+        default:
+            break;
+        }
+    }
+    return loads;
 }
 
 void translator_loop(CPUState *cpu, TranslationBlock *tb, int max_insns,
@@ -59,6 +399,8 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int max_insns,
     db->singlestep_enabled = cflags & CF_SINGLE_STEP;
     db->host_addr[0] = host_pc;
     db->host_addr[1] = NULL;
+    db->nb_goto_tb_dest = 0;
+    tb->spin_loop = false;
 
 #ifdef CONFIG_USER_ONLY
     page_protect(pc);
@@ -72,6 +414,9 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int max_insns,
 
     /* Start translating.  */
     gen_tb_start(db->tb);
+    if (tb->self_check) {
+        gen_tb_self_check(tb);
+    }
     ops->tb_start(db, cpu);
     tcg_debug_assert(db->is_jmp == DISAS_NEXT);  /* no early exit */
 
@@ -127,12 +472,21 @@ void translator_loop(CPUState *cpu, TranslationBlock *tb, int max_insns,
 
     if (plugin_enabled) {
         plugin_gen_tb_end(cpu);
+    } else if (tb_spin_threshold && translator_is_spin_loop(db)) {
+        tb->spin_loop = true;
+        qatomic_inc(&tb_ctx.tb_spin_loops);
     }
 
     /* The disas_log hook may use these values rather than recompute.  */
     tb->size = db->pc_next - db->pc_first;
     tb->icount = db->num_insns;
 
+#ifdef CONFIG_SOFTMMU
+    if (tb_spec_enabled && db->nb_goto_tb_dest) {
+        tb_spec_queue(cpu, tb, db->goto_tb_dest, db->nb_goto_tb_dest);
+    }
+#endif
+
 #ifdef DEBUG_DISAS
     if (qemu_loglevel_mask(CPU_LOG_TB_IN_ASM)
         && qemu_log_in_addr_range(db->pc_first)) {
@@ -169,6 +523,8 @@ static void *translator_access(CPUArchState *env, DisasContextBase *db,
         host = db->host_addr[1];
         base = TARGET_PAGE_ALIGN(db->pc_first);
         if (host == NULL) {
+            /* Only the vCPU can look up the second page. */
+            translator_no_speculation();
             tb->page_addr[1] =
                 get_page_addr_code_hostp(env, base, &db->host_addr[1]);
 #ifdef CONFIG_USER_ONLY
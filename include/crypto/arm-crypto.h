@@ -0,0 +1,54 @@
+/*
+ * The AES, SHA and PMULL instructions of the Arm crypto extensions, in C
+ *
+ * Each crypto_foo() computes the same result as host_crypto_foo() from
+ * qemu/host-crypto.h, on any host.  The target/arm helpers run them when
+ * the host does not have the instruction.
+ *
+ * Copyright (C) 2013 - 2018 Linaro Ltd <ard.biesheuvel@linaro.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ */
+
+#ifndef QEMU_ARM_CRYPTO_H
+#define QEMU_ARM_CRYPTO_H
+
+#include "qemu/host-crypto.h"
+
+union CRYPTO_STATE {
+    uint8_t    bytes[16];
+    uint32_t   words[4];
+    uint64_t   l[2];
+};
+
+#if HOST_BIG_ENDIAN
+#define CR_ST_BYTE(state, i)   ((state).bytes[(15 - (i)) ^ 8])
+#define CR_ST_WORD(state, i)   ((state).words[(3 - (i)) ^ 2])
+#else
+#define CR_ST_BYTE(state, i)   ((state).bytes[i])
+#define CR_ST_WORD(state, i)   ((state).words[i])
+#endif
+
+/* AESE and AESD */
+void crypto_aese(uint64_t *rd, const uint64_t *rn,
+                 const uint64_t *rm, bool decrypt);
+/* AESMC and AESIMC */
+void crypto_aesmc(uint64_t *rd, const uint64_t *rm, bool decrypt);
+/* PMULL of two 64-bit elements */
+void crypto_pmull_64(uint64_t *rd, uint64_t n, uint64_t m);
+/* SHA1C, SHA1P and SHA1M */
+void crypto_sha1(uint64_t *rd, const uint64_t *rn,
+                 const uint64_t *rm, HostCryptoSHA1Op op);
+/* SHA256H and SHA256H2 */
+void crypto_sha256h(uint64_t *rd, const uint64_t *rn,
+                    const uint64_t *rm, bool h2);
+/* SHA512H, SHA512H2, SHA512SU0 and SHA512SU1 */
+void crypto_sha512h(uint64_t *rd, const uint64_t *rn, const uint64_t *rm);
+void crypto_sha512h2(uint64_t *rd, const uint64_t *rn, const uint64_t *rm);
+void crypto_sha512su0(uint64_t *rd, const uint64_t *rn);
+void crypto_sha512su1(uint64_t *rd, const uint64_t *rn, const uint64_t *rm);
+
+#endif /* QEMU_ARM_CRYPTO_H */
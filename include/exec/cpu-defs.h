@@ -78,6 +78,8 @@ typedef uint64_t target_ulong;
 
 /* use a fully associative victim tlb of 8 entries */
 #define CPU_VTLB_SIZE 8
+/* and a fully associative tlb of 8 block mappings larger than a page */
+#define CPU_LPTLB_SIZE 8
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -150,6 +152,44 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+/*
+ * A block mapping larger than a page, entered with
+ * tlb_set_large_page_with_attrs.  The pages of the block are entered
+ * in the tlb one by one as they are accessed, without tlb_fill.
+ */
+typedef struct CPULPTLBEntry {
+    /* first virtual address of the block, -1 if unused */
+    target_ulong addr;
+    /* ~(size - 1), 0 if unused */
+    target_ulong mask;
+    hwaddr paddr;
+    MemTxAttrs attrs;
+    int prot;
+} CPULPTLBEntry;
+
+/*
+ * The entries of one MMU mode that tlb_switch_tag_by_mmuidx set aside
+ * for an address space other than the current one.  The fields mirror
+ * those of CPUTLBDesc and CPUTLBDescFast, with which they are swapped.
+ */
+typedef struct CPUTLBTagSet {
+    uint32_t tag;
+    bool valid;
+    /* value of CPUTLBDesc.tag_clock when last switched out */
+    uint64_t stamp;
+    target_ulong large_page_addr;
+    target_ulong large_page_mask;
+    size_t n_used_entries;
+    size_t vindex;
+    uintptr_t mask;
+    CPUTLBEntry *table;
+    CPUIOTLBEntry *iotlb;
+    CPUTLBEntry vtable[CPU_VTLB_SIZE];
+    CPUIOTLBEntry viotlb[CPU_VTLB_SIZE];
+    size_t lpindex;
+    CPULPTLBEntry lptlb[CPU_LPTLB_SIZE];
+} CPUTLBTagSet;
+
 /*
  * Data elements that are per MMU mode, minus the bits accessed by
  * the TCG fast path.
@@ -157,9 +197,9 @@ typedef struct CPUIOTLBEntry {
 typedef struct CPUTLBDesc {
     /*
      * Describe a region covering all of the large pages allocated
-     * into the tlb.  When any page within this region is flushed,
-     * we must flush the entire tlb.  The region is matched if
-     * (addr & large_page_mask) == large_page_addr.
+     * into the tlb that are not in lptlb.  When any page within this
+     * region is flushed, we must flush the entire tlb.  The region is
+     * matched if (addr & large_page_mask) == large_page_addr.
      */
     target_ulong large_page_addr;
     target_ulong large_page_mask;
@@ -175,6 +215,21 @@ typedef struct CPUTLBDesc {
     CPUIOTLBEntry viotlb[CPU_VTLB_SIZE];
     /* The iotlb.  */
     CPUIOTLBEntry *iotlb;
+    /*
+     * The block mappings whose pages may be in the tlb, so that flushing
+     * part of one only flushes that block.  The next index to use.
+     */
+    size_t lpindex;
+    CPULPTLBEntry lptlb[CPU_LPTLB_SIZE];
+    /*
+     * With tagged TLB sets enabled, the address space tag of the current
+     * entries if has_tag, and the entries of up to tlb_tag_sets other
+     * address spaces, allocated on first use.
+     */
+    bool has_tag;
+    uint32_t tag;
+    uint64_t tag_clock;
+    CPUTLBTagSet *tag_sets;
 } CPUTLBDesc;
 
 /*
@@ -188,6 +243,20 @@ typedef struct CPUTLBDescFast {
     CPUTLBEntry *table;
 } CPUTLBDescFast QEMU_ALIGNED(2 * sizeof(void *));
 
+/*
+ * One flush of a range of pages, with @bits significant address bits.
+ * A zero @len instead flushes the entries tagged @addr.
+ */
+typedef struct TLBFlushRangeData {
+    target_ulong addr;
+    target_ulong len;
+    uint16_t idxmap;
+    uint16_t bits;
+} TLBFlushRangeData;
+
+/* Flushes that other vCPUs can post before this one gets to them. */
+#define CPU_TLB_SHOOTDOWN_RANGES 8
+
 /*
  * Data elements that are shared between all MMU modes.
  */
@@ -200,6 +269,22 @@ typedef struct CPUTLBCommon {
      * Protected by tlb_c.lock.
      */
     uint16_t dirty;
+    /*
+     * Flushes posted by other vCPUs with tlb_flush_*_all_cpus_synced,
+     * applied by this vCPU at its next TB boundary.  mmu_idx in
+     * shootdown_full are flushed entirely; ranges that do not fit in
+     * shootdown[] are merged into it.  Protected by tlb_c.lock.
+     */
+    uint16_t shootdown_full;
+    uint16_t nb_shootdown;
+    TLBFlushRangeData shootdown[CPU_TLB_SHOOTDOWN_RANGES];
+    /*
+     * Generation of the last posted and the last applied shootdown.
+     * Posting increments the first with tlb_c.lock held; only this
+     * vCPU writes the second.
+     */
+    uint32_t shootdown_posted;
+    uint32_t shootdown_done;
     /*
      * Statistics.  These are not lock protected, but are read and
      * written atomically.  This allows the monitor to print a snapshot
@@ -208,6 +293,14 @@ typedef struct CPUTLBCommon {
     size_t full_flush_count;
     size_t part_flush_count;
     size_t elide_flush_count;
+    size_t shootdown_count;
+    size_t shootdown_wait_count;
+    size_t tag_switch_count;
+    size_t tag_restore_count;
+    size_t lptlb_fill_count;
+    size_t lptlb_flush_count;
+    size_t shared_hit_count;
+    size_t shared_miss_count;
 } CPUTLBCommon;
 
 /*
@@ -27,5 +27,8 @@
 void tlb_protect_code(ram_addr_t ram_addr);
 void tlb_unprotect_code(ram_addr_t ram_addr);
 void tlb_flush_counts(size_t *full, size_t *part, size_t *elide);
+void tlb_shootdown_counts(size_t *posted, size_t *waited);
+void tlb_tag_counts(size_t *switches, size_t *restores);
+void tlb_lptlb_counts(size_t *fills, size_t *flushes);
 #endif
 #endif
@@ -257,6 +257,43 @@ void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *cpu,
                                                uint16_t idxmap,
                                                unsigned bits);
 
+/**
+ * tlb_switch_tag_by_mmuidx
+ * @cpu: CPU whose TLB should be switched
+ * @idxmap: bitmap of mmu indexes to switch
+ * @old_tag: address space tag of the current entries
+ * @new_tag: address space tag being switched to
+ *
+ * For each mmuidx in @idxmap, set the current entries aside under
+ * @old_tag and bring back those last set aside under @new_tag, if they
+ * are still kept.  Full flushes drop all entries set aside, and forget
+ * the current tag.  Must be called on @cpu itself.  Without tagged TLB
+ * sets (see tlb_tags_enabled), this is tlb_flush_by_mmuidx.
+ */
+void tlb_switch_tag_by_mmuidx(CPUState *cpu, uint16_t idxmap,
+                              uint32_t old_tag, uint32_t new_tag);
+/**
+ * tlb_flush_tag_by_mmuidx
+ * @cpu: CPU whose TLB should be flushed
+ * @idxmap: bitmap of mmu indexes to flush
+ * @tag: address space tag to flush
+ *
+ * For each mmuidx in @idxmap, flush the entries of address space @tag,
+ * whether current or set aside.  The current entries are flushed too
+ * if their tag is not known.
+ */
+void tlb_flush_tag_by_mmuidx(CPUState *cpu, uint16_t idxmap, uint32_t tag);
+/* Similarly, with broadcast and syncing. */
+void tlb_flush_tag_by_mmuidx_all_cpus_synced(CPUState *cpu, uint16_t idxmap,
+                                             uint32_t tag);
+/**
+ * tlb_tags_enabled:
+ *
+ * Return true if tlb_switch_tag_by_mmuidx keeps the entries of the
+ * address space being left rather than flushing them.
+ */
+bool tlb_tags_enabled(void);
+
 /**
  * tlb_set_page_with_attrs:
  * @cpu: CPU to add this TLB entry for
@@ -282,6 +319,26 @@ void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *cpu,
 void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
                              hwaddr paddr, MemTxAttrs attrs,
                              int prot, int mmu_idx, target_ulong size);
+/**
+ * tlb_set_large_page_with_attrs:
+ * @cpu: CPU to add this TLB entry for
+ * @vaddr: virtual address of page to add entry for
+ * @paddr: physical address of the page
+ * @attrs: memory transaction attributes
+ * @prot: access permissions (PAGE_READ/PAGE_WRITE/PAGE_EXEC bits)
+ * @mmu_idx: MMU index to insert TLB entry for
+ * @size: size of the block containing the page, a power of 2
+ *
+ * This function is equivalent to tlb_set_page_with_attrs(), for a page
+ * within a @size aligned block that maps linearly to physical memory,
+ * with the same @attrs and @prot throughout.  The block is remembered,
+ * so that the other pages of the block are added to the TLB without
+ * calling tlb_fill() on a miss, and flushing part of the block flushes
+ * only the pages of this block.
+ */
+void tlb_set_large_page_with_attrs(CPUState *cpu, target_ulong vaddr,
+                                   hwaddr paddr, MemTxAttrs attrs, int prot,
+                                   int mmu_idx, target_ulong size);
 /* tlb_set_page:
  *
  * This function is equivalent to calling tlb_set_page_with_attrs()
@@ -379,6 +436,23 @@ static inline void tlb_flush_range_by_mmuidx_all_cpus_synced(CPUState *cpu,
                                                              unsigned bits)
 {
 }
+static inline void tlb_switch_tag_by_mmuidx(CPUState *cpu, uint16_t idxmap,
+                                            uint32_t old_tag, uint32_t new_tag)
+{
+}
+static inline void tlb_flush_tag_by_mmuidx(CPUState *cpu, uint16_t idxmap,
+                                           uint32_t tag)
+{
+}
+static inline void tlb_flush_tag_by_mmuidx_all_cpus_synced(CPUState *cpu,
+                                                           uint16_t idxmap,
+                                                           uint32_t tag)
+{
+}
+static inline bool tlb_tags_enabled(void)
+{
+    return false;
+}
 #endif
 /**
  * probe_access:
@@ -489,6 +563,30 @@ struct TranslationBlock {
     uint16_t size;
     uint16_t icount;
 
+    /*
+     * Executions left before a first tier TB gets retranslated with the
+     * heavier pipeline.  Decremented by the generated code without atomics,
+     * so the count is only approximate under MTTCG.
+     */
+    int32_t exec_count;
+    /* optimization tier the TB was generated for */
+    uint8_t tier;
+#define TB_TIER_BASE 0
+#define TB_TIER_HOT  1
+    /* translated speculatively, and not looked up by a vCPU yet */
+    uint8_t spec;
+    /*
+     * On a page that is not write protected: the TB checks on entry that
+     * its guest code still hashes to code_hash.
+     */
+    uint8_t self_check;
+    /*
+     * A short loop back to its own start that only loads and compares:
+     * never chained to itself, so that cpu_exec() sees each iteration.
+     */
+    uint8_t spin_loop;
+    uint64_t code_hash;
+
     struct tb_tc tc;
 
     /* first and second physical page containing code. The lower bit
@@ -542,6 +640,26 @@ static inline uint32_t tb_cflags(const TranslationBlock *tb)
 /* current cflags for hashing/comparison */
 uint32_t curr_cflags(CPUState *cpu);
 
+/* executions after which a TB is promoted to TB_TIER_HOT; 0 disables */
+extern uint32_t tb_hot_threshold;
+
+/* whether calls and returns are predicted with the vCPU return stack */
+extern bool tb_ras_enabled;
+
+/* spin loop iterations after which the vCPU yields; 0 disables */
+extern uint32_t tb_spin_threshold;
+
+/*
+ * Whether @tb counts its executions: only first tier TBs of the normal
+ * execution loop do, since exact-count, icount and uninterruptible TBs
+ * cannot be left early at their start.
+ */
+static inline bool tb_counts_execs(const TranslationBlock *tb)
+{
+    return tb_hot_threshold && tb->tier == TB_TIER_BASE &&
+        !(tb_cflags(tb) & (CF_COUNT_MASK | CF_USE_ICOUNT | CF_NOIRQ));
+}
+
 /* TranslationBlock invalidate API */
 #if defined(CONFIG_USER_ONLY)
 void tb_invalidate_phys_addr(target_ulong addr);
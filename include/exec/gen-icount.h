@@ -55,6 +55,20 @@ static inline void gen_tb_start(const TranslationBlock *tb)
         tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, tcg_ctx->exitreq_label);
     }
 
+    /*
+     * Count down the executions of a first tier TB, and leave it through
+     * the exit request path when it becomes hot: cpu_tb_exec() will then
+     * retranslate it with the heavier pipeline.
+     */
+    if (tb_counts_execs(tb)) {
+        TCGv_ptr ptr = tcg_constant_ptr(tb);
+
+        tcg_gen_ld_i32(count, ptr, offsetof(TranslationBlock, exec_count));
+        tcg_gen_subi_i32(count, count, 1);
+        tcg_gen_st_i32(count, ptr, offsetof(TranslationBlock, exec_count));
+        tcg_gen_brcondi_i32(TCG_COND_EQ, count, 0, tcg_ctx->exitreq_label);
+    }
+
     if (tb_cflags(tb) & CF_USE_ICOUNT) {
         tcg_gen_st16_i32(count, cpu_env,
                          offsetof(ArchCPU, neg.icount_decr.u16.low) -
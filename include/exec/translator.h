@@ -77,6 +77,8 @@ typedef enum DisasJumpType {
  * @num_insns: Number of translated instructions (including current).
  * @max_insns: Maximum number of instructions to be translated in this TB.
  * @singlestep_enabled: "Hardware" single stepping enabled.
+ * @goto_tb_dest: Targets of direct jumps on the page of @pc_first.
+ * @nb_goto_tb_dest: Number of valid entries in @goto_tb_dest.
  *
  * Architecture-agnostic disassembly context.
  */
@@ -89,6 +91,8 @@ typedef struct DisasContextBase {
     int max_insns;
     bool singlestep_enabled;
     void *host_addr[2];
+    target_ulong goto_tb_dest[2];
+    int nb_goto_tb_dest;
 } DisasContextBase;
 
 /**
@@ -162,6 +166,57 @@ void translator_loop_temp_check(DisasContextBase *db);
  */
 bool translator_use_goto_tb(DisasContextBase *db, target_ulong dest);
 
+/**
+ * translator_no_speculation
+ *
+ * Called before translation depends on state that only the vCPU
+ * thread may read, such as its TLB.  Abandons the translation if it
+ * is done speculatively on another thread; does nothing otherwise.
+ */
+void translator_no_speculation(void);
+
+/**
+ * translator_lookup_and_goto_ptr
+ * @db: Disassembly context
+ * @pc: guest pc of the destination; must be a global
+ * @cs_base: cs_base of the cpu state at the destination
+ * @flags: flags of the cpu state at the destination
+ *
+ * Like tcg_gen_lookup_and_goto_ptr(), but first probe the tb_jmp_cache
+ * of the vCPU inline, and jump straight to the cached TB if it matches
+ * @pc, @cs_base, @flags and the cflags of the current TB.  The helper is
+ * only called on a miss, or while the vCPU has breakpoints so that they
+ * are still checked for.  @cs_base and @flags must be what
+ * cpu_get_tb_cpu_state() would return once the branch has executed.
+ */
+void translator_lookup_and_goto_ptr(DisasContextBase *db, TCGv pc,
+                                    target_ulong cs_base, uint32_t flags);
+
+/**
+ * translator_ras_push
+ * @db: Disassembly context
+ * @ret_pc: guest pc the call returns to
+ *
+ * Push @ret_pc on the return address stack of the vCPU, for a function
+ * call instruction.  Does nothing if the stack is disabled.
+ */
+void translator_ras_push(DisasContextBase *db, target_ulong ret_pc);
+
+/**
+ * translator_ras_return
+ * @db: Disassembly context
+ * @pc: guest pc of the destination; must be a global
+ * @cs_base: cs_base of the cpu state at the destination
+ * @flags: flags of the cpu state at the destination
+ *
+ * Like translator_lookup_and_goto_ptr(), for a function return: pop the
+ * return address stack and jump straight to the TB in the popped entry
+ * if it is valid for @pc.  A misprediction falls back to
+ * translator_lookup_and_goto_ptr().
+ */
+void translator_ras_return(DisasContextBase *db, TCGv pc,
+                           target_ulong cs_base, uint32_t flags);
+
 /*
  * Translator Load Functions
  *
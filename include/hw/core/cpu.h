@@ -230,8 +230,56 @@ struct kvm_run;
 struct hax_vcpu_state;
 struct hvf_vcpu_state;
 
-#define TB_JMP_CACHE_BITS 12
-#define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
+/*
+ * The jump cache has between 1 << TB_JMP_CACHE_MIN_BITS and
+ * 1 << TB_JMP_CACHE_MAX_BITS sets of TB_JMP_CACHE_WAYS entries, and is
+ * resized by TCG with its miss rate.  Sets are used and cleared in groups
+ * of TB_JMP_PAGE_SIZE, which in system mode hold the TBs of a guest page.
+ */
+#define TB_JMP_CACHE_WAYS 2
+#define TB_JMP_CACHE_MIN_BITS 8
+#define TB_JMP_CACHE_DEFAULT_BITS 11
+#define TB_JMP_CACHE_MAX_BITS 16
+#define TB_JMP_CACHE_MAX_SIZE (1 << TB_JMP_CACHE_MAX_BITS)
+#define TB_JMP_PAGE_BITS 6
+#define TB_JMP_PAGE_SIZE (1 << TB_JMP_PAGE_BITS)
+
+/* Jump cache lookups done in C, i.e. not by generated code. */
+typedef struct TBJmpCacheStats {
+    uint64_t lookups;
+    /* lookups of TBs that were only found in the TB hash table */
+    uint64_t misses;
+    uint64_t resizes;
+    /* start of the current resize window, and the counts at that time */
+    int64_t window_begin_ns;
+    uint64_t window_lookups;
+    uint64_t window_misses;
+} TBJmpCacheStats;
+
+/* Halts of a TCG vCPU thread, see accel/tcg/tcg-halt-poll.c */
+typedef struct TCGHaltPollStats {
+    /* halts that ended while polling, and their total length */
+    uint64_t poll_hits;
+    int64_t poll_hit_ns;
+    /* halts that went to sleep, their total length and time polled */
+    uint64_t sleeps;
+    int64_t sleep_ns;
+    int64_t wasted_poll_ns;
+    uint64_t grows;
+    uint64_t shrinks;
+} TCGHaltPollStats;
+
+#define TB_RAS_BITS 4
+#define TB_RAS_SIZE (1 << TB_RAS_BITS)
+
+/*
+ * An entry of the return address stack: the pc a call will return to,
+ * and the TB for that pc once the first return through it has found one.
+ */
+typedef struct TBReturnEntry {
+    vaddr pc;
+    TranslationBlock *tb;
+} TBReturnEntry;
 
 /* work queue */
 
@@ -361,8 +409,29 @@ struct CPUState {
     CPUArchState *env_ptr;
     IcountDecr *icount_decr_ptr;
 
-    /* Accessed in parallel; all accesses must be atomic */
-    TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    /*
+     * Jump cache of tb_jmp_cache_mask + 1 sets, each with the most recently
+     * used TB first.  Only accessed by this vCPU or while it is stopped,
+     * but read by generated code; all accesses to entries must be atomic.
+     */
+    TranslationBlock **tb_jmp_cache;
+    uint32_t tb_jmp_cache_mask;
+    /* Groups of TB_JMP_PAGE_SIZE sets that may have entries */
+    unsigned long *tb_jmp_cache_used;
+    /* Outcome of the inline tb_jmp_cache probes of indirect branches */
+    size_t tb_jmp_cache_hits;
+    size_t tb_jmp_cache_misses;
+    TBJmpCacheStats tb_jmp_cache_stats;
+    /* Return address stack, only accessed by generated code of this vCPU */
+    TBReturnEntry tb_ras[TB_RAS_SIZE];
+    uint32_t tb_ras_top;
+    size_t tb_ras_hits;
+    size_t tb_ras_misses;
+    /* How long a halted TCG vCPU polls for work before sleeping */
+    uint32_t halt_poll_ns;
+    TCGHaltPollStats halt_poll_stats;
+    /* Consecutive iterations of a spin loop TB, see cpu_loop_spin() */
+    uint32_t spin_iters;
 
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
@@ -448,13 +517,45 @@ extern CPUTailQ cpus;
 
 extern __thread CPUState *current_cpu;
 
-static inline void cpu_tb_jmp_cache_clear(CPUState *cpu)
+static inline void cpu_tb_ras_clear(CPUState *cpu)
 {
     unsigned int i;
 
-    for (i = 0; i < TB_JMP_CACHE_SIZE; i++) {
-        qatomic_set(&cpu->tb_jmp_cache[i], NULL);
+    for (i = 0; i < TB_RAS_SIZE; i++) {
+        qatomic_set(&cpu->tb_ras[i].tb, NULL);
+    }
+}
+
+static inline size_t cpu_tb_jmp_cache_groups(CPUState *cpu)
+{
+    return (cpu->tb_jmp_cache_mask + 1) >> TB_JMP_PAGE_BITS;
+}
+
+/* Clear group @g of TB_JMP_PAGE_SIZE sets of the jump cache. */
+static inline void cpu_tb_jmp_cache_clear_group(CPUState *cpu, size_t g)
+{
+    TranslationBlock **p = cpu->tb_jmp_cache +
+                           (g << TB_JMP_PAGE_BITS) * TB_JMP_CACHE_WAYS;
+    unsigned int i;
+
+    for (i = 0; i < TB_JMP_PAGE_SIZE * TB_JMP_CACHE_WAYS; i++) {
+        qatomic_set(&p[i], NULL);
+    }
+    clear_bit(g, cpu->tb_jmp_cache_used);
+}
+
+static inline void cpu_tb_jmp_cache_clear(CPUState *cpu)
+{
+    size_t g, n = cpu_tb_jmp_cache_groups(cpu);
+
+    /* Only the groups that were filled since the last clear. */
+    if (cpu->tb_jmp_cache) {
+        for (g = find_first_bit(cpu->tb_jmp_cache_used, n); g < n;
+             g = find_next_bit(cpu->tb_jmp_cache_used, n, g + 1)) {
+            cpu_tb_jmp_cache_clear_group(cpu, g);
+        }
     }
+    cpu_tb_ras_clear(cpu);
 }
 
 /**
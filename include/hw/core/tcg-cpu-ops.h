@@ -110,6 +110,42 @@ struct TCGCPUOps {
      */
     bool (*io_recompile_replay_branch)(CPUState *cpu,
                                        const TranslationBlock *tb);
+
+    /**
+     * @tlb_flushed: Callback after a softmmu TLB flush on @cpu.
+     *
+     * Called on the vCPU thread once the entries for @idxmap are gone.
+     * @len is zero for a flush of the whole TLB, otherwise the flush
+     * covered the @len bytes from @addr.  Targets that cache anything
+     * derived from the guest page tables outside of the TLB drop it here.
+     */
+    void (*tlb_flushed)(CPUState *cpu, uint16_t idxmap,
+                        vaddr addr, vaddr len);
+
+    /**
+     * @tlb_root: Set @root to the base of the translation table that maps
+     * @addr in @mmu_idx, and return true; return false if the translation
+     * may not be shared.  The shared TLB (tlb-shared) keys its entries on
+     * this as well as on the address space tag.  Without it, nothing is
+     * shared.
+     */
+    bool (*tlb_root)(CPUState *cpu, int mmu_idx, vaddr addr, uint64_t *root);
+
+    /**
+     * @translate_async: true if the translator may run on a thread other
+     * than the vCPU's own, while the vCPU is executing.  Everything the
+     * translator reads from the CPU state must then be either constant or
+     * covered by the TB flags; anything else must be guarded with
+     * translator_no_speculation().
+     */
+    bool translate_async;
+
+    /**
+     * @topology_cluster: Return an identifier shared by the CPUs of the
+     * guest cluster that @cpu belongs to, for placing vCPU threads on the
+     * host.  Without it, the -smp topology decides.
+     */
+    int64_t (*topology_cluster)(CPUState *cpu);
 #else
     /**
      * record_sigsegv:
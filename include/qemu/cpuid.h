@@ -25,12 +25,18 @@
 #endif
 
 /* Leaf 1, %ecx */
+#ifndef bit_PCLMUL
+#define bit_PCLMUL      (1 << 1)
+#endif
 #ifndef bit_SSE4_1
 #define bit_SSE4_1      (1 << 19)
 #endif
 #ifndef bit_MOVBE
 #define bit_MOVBE       (1 << 22)
 #endif
+#ifndef bit_AES
+#define bit_AES         (1 << 25)
+#endif
 #ifndef bit_OSXSAVE
 #define bit_OSXSAVE     (1 << 27)
 #endif
@@ -48,12 +54,18 @@
 #ifndef bit_BMI2
 #define bit_BMI2        (1 << 8)
 #endif
+#ifndef bit_RTM
+#define bit_RTM         (1 << 11)
+#endif
 #ifndef bit_AVX512F
 #define bit_AVX512F     (1 << 16)
 #endif
 #ifndef bit_AVX512DQ
 #define bit_AVX512DQ    (1 << 17)
 #endif
+#ifndef bit_SHA
+#define bit_SHA         (1 << 29)
+#endif
 #ifndef bit_AVX512BW
 #define bit_AVX512BW    (1 << 30)
 #endif
@@ -66,6 +78,11 @@
 #define bit_AVX512VBMI2 (1 << 6)
 #endif
 
+/* Leaf 7, %edx */
+#ifndef bit_RTM_ALWAYS_ABORT
+#define bit_RTM_ALWAYS_ABORT (1 << 11)
+#endif
+
 /* Leaf 0x80000001, %ecx */
 #ifndef bit_LZCNT
 #define bit_LZCNT       (1 << 5)
@@ -0,0 +1,62 @@
+/*
+ * Host instructions for AES, SHA and carry-less multiplication
+ *
+ * Each function below computes the same result as the Arm instruction
+ * it is named after, on 128-bit values laid out as in the Arm vector
+ * registers of the TCG cpu state.  A function may only be called if
+ * host_crypto_has() is true for its group of instructions.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef QEMU_HOST_CRYPTO_H
+#define QEMU_HOST_CRYPTO_H
+
+#define HOST_CRYPTO_AES     (1u << 0)
+#define HOST_CRYPTO_PMULL   (1u << 1)
+#define HOST_CRYPTO_SHA1    (1u << 2)
+#define HOST_CRYPTO_SHA256  (1u << 3)
+#define HOST_CRYPTO_SHA512  (1u << 4)
+
+/* The logical function of SHA1C, SHA1P and SHA1M */
+typedef enum HostCryptoSHA1Op {
+    HOST_CRYPTO_SHA1C,
+    HOST_CRYPTO_SHA1P,
+    HOST_CRYPTO_SHA1M,
+} HostCryptoSHA1Op;
+
+/* HOST_CRYPTO_* instructions found on the host at startup */
+extern unsigned host_crypto_caps;
+
+static inline bool host_crypto_has(unsigned caps)
+{
+#ifdef CONFIG_HOST_CRYPTO_OPT
+    return (host_crypto_caps & caps) == caps;
+#else
+    return false;
+#endif
+}
+
+/* AESE and AESD */
+void host_crypto_aese(uint64_t *rd, const uint64_t *rn,
+                      const uint64_t *rm, bool decrypt);
+/* AESMC and AESIMC */
+void host_crypto_aesmc(uint64_t *rd, const uint64_t *rm, bool decrypt);
+/* PMULL of two 64-bit elements */
+void host_crypto_pmull_64(uint64_t *rd, uint64_t n, uint64_t m);
+/* SHA1C, SHA1P and SHA1M */
+void host_crypto_sha1(uint64_t *rd, const uint64_t *rn,
+                      const uint64_t *rm, HostCryptoSHA1Op op);
+/* SHA256H and SHA256H2 */
+void host_crypto_sha256h(uint64_t *rd, const uint64_t *rn,
+                         const uint64_t *rm, bool h2);
+/* SHA512H, SHA512H2, SHA512SU0 and SHA512SU1 */
+void host_crypto_sha512h(uint64_t *rd, const uint64_t *rn,
+                         const uint64_t *rm);
+void host_crypto_sha512h2(uint64_t *rd, const uint64_t *rn,
+                          const uint64_t *rm);
+void host_crypto_sha512su0(uint64_t *rd, const uint64_t *rn);
+void host_crypto_sha512su1(uint64_t *rd, const uint64_t *rn,
+                           const uint64_t *rm);
+
+#endif /* QEMU_HOST_CRYPTO_H */
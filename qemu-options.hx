@@ -182,8 +182,18 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                igd-passthru=on|off (enable Xen integrated Intel graphics passthrough, default=off)\n"
     "                kernel-irqchip=on|off|split controls accelerated irqchip support (default=on)\n"
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
+    "                halt-poll-ns=n (max TCG halt polling time, default=0)\n"
+    "                hot-threshold=n (retranslate TCG blocks run n times)\n"
+    "                pin-threads=on|off (place TCG threads by host topology)\n"
+    "                return-stack=on|off (predict TCG guest returns, default=on)\n"
+    "                smc-threshold=n (unprotect TCG code pages, default=0)\n"
+    "                spec-translate=n (TCG threads translating ahead, default=0)\n"
+    "                spin-threshold=n (TCG spin loops run before a yield, default=0)\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
+    "                tb-cache=file (measure TCG retranslation across runs)\n"
     "                tb-size=n (TCG translation block cache size)\n"
+    "                tlb-shared=on|off (share TCG TLB entries between vCPUs)\n"
+    "                tlb-tags=n (TCG TLBs kept per guest ASID, default=0)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
 SRST
@@ -209,15 +219,111 @@ SRST
     ``kvm-shadow-mem=size``
         Defines the size of the KVM shadow MMU.
 
+    ``halt-poll-ns=n``
+        Lets a halted TCG vCPU thread poll for work for up to ``n``
+        nanoseconds before it goes to sleep, so that an interrupt shortly
+        after a WFI or HLT does not have to wake the thread up. The
+        polling time of each vCPU adapts to the length of its halts
+        between 0 and ``n``. The default of 0 disables this. Requires
+        ``thread=multi``. The polling time, and the halts that polling
+        caught or missed, are reported by ``info jit``.
+
+    ``hot-threshold=n``
+        Retranslates a TCG translation block with a more expensive
+        optimization pipeline once it has been executed ``n`` times.
+        The default of 0 disables this. The number of retranslated
+        blocks is reported by ``info jit``.
+
+    ``pin-threads=on|off``
+        Pins each TCG vCPU thread to a domain of host CPUs that share a
+        last level cache, or a package if the cache topology is unknown.
+        The vCPUs of one guest cluster share a domain, and the clusters
+        are spread over the domains in turn. On Arm, the cluster of a
+        vCPU is given by its MPIDR affinity, other targets use the
+        ``-smp`` cores and threads. The main loop thread, and the
+        threads it starts, stay on the first domain; the
+        ``spec-translate`` threads are spread over all of them.
+        Requires ``thread=multi`` and a Linux host. The default is off.
+        The domain, current host CPU and observed migrations of each
+        thread are reported by ``info jit``.
+
+    ``return-stack=on|off``
+        Controls the return address stack used to predict the target of
+        guest function returns. Calls push their return address, and a
+        return whose target matches the top entry jumps straight to the
+        translated code of the caller. Mispredicted returns take the
+        normal lookup path. The default is on; turning it off can help
+        when debugging control flow. Hits and misses are reported by
+        ``info jit``. Only implemented for AArch64 guests.
+
+    ``smc-threshold=n``
+        Stops write protecting a guest page with translated code once
+        ``n`` writes to it have missed the code, as happens when code and
+        often written data share a page. The blocks translated from the
+        page then check on entry that their code did not change instead,
+        so that writes to the page no longer take the slow path. A block
+        that cannot do this check protects the page again. The default
+        of 0 disables this. Writes that took the slow path and the pages
+        that stopped being protected are reported by ``info jit``. Not
+        supported for targets with precise self-modifying code semantics,
+        such as x86.
+
+    ``spec-translate=n``
+        Starts ``n`` helper threads that translate the targets of direct
+        jumps ahead of time, so that vCPUs find them already translated.
+        Requires ``thread=multi``. The default of 0 disables this. The
+        number of speculative translations that were later used and
+        that were wasted is reported by ``info jit``. Only implemented
+        for Arm guests.
+
+    ``spin-threshold=n``
+        Detects guest spin loops at translation time: short loops back to
+        their own start that only load, compare and branch. Once such a
+        loop has run ``n`` times in a row, the vCPU gives up the host
+        CPU. With ``thread=multi`` its thread yields to other host
+        threads, so that a vCPU holding the awaited lock can get to run
+        on an overcommitted host. With round-robin TCG the next vCPU is
+        scheduled. The default of 0 disables this. The number of spin
+        loops found and of yields is reported by ``info jit``.
+
     ``split-wx=on|off``
         Controls the use of split w^x mapping for the TCG code generation
         buffer. Some operating systems require this to be enabled, and in
         such a case this will default on. On other operating systems, this
         will default off, but one may enable this for testing or debugging.
 
+    ``tb-cache=file``
+        Records a digest of every block translated by TCG in ``file`` at
+        exit, and checks each translation of the next run against it.
+        The number of translations that repeat the previous run and the
+        host time spent on them are reported by ``info jit``.  This only
+        measures: cached translations are not reused, so every block is
+        still translated and the run is not made faster.
+
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
+    ``tlb-shared=on|off``
+        Enters the translations of tagged guest address spaces (see
+        ``tlb-tags``, which this requires) in a second-level TLB shared by
+        all vCPUs. A vCPU that misses in its own TLB then uses the
+        translation another vCPU already looked up for the same address
+        space instead of walking the guest page tables again. Any TLB
+        flush on any vCPU invalidates the matching shared entries.
+        Entries are keyed on the address space tag and on the base of
+        the translation table, so vCPUs that use one tag for different
+        page tables do not share them. The default is off. ``info jit``
+        reports the hits and misses of each vCPU.
+
+    ``tlb-tags=n``
+        Keeps the TLB entries of up to ``n`` guest address spaces per MMU
+        mode when the guest switches between them, instead of flushing
+        the TLB on every switch. Entries set aside are dropped by any
+        full TLB flush. The default of 0 disables this. The number of
+        switches, and of those that found their entries still kept, is
+        reported by ``info jit``. Only implemented for AArch64 guests,
+        where address spaces are identified by their ASID.
+
     ``thread=single|multi``
         Controls number of TCG threads. When the TCG is multi-threaded
         there will be one thread per vCPU therefore taking advantage of
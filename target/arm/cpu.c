@@ -84,10 +84,12 @@ static bool arm_cpu_has_work(CPUState *cs)
     ARMCPU *cpu = ARM_CPU(cs);
 
     return (cpu->power_state != PSCI_OFF)
-        && cs->interrupt_request &
-        (CPU_INTERRUPT_FIQ | CPU_INTERRUPT_HARD
-         | CPU_INTERRUPT_VFIQ | CPU_INTERRUPT_VIRQ | CPU_INTERRUPT_VSERR
-         | CPU_INTERRUPT_EXITTB);
+        && ((cs->interrupt_request &
+             (CPU_INTERRUPT_FIQ | CPU_INTERRUPT_HARD
+              | CPU_INTERRUPT_VFIQ | CPU_INTERRUPT_VIRQ | CPU_INTERRUPT_VSERR
+              | CPU_INTERRUPT_EXITTB))
+            || (qatomic_read(&cpu->wfe_waiting)
+                && qatomic_read(&cpu->env.event_register)));
 }
 
 void arm_register_pre_el_change_hook(ARMCPU *cpu, ARMELChangeHookFn *hook,
@@ -1167,6 +1169,9 @@ static void arm_cpu_initfn(Object *obj)
                              "gicv3-maintenance-interrupt", 1);
     qdev_init_gpio_out_named(DEVICE(cpu), &cpu->pmu_interrupt,
                              "pmu-interrupt", 1);
+
+    /* Generation 0 would match the zeroed walk cache entries */
+    cpu->walk_cache_gen = 1;
 #endif
 
     /* DTB consumers generally don't in fact care what the 'compatible'
@@ -1435,6 +1440,9 @@ static void arm_cpu_finalizefn(Object *obj)
     if (cpu->pmu_timer) {
         timer_free(cpu->pmu_timer);
     }
+    if (cpu->wfe_timer) {
+        timer_free(cpu->wfe_timer);
+    }
 #endif
 }
 
@@ -1942,6 +1950,10 @@ static void arm_cpu_realizefn(DeviceState *dev, Error **errp)
          */
         cpu->isar.id_aa64dfr0 =
             FIELD_DP64(cpu->isar.id_aa64dfr0, ID_AA64DFR0, PMSVER, 0);
+#ifndef CONFIG_USER_ONLY
+        cpu->wfe_timer = timer_new_ns(QEMU_CLOCK_REALTIME, arm_wfe_timer_cb,
+                                      cpu);
+#endif
     }
 
     /* MPU can be configured out of a PMSA CPU either by setting has-mpu
@@ -2135,6 +2147,14 @@ static const struct SysemuCPUOps arm_sysemu_ops = {
 #endif
 
 #ifdef CONFIG_TCG
+#ifndef CONFIG_USER_ONLY
+/* Aff1 and above of the MPIDR name the cluster of the CPU. */
+static int64_t arm_cpu_topology_cluster(CPUState *cs)
+{
+    return ARM_CPU(cs)->mp_affinity >> ARM_AFF1_SHIFT;
+}
+#endif
+
 static const struct TCGCPUOps arm_tcg_ops = {
     .initialize = arm_translate_init,
     .synchronize_from_tb = arm_cpu_synchronize_from_tb,
@@ -2152,6 +2172,10 @@ static const struct TCGCPUOps arm_tcg_ops = {
     .adjust_watchpoint_address = arm_adjust_watchpoint_address,
     .debug_check_watchpoint = arm_debug_check_watchpoint,
     .debug_check_breakpoint = arm_debug_check_breakpoint,
+    .tlb_flushed = arm_cpu_tlb_flushed,
+    .tlb_root = arm_cpu_tlb_root,
+    .translate_async = true,
+    .topology_cluster = arm_cpu_topology_cluster,
 #endif /* !CONFIG_USER_ONLY */
 };
 #endif /* CONFIG_TCG */
@@ -217,6 +217,21 @@ typedef struct ARMPredicateReg {
 typedef struct ARMPACKey {
     uint64_t lo, hi;
 } ARMPACKey;
+
+#define ARM_PAC_CACHE_SIZE  64
+
+typedef struct ARMPACCacheEntry {
+    uint64_t data;
+    uint64_t modifier;
+    uint64_t pac;
+} ARMPACCacheEntry;
+
+/* PACs recently computed with one key, while it had the value @key. */
+typedef struct ARMPACCache {
+    ARMPACKey key;
+    uint64_t valid; /* bitmap of the valid entries */
+    ARMPACCacheEntry entry[ARM_PAC_CACHE_SIZE];
+} ARMPACCache;
 #endif
 
 /* See the commentary above the TBFLAG field definitions.  */
@@ -664,6 +679,10 @@ typedef struct CPUArchState {
     uint64_t exclusive_addr;
     uint64_t exclusive_val;
     uint64_t exclusive_high;
+    /* Bytes covered by the exclusive monitor, 0 if not known. */
+    uint32_t exclusive_size;
+    /* Event register for WFE, which SEV on any vCPU sets. */
+    uint32_t event_register;
 
     /* iwMMXt coprocessor state.  */
     struct {
@@ -809,6 +828,30 @@ typedef struct {
     uint32_t map, init, supported;
 } ARMVQMap;
 
+/*
+ * Page table walk cache.  Each entry remembers where the walk for a
+ * range of input addresses continues after the table descriptors of
+ * the levels above @level, so that a later walk through the same tables
+ * can start from there.  Entries are only valid while @gen matches
+ * ARMCPU::walk_cache_gen; see ptw.c.
+ */
+#define ARM_WALK_CACHE_BITS 8
+#define ARM_WALK_CACHE_SIZE (1 << ARM_WALK_CACHE_BITS)
+
+typedef struct ARMWalkCacheEntry {
+    uint64_t va;            /* input address bits resolved by the entry */
+    uint64_t va_mask;
+    uint64_t ttbr;          /* TTBR of the walk, which holds the ASID */
+    uint64_t vttbr;         /* VTTBR (VMID) if the walk is stage 1 of 2 */
+    uint64_t tcr;
+    uint64_t descaddr;      /* base address of the level @level table */
+    uint32_t tableattrs;    /* table attributes gathered above @level */
+    uint32_t gen;
+    uint8_t mmu_idx;        /* ARMMMUIdx of the walk */
+    uint8_t level;
+    bool aarch64;
+} ARMWalkCacheEntry;
+
 /**
  * ARMCPU:
  * @env: #CPUARMState
@@ -855,6 +898,25 @@ struct ArchCPU {
      * pmu_op_finish() - it does not need other handling during migration
      */
     QEMUTimer *pmu_timer;
+    /*
+     * State of a WFE sleeping until an event, protected by the BQL.
+     * The timer bounds the sleep and polls the location watched by the
+     * exclusive monitor, if it is in RAM, for stores by other vCPUs.
+     */
+    QEMUTimer *wfe_timer;
+    bool wfe_waiting;
+    bool wfe_big_endian;
+    void *wfe_host;
+    MemoryRegion *wfe_mr;
+    int64_t wfe_start_ns;
+    int64_t wfe_deadline_ns;
+#ifdef TARGET_AARCH64
+    /*
+     * PAC memo for each of env->keys, in order.  Only the vCPU thread
+     * uses it, and it drops the entries of a key once that key changes.
+     */
+    ARMPACCache pac_cache[5];
+#endif
     /* GPIO outputs for generic timer */
     qemu_irq gt_timer_outputs[NUM_GTIMERS];
     /* GPIO output for GICv3 maintenance interrupt signal */
@@ -1065,6 +1127,12 @@ struct ArchCPU {
 
     /* Generic timer counter frequency, in Hz */
     uint64_t gt_cntfrq_hz;
+
+#ifndef CONFIG_USER_ONLY
+    /* Only accessed from the vCPU thread, see ptw.c */
+    ARMWalkCacheEntry walk_cache[ARM_WALK_CACHE_SIZE];
+    uint32_t walk_cache_gen;
+#endif
 };
 
 unsigned int gt_cntfrq_period_ns(ARMCPU *cpu);
@@ -915,6 +915,8 @@ void HELPER(exception_return)(CPUARMState *env, uint64_t new_pc)
     aarch64_save_sp(env, cur_el);
 
     arm_clear_exclusive(env);
+    /* An exception return is a WFE wakeup event. */
+    qatomic_set(&env->event_register, 1);
 
     /* We must squash the PSTATE.SS bit to zero unless both of the
      * following hold:
@@ -3649,6 +3649,32 @@ static void vmsa_tcr_el12_write(CPUARMState *env, const ARMCPRegInfo *ri,
     raw_write(env, ri, value);
 }
 
+/*
+ * Return the TLB tag for the ASID in bits [63:48] of @value, a TTBRn_EL1
+ * or TLBI operand, as used by the EL1&0 regime: TCR_EL1.AS clear selects
+ * 8-bit ASIDs.  The current VMID fills the top half, so that the same
+ * ASID in two guests of a hypervisor gives two tags; tagged entries may
+ * be shared between vCPUs.
+ */
+static uint32_t aa64_el1_tag(CPUARMState *env, uint64_t value)
+{
+    uint16_t asid = extract64(value, 48, 16);
+
+    if (!extract64(env->cp15.tcr_el[1], 36, 1)) {
+        asid = (uint8_t)asid;
+    }
+    return deposit32(asid, 16, 16, extract64(env->cp15.vttbr_el2, 48, 16));
+}
+
+/* Return the TLB tag of the EL1&0 regime, per TCR_EL1.A1. */
+static uint32_t aa64_el1_cur_tag(CPUARMState *env)
+{
+    if (env->cp15.tcr_el[1] & TTBCR_A1) {
+        return aa64_el1_tag(env, env->cp15.ttbr1_el[1]);
+    }
+    return aa64_el1_tag(env, env->cp15.ttbr0_el[1]);
+}
+
 static void vmsa_ttbr_write(CPUARMState *env, const ARMCPRegInfo *ri,
                             uint64_t value)
 {
@@ -3656,6 +3682,28 @@ static void vmsa_ttbr_write(CPUARMState *env, const ARMCPRegInfo *ri,
     if (cpreg_field_is_64bit(ri) &&
         extract64(raw_read(env, ri) ^ value, 48, 16) != 0) {
         ARMCPU *cpu = env_archcpu(env);
+
+        /*
+         * With tagged TLBs, only the EL1&0 regime translates with
+         * TTBRn_EL1, and only if the ASID in use changes do its TLBs
+         * switch to those of the new ASID.
+         */
+        if (ri->state == ARM_CP_STATE_AA64 && tlb_tags_enabled()) {
+            uint16_t mask = ARMMMUIdxBit_E10_1 |
+                            ARMMMUIdxBit_E10_1_PAN |
+                            ARMMMUIdxBit_E10_0;
+            uint32_t old_tag = aa64_el1_cur_tag(env);
+            uint32_t new_tag;
+
+            raw_write(env, ri, value);
+            new_tag = aa64_el1_cur_tag(env);
+            if (new_tag != old_tag) {
+                tlb_switch_tag_by_mmuidx(CPU(cpu),
+                                         mask | mask >> ARM_MMU_IDX_A_NS,
+                                         old_tag, new_tag);
+            }
+            return;
+        }
         tlb_flush(CPU(cpu));
     }
     raw_write(env, ri, value);
@@ -4234,6 +4282,34 @@ static void tlbi_aa64_vmalle1_write(CPUARMState *env, const ARMCPRegInfo *ri,
     }
 }
 
+static void tlbi_aa64_aside1is_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                     uint64_t value)
+{
+    CPUState *cs = env_cpu(env);
+    int mask = vae1_tlbmask(env);
+
+    tlb_flush_tag_by_mmuidx_all_cpus_synced(cs, mask,
+                                            aa64_el1_tag(env, value));
+}
+
+static void tlbi_aa64_aside1_write(CPUARMState *env, const ARMCPRegInfo *ri,
+                                   uint64_t value)
+{
+    /*
+     * Invalidate by ASID, EL1&0.  Global entries of the current ASID
+     * are invalidated as well, since entries are not tagged one by one.
+     */
+    CPUState *cs = env_cpu(env);
+    int mask = vae1_tlbmask(env);
+    uint32_t tag = aa64_el1_tag(env, value);
+
+    if (tlb_force_broadcast(env)) {
+        tlb_flush_tag_by_mmuidx_all_cpus_synced(cs, mask, tag);
+    } else {
+        tlb_flush_tag_by_mmuidx(cs, mask, tag);
+    }
+}
+
 static int alle1_tlbmask(CPUARMState *env)
 {
     /*
@@ -4770,7 +4846,7 @@ static const ARMCPRegInfo v8_cp_reginfo[] = {
     { .name = "TLBI_ASIDE1IS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 3, .opc2 = 2,
       .access = PL1_W, .accessfn = access_ttlb, .type = ARM_CP_NO_RAW,
-      .writefn = tlbi_aa64_vmalle1is_write },
+      .writefn = tlbi_aa64_aside1is_write },
     { .name = "TLBI_VAAE1IS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 3, .opc2 = 3,
       .access = PL1_W, .accessfn = access_ttlb, .type = ARM_CP_NO_RAW,
@@ -4794,7 +4870,7 @@ static const ARMCPRegInfo v8_cp_reginfo[] = {
     { .name = "TLBI_ASIDE1", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 7, .opc2 = 2,
       .access = PL1_W, .accessfn = access_ttlb, .type = ARM_CP_NO_RAW,
-      .writefn = tlbi_aa64_vmalle1_write },
+      .writefn = tlbi_aa64_aside1_write },
     { .name = "TLBI_VAAE1", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 7, .opc2 = 3,
       .access = PL1_W, .accessfn = access_ttlb, .type = ARM_CP_NO_RAW,
@@ -6637,7 +6713,7 @@ static const ARMCPRegInfo tlbios_reginfo[] = {
     { .name = "TLBI_ASIDE1OS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 1, .opc2 = 2,
       .access = PL1_W, .type = ARM_CP_NO_RAW,
-      .writefn = tlbi_aa64_vmalle1is_write },
+      .writefn = tlbi_aa64_aside1is_write },
     { .name = "TLBI_VAAE1OS", .state = ARM_CP_STATE_AA64,
       .opc0 = 1, .opc1 = 0, .crn = 8, .crm = 1, .opc2 = 3,
       .access = PL1_W, .type = ARM_CP_NO_RAW,
@@ -561,6 +561,9 @@ void arm_cpu_record_sigbus(CPUState *cpu, vaddr addr,
 bool arm_cpu_tlb_fill(CPUState *cs, vaddr address, int size,
                       MMUAccessType access_type, int mmu_idx,
                       bool probe, uintptr_t retaddr);
+void arm_cpu_tlb_flushed(CPUState *cs, uint16_t idxmap,
+                         vaddr addr, vaddr len);
+bool arm_cpu_tlb_root(CPUState *cs, int mmu_idx, vaddr addr, uint64_t *root);
 #endif
 
 static inline int arm_to_core_mmu_idx(ARMMMUIdx mmu_idx)
@@ -1151,6 +1154,9 @@ bool get_phys_addr(CPUARMState *env, target_ulong address,
 
 void arm_log_exception(CPUState *cs);
 
+/* Polls the wakeup conditions of a vCPU sleeping in WFE. */
+void arm_wfe_timer_cb(void *opaque);
+
 #endif /* !CONFIG_USER_ONLY */
 
 /*
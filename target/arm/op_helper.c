@@ -24,6 +24,7 @@
 #include "exec/exec-all.h"
 #include "exec/cpu_ldst.h"
 #include "cpregs.h"
+#include "trace.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -353,18 +354,246 @@ void HELPER(wfi)(CPUARMState *env, uint32_t insn_len)
 #endif
 }
 
-void HELPER(wfe)(CPUARMState *env)
+#ifndef CONFIG_USER_ONLY
+/*
+ * WFE with MTTCG.  A vCPU waiting for an event halts like for WFI, with
+ * its PC left on the WFE so that the instruction runs again once woken.
+ * It is then woken by SEV on another vCPU, by an interrupt, or by the
+ * WFE timer.  The timer polls the location of the exclusive monitor for
+ * a store by another vCPU, which would clear the monitor and generate
+ * an event, and bounds the sleep like the generic timer event stream
+ * of real hardware does.
+ */
+
+/* Polls of the exclusive monitor location before halting. */
+#define ARM_WFE_SPIN        256
+#define ARM_WFE_POLL_NS     (20 * SCALE_US)
+#define ARM_WFE_TIMEOUT_NS  (1 * SCALE_MS)
+
+/* Return true if the location of the exclusive monitor was written. */
+static bool arm_wfe_monitor_changed(ARMCPU *cpu)
+{
+    CPUARMState *env = &cpu->env;
+    const void *host = cpu->wfe_host;
+    uint64_t val, high;
+
+    switch (env->exclusive_size) {
+    case 1:
+    case 2:
+    case 4:
+    case 8:
+        val = cpu->wfe_big_endian ? ldn_be_p(host, env->exclusive_size)
+                                  : ldn_le_p(host, env->exclusive_size);
+        return val != env->exclusive_val;
+    case 16:
+        val = cpu->wfe_big_endian ? ldq_be_p(host) : ldq_le_p(host);
+        high = cpu->wfe_big_endian ? ldq_be_p(host + 8) : ldq_le_p(host + 8);
+        return val != env->exclusive_val || high != env->exclusive_high;
+    default:
+        return false;
+    }
+}
+
+/* Find the host address of the exclusive monitor, if it is in RAM. */
+static void arm_wfe_watch(ARMCPU *cpu)
+{
+    CPUARMState *env = &cpu->env;
+    ram_addr_t offset;
+    void *host;
+
+    /* BE32 sub-word accesses are address swizzled; don't bother. */
+    if (env->exclusive_addr == -1 || env->exclusive_size == 0 ||
+        arm_sctlr_b(env)) {
+        return;
+    }
+    host = tlb_vaddr_to_host(env, env->exclusive_addr, MMU_DATA_LOAD,
+                             cpu_mmu_index(env, false));
+    if (host) {
+        cpu->wfe_mr = memory_region_from_host(host, &offset);
+        if (cpu->wfe_mr) {
+            memory_region_ref(cpu->wfe_mr);
+            cpu->wfe_big_endian = arm_cpu_data_is_big_endian(env);
+            cpu->wfe_host = host;
+        }
+    }
+}
+
+static void arm_wfe_unwatch(ARMCPU *cpu)
+{
+    if (cpu->wfe_mr) {
+        memory_region_unref(cpu->wfe_mr);
+        cpu->wfe_mr = NULL;
+    }
+    cpu->wfe_host = NULL;
+}
+
+/* Called with the BQL held. */
+static void arm_wfe_end(ARMCPU *cpu)
+{
+    arm_wfe_unwatch(cpu);
+    timer_del(cpu->wfe_timer);
+    qatomic_set(&cpu->wfe_waiting, false);
+    trace_arm_wfe_end(CPU(cpu)->cpu_index,
+                      qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                      cpu->wfe_start_ns);
+}
+
+void arm_wfe_timer_cb(void *opaque)
+{
+    ARMCPU *cpu = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    bool changed;
+
+    if (!cpu->wfe_waiting) {
+        return;
+    }
+    changed = cpu->wfe_host && arm_wfe_monitor_changed(cpu);
+    if (changed || now >= cpu->wfe_deadline_ns) {
+        trace_arm_wfe_wake(CPU(cpu)->cpu_index,
+                           changed ? "monitor" : "timeout");
+        qatomic_set(&cpu->env.event_register, 1);
+        qemu_cpu_kick(CPU(cpu));
+        return;
+    }
+    timer_mod(cpu->wfe_timer, now + ARM_WFE_POLL_NS);
+}
+
+/*
+ * Wait a little for an event before halting, since lock handovers are
+ * often quicker than a trip through the halt path.
+ */
+static bool arm_wfe_spin(ARMCPU *cpu)
+{
+    CPUState *cs = CPU(cpu);
+    int i;
+
+    for (i = 0; i < ARM_WFE_SPIN; i++) {
+        if (qatomic_read(&cpu->env.event_register) ||
+            qatomic_read(&cs->interrupt_request) ||
+            (cpu->wfe_host && arm_wfe_monitor_changed(cpu))) {
+            return true;
+        }
+        cpu_relax();
+    }
+    return false;
+}
+
+static void arm_wfe_mttcg(CPUARMState *env, uint32_t insn_len)
+{
+    ARMCPU *cpu = env_archcpu(env);
+    CPUState *cs = env_cpu(env);
+    int target_el;
+
+    if (qatomic_xchg(&env->event_register, 0) || cpu_has_work(cs)) {
+        goto done;
+    }
+
+    target_el = check_wfx_trap(env, true);
+    if (target_el) {
+        if (env->aarch64) {
+            env->pc -= insn_len;
+        } else {
+            env->regs[15] -= insn_len;
+        }
+        raise_exception(env, EXCP_UDEF, syn_wfx(1, 0xe, 1, insn_len == 2),
+                        target_el);
+    }
+
+    /* wfe_waiting is only set and cleared by this thread. */
+    if (!cpu->wfe_waiting) {
+        arm_wfe_watch(cpu);
+        if (arm_wfe_spin(cpu)) {
+            arm_wfe_unwatch(cpu);
+            qatomic_set(&env->event_register, 0);
+            return;
+        }
+    }
+
+    qemu_mutex_lock_iothread();
+    if (!cpu->wfe_waiting) {
+        cpu->wfe_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        cpu->wfe_deadline_ns = cpu->wfe_start_ns + ARM_WFE_TIMEOUT_NS;
+        timer_mod(cpu->wfe_timer, cpu->wfe_start_ns + ARM_WFE_POLL_NS);
+        trace_arm_wfe_sleep(cs->cpu_index, cpu->wfe_host ?
+                            env->exclusive_addr : -1);
+    }
+    /* Pairs with the barrier in HELPER(sev). */
+    qatomic_mb_set(&cpu->wfe_waiting, true);
+    if (qatomic_read(&env->event_register)) {
+        qatomic_set(&env->event_register, 0);
+        arm_wfe_end(cpu);
+        qemu_mutex_unlock_iothread();
+        return;
+    }
+    qemu_mutex_unlock_iothread();
+
+    /* Run the WFE again when woken up. */
+    if (env->aarch64) {
+        env->pc -= insn_len;
+    } else {
+        env->regs[15] -= insn_len;
+    }
+    cs->exception_index = EXCP_HLT;
+    cs->halted = 1;
+    cpu_loop_exit(cs);
+
+done:
+    if (qatomic_read(&cpu->wfe_waiting)) {
+        qemu_mutex_lock_iothread();
+        arm_wfe_end(cpu);
+        qemu_mutex_unlock_iothread();
+    }
+}
+#endif
+
+void HELPER(wfe)(CPUARMState *env, uint32_t insn_len)
 {
-    /* This is a hint instruction that is semantically different
-     * from YIELD even though we currently implement it identically.
-     * Don't actually halt the CPU, just yield back to top
-     * level loop. This is not going into a "low power state"
-     * (ie halting until some event occurs), so we never take
-     * a configurable trap to a different exception level.
+#ifndef CONFIG_USER_ONLY
+    if (qemu_tcg_mttcg_enabled() && !arm_feature(env, ARM_FEATURE_M)) {
+        arm_wfe_mttcg(env, insn_len);
+        return;
+    }
+#endif
+    /*
+     * Otherwise, don't actually halt the CPU, just yield back to top
+     * level loop so that the next round-robin scheduled vCPU gets a
+     * crack.  This is not going into a "low power state" (ie halting
+     * until some event occurs), so we never take a configurable trap
+     * to a different exception level.
      */
     HELPER(yield)(env);
 }
 
+void HELPER(sev)(CPUARMState *env)
+{
+#ifndef CONFIG_USER_ONLY
+    CPUState *cs;
+    bool wake = false;
+
+    if (!qemu_tcg_mttcg_enabled()) {
+        return;
+    }
+    CPU_FOREACH(cs) {
+        qatomic_set(&ARM_CPU(cs)->env.event_register, 1);
+    }
+    /* Pairs with the barrier in arm_wfe_mttcg. */
+    smp_mb();
+    CPU_FOREACH(cs) {
+        wake |= qatomic_read(&ARM_CPU(cs)->wfe_waiting);
+    }
+    if (wake) {
+        qemu_mutex_lock_iothread();
+        CPU_FOREACH(cs) {
+            if (ARM_CPU(cs)->wfe_waiting) {
+                trace_arm_wfe_wake(cs->cpu_index, "sev");
+                qemu_cpu_kick(cs);
+            }
+        }
+        qemu_mutex_unlock_iothread();
+    }
+#endif
+}
+
 void HELPER(yield)(CPUARMState *env)
 {
     CPUState *cs = env_cpu(env);
@@ -432,6 +661,8 @@ void HELPER(cpsr_write_eret)(CPUARMState *env, uint32_t val)
 
     mask = aarch32_cpsr_valid_mask(env->features, &env_archcpu(env)->isar);
     cpsr_write(env, val, mask, CPSRWriteExceptionReturn);
+    /* An exception return is a WFE wakeup event. */
+    qatomic_set(&env->event_register, 1);
 
     /* Generated code has already stored the new PC value, but
      * without masking out its low bits, because which bits need
@@ -27,185 +27,178 @@
 #include "qemu/xxhash.h"
 
 
+/*
+ * The cell permutations move all the cells that travel the same distance
+ * with one shift and mask.
+ */
 static uint64_t pac_cell_shuffle(uint64_t i)
 {
-    uint64_t o = 0;
-
-    o |= extract64(i, 52, 4);
-    o |= extract64(i, 24, 4) << 4;
-    o |= extract64(i, 44, 4) << 8;
-    o |= extract64(i,  0, 4) << 12;
-
-    o |= extract64(i, 28, 4) << 16;
-    o |= extract64(i, 48, 4) << 20;
-    o |= extract64(i,  4, 4) << 24;
-    o |= extract64(i, 40, 4) << 28;
-
-    o |= extract64(i, 32, 4) << 32;
-    o |= extract64(i, 12, 4) << 36;
-    o |= extract64(i, 56, 4) << 40;
-    o |= extract64(i, 20, 4) << 44;
-
-    o |= extract64(i,  8, 4) << 48;
-    o |= extract64(i, 36, 4) << 52;
-    o |= extract64(i, 16, 4) << 56;
-    o |= extract64(i, 60, 4) << 60;
-
-    return o;
+    return (i & 0xf000000f00000000ull) |
+           ((i >> 12) & 0x00000000f00f0000ull) |
+           ((i & 0x000000000000000full) << 12) |
+           ((i >> 16) & 0x00000f0000000000ull) |
+           ((i & 0x000000f000000000ull) << 16) |
+           ((i >> 20) & 0x00000000000000f0ull) |
+           ((i & 0x00000000000000f0ull) << 20) |
+           ((i & 0x0000000000f0f000ull) << 24) |
+           ((i >> 28) & 0x0000000000f00000ull) |
+           ((i >> 36) & 0x0000000000000f00ull) |
+           ((i & 0x00000000000f0f00ull) << 40) |
+           ((i >> 52) & 0x000000000000000full);
 }
 
 static uint64_t pac_cell_inv_shuffle(uint64_t i)
 {
-    uint64_t o = 0;
-
-    o |= extract64(i, 12, 4);
-    o |= extract64(i, 24, 4) << 4;
-    o |= extract64(i, 48, 4) << 8;
-    o |= extract64(i, 36, 4) << 12;
-
-    o |= extract64(i, 56, 4) << 16;
-    o |= extract64(i, 44, 4) << 20;
-    o |= extract64(i,  4, 4) << 24;
-    o |= extract64(i, 16, 4) << 28;
-
-    o |= i & MAKE_64BIT_MASK(32, 4);
-    o |= extract64(i, 52, 4) << 36;
-    o |= extract64(i, 28, 4) << 40;
-    o |= extract64(i,  8, 4) << 44;
-
-    o |= extract64(i, 20, 4) << 48;
-    o |= extract64(i,  0, 4) << 52;
-    o |= extract64(i, 40, 4) << 56;
-    o |= i & MAKE_64BIT_MASK(60, 4);
-
-    return o;
+    return (i & 0xf000000f00000000ull) |
+           ((i >> 12) & 0x000000000000000full) |
+           ((i & 0x00000000f00f0000ull) << 12) |
+           ((i >> 16) & 0x000000f000000000ull) |
+           ((i & 0x00000f0000000000ull) << 16) |
+           ((i >> 20) & 0x00000000000000f0ull) |
+           ((i & 0x00000000000000f0ull) << 20) |
+           ((i >> 24) & 0x0000000000f0f000ull) |
+           ((i & 0x0000000000f00000ull) << 28) |
+           ((i & 0x0000000000000f00ull) << 36) |
+           ((i >> 40) & 0x00000000000f0f00ull) |
+           ((i & 0x000000000000000full) << 52);
 }
 
+/* The sbox applied to each cell, looked up two cells at a time. */
 static uint64_t pac_sub(uint64_t i)
 {
-    static const uint8_t sub[16] = {
-        0xb, 0x6, 0x8, 0xf, 0xc, 0x0, 0x9, 0xe,
-        0x3, 0x7, 0x4, 0x5, 0xd, 0x2, 0x1, 0xa,
+    static const uint8_t sub[256] = {
+        0xbb, 0xb6, 0xb8, 0xbf, 0xbc, 0xb0, 0xb9, 0xbe,
+        0xb3, 0xb7, 0xb4, 0xb5, 0xbd, 0xb2, 0xb1, 0xba,
+        0x6b, 0x66, 0x68, 0x6f, 0x6c, 0x60, 0x69, 0x6e,
+        0x63, 0x67, 0x64, 0x65, 0x6d, 0x62, 0x61, 0x6a,
+        0x8b, 0x86, 0x88, 0x8f, 0x8c, 0x80, 0x89, 0x8e,
+        0x83, 0x87, 0x84, 0x85, 0x8d, 0x82, 0x81, 0x8a,
+        0xfb, 0xf6, 0xf8, 0xff, 0xfc, 0xf0, 0xf9, 0xfe,
+        0xf3, 0xf7, 0xf4, 0xf5, 0xfd, 0xf2, 0xf1, 0xfa,
+        0xcb, 0xc6, 0xc8, 0xcf, 0xcc, 0xc0, 0xc9, 0xce,
+        0xc3, 0xc7, 0xc4, 0xc5, 0xcd, 0xc2, 0xc1, 0xca,
+        0x0b, 0x06, 0x08, 0x0f, 0x0c, 0x00, 0x09, 0x0e,
+        0x03, 0x07, 0x04, 0x05, 0x0d, 0x02, 0x01, 0x0a,
+        0x9b, 0x96, 0x98, 0x9f, 0x9c, 0x90, 0x99, 0x9e,
+        0x93, 0x97, 0x94, 0x95, 0x9d, 0x92, 0x91, 0x9a,
+        0xeb, 0xe6, 0xe8, 0xef, 0xec, 0xe0, 0xe9, 0xee,
+        0xe3, 0xe7, 0xe4, 0xe5, 0xed, 0xe2, 0xe1, 0xea,
+        0x3b, 0x36, 0x38, 0x3f, 0x3c, 0x30, 0x39, 0x3e,
+        0x33, 0x37, 0x34, 0x35, 0x3d, 0x32, 0x31, 0x3a,
+        0x7b, 0x76, 0x78, 0x7f, 0x7c, 0x70, 0x79, 0x7e,
+        0x73, 0x77, 0x74, 0x75, 0x7d, 0x72, 0x71, 0x7a,
+        0x4b, 0x46, 0x48, 0x4f, 0x4c, 0x40, 0x49, 0x4e,
+        0x43, 0x47, 0x44, 0x45, 0x4d, 0x42, 0x41, 0x4a,
+        0x5b, 0x56, 0x58, 0x5f, 0x5c, 0x50, 0x59, 0x5e,
+        0x53, 0x57, 0x54, 0x55, 0x5d, 0x52, 0x51, 0x5a,
+        0xdb, 0xd6, 0xd8, 0xdf, 0xdc, 0xd0, 0xd9, 0xde,
+        0xd3, 0xd7, 0xd4, 0xd5, 0xdd, 0xd2, 0xd1, 0xda,
+        0x2b, 0x26, 0x28, 0x2f, 0x2c, 0x20, 0x29, 0x2e,
+        0x23, 0x27, 0x24, 0x25, 0x2d, 0x22, 0x21, 0x2a,
+        0x1b, 0x16, 0x18, 0x1f, 0x1c, 0x10, 0x19, 0x1e,
+        0x13, 0x17, 0x14, 0x15, 0x1d, 0x12, 0x11, 0x1a,
+        0xab, 0xa6, 0xa8, 0xaf, 0xac, 0xa0, 0xa9, 0xae,
+        0xa3, 0xa7, 0xa4, 0xa5, 0xad, 0xa2, 0xa1, 0xaa,
     };
     uint64_t o = 0;
     int b;
 
-    for (b = 0; b < 64; b += 4) {
-        o |= (uint64_t)sub[(i >> b) & 0xf] << b;
+    for (b = 0; b < 64; b += 8) {
+        o |= (uint64_t)sub[(i >> b) & 0xff] << b;
     }
     return o;
 }
 
 static uint64_t pac_inv_sub(uint64_t i)
 {
-    static const uint8_t inv_sub[16] = {
-        0x5, 0xe, 0xd, 0x8, 0xa, 0xb, 0x1, 0x9,
-        0x2, 0x6, 0xf, 0x0, 0x4, 0xc, 0x7, 0x3,
+    static const uint8_t inv_sub[256] = {
+        0x55, 0x5e, 0x5d, 0x58, 0x5a, 0x5b, 0x51, 0x59,
+        0x52, 0x56, 0x5f, 0x50, 0x54, 0x5c, 0x57, 0x53,
+        0xe5, 0xee, 0xed, 0xe8, 0xea, 0xeb, 0xe1, 0xe9,
+        0xe2, 0xe6, 0xef, 0xe0, 0xe4, 0xec, 0xe7, 0xe3,
+        0xd5, 0xde, 0xdd, 0xd8, 0xda, 0xdb, 0xd1, 0xd9,
+        0xd2, 0xd6, 0xdf, 0xd0, 0xd4, 0xdc, 0xd7, 0xd3,
+        0x85, 0x8e, 0x8d, 0x88, 0x8a, 0x8b, 0x81, 0x89,
+        0x82, 0x86, 0x8f, 0x80, 0x84, 0x8c, 0x87, 0x83,
+        0xa5, 0xae, 0xad, 0xa8, 0xaa, 0xab, 0xa1, 0xa9,
+        0xa2, 0xa6, 0xaf, 0xa0, 0xa4, 0xac, 0xa7, 0xa3,
+        0xb5, 0xbe, 0xbd, 0xb8, 0xba, 0xbb, 0xb1, 0xb9,
+        0xb2, 0xb6, 0xbf, 0xb0, 0xb4, 0xbc, 0xb7, 0xb3,
+        0x15, 0x1e, 0x1d, 0x18, 0x1a, 0x1b, 0x11, 0x19,
+        0x12, 0x16, 0x1f, 0x10, 0x14, 0x1c, 0x17, 0x13,
+        0x95, 0x9e, 0x9d, 0x98, 0x9a, 0x9b, 0x91, 0x99,
+        0x92, 0x96, 0x9f, 0x90, 0x94, 0x9c, 0x97, 0x93,
+        0x25, 0x2e, 0x2d, 0x28, 0x2a, 0x2b, 0x21, 0x29,
+        0x22, 0x26, 0x2f, 0x20, 0x24, 0x2c, 0x27, 0x23,
+        0x65, 0x6e, 0x6d, 0x68, 0x6a, 0x6b, 0x61, 0x69,
+        0x62, 0x66, 0x6f, 0x60, 0x64, 0x6c, 0x67, 0x63,
+        0xf5, 0xfe, 0xfd, 0xf8, 0xfa, 0xfb, 0xf1, 0xf9,
+        0xf2, 0xf6, 0xff, 0xf0, 0xf4, 0xfc, 0xf7, 0xf3,
+        0x05, 0x0e, 0x0d, 0x08, 0x0a, 0x0b, 0x01, 0x09,
+        0x02, 0x06, 0x0f, 0x00, 0x04, 0x0c, 0x07, 0x03,
+        0x45, 0x4e, 0x4d, 0x48, 0x4a, 0x4b, 0x41, 0x49,
+        0x42, 0x46, 0x4f, 0x40, 0x44, 0x4c, 0x47, 0x43,
+        0xc5, 0xce, 0xcd, 0xc8, 0xca, 0xcb, 0xc1, 0xc9,
+        0xc2, 0xc6, 0xcf, 0xc0, 0xc4, 0xcc, 0xc7, 0xc3,
+        0x75, 0x7e, 0x7d, 0x78, 0x7a, 0x7b, 0x71, 0x79,
+        0x72, 0x76, 0x7f, 0x70, 0x74, 0x7c, 0x77, 0x73,
+        0x35, 0x3e, 0x3d, 0x38, 0x3a, 0x3b, 0x31, 0x39,
+        0x32, 0x36, 0x3f, 0x30, 0x34, 0x3c, 0x37, 0x33,
     };
     uint64_t o = 0;
     int b;
 
-    for (b = 0; b < 64; b += 4) {
-        o |= (uint64_t)inv_sub[(i >> b) & 0xf] << b;
+    for (b = 0; b < 64; b += 8) {
+        o |= (uint64_t)inv_sub[(i >> b) & 0xff] << b;
     }
     return o;
 }
 
-static int rot_cell(int cell, int n)
+/* Rotate each of the 16 cells in @i left by 1 and by 2 bits. */
+static uint64_t rot_cells_1(uint64_t i)
 {
-    /* 4-bit rotate left by n.  */
-    cell |= cell << 4;
-    return extract32(cell, 4 - n, 4);
+    return ((i << 1) & 0xeeeeeeeeeeeeeeeeull) |
+           ((i >> 3) & 0x1111111111111111ull);
 }
 
-static uint64_t pac_mult(uint64_t i)
+static uint64_t rot_cells_2(uint64_t i)
 {
-    uint64_t o = 0;
-    int b;
-
-    for (b = 0; b < 4 * 4; b += 4) {
-        int i0, i4, i8, ic, t0, t1, t2, t3;
-
-        i0 = extract64(i, b, 4);
-        i4 = extract64(i, b + 4 * 4, 4);
-        i8 = extract64(i, b + 8 * 4, 4);
-        ic = extract64(i, b + 12 * 4, 4);
-
-        t0 = rot_cell(i8, 1) ^ rot_cell(i4, 2) ^ rot_cell(i0, 1);
-        t1 = rot_cell(ic, 1) ^ rot_cell(i4, 1) ^ rot_cell(i0, 2);
-        t2 = rot_cell(ic, 2) ^ rot_cell(i8, 1) ^ rot_cell(i0, 1);
-        t3 = rot_cell(ic, 1) ^ rot_cell(i8, 2) ^ rot_cell(i4, 1);
-
-        o |= (uint64_t)t3 << b;
-        o |= (uint64_t)t2 << (b + 4 * 4);
-        o |= (uint64_t)t1 << (b + 8 * 4);
-        o |= (uint64_t)t0 << (b + 12 * 4);
-    }
-    return o;
+    return ((i << 2) & 0xccccccccccccccccull) |
+           ((i >> 2) & 0x3333333333333333ull);
 }
 
-static uint64_t tweak_cell_rot(uint64_t cell)
-{
-    return (cell >> 1) | (((cell ^ (cell >> 1)) & 1) << 3);
-}
-
-static uint64_t tweak_shuffle(uint64_t i)
+/*
+ * Each cell of the result is the xor of the other three cells in its
+ * column, rotated by 1, 2 and 1 bits when taken from the rows 1, 2 and
+ * 3 after it (wrapping around), so all 16 cells are computed at once by
+ * rotating whole rows into place.
+ */
+static uint64_t pac_mult(uint64_t i)
 {
-    uint64_t o = 0;
-
-    o |= extract64(i, 16, 4) << 0;
-    o |= extract64(i, 20, 4) << 4;
-    o |= tweak_cell_rot(extract64(i, 24, 4)) << 8;
-    o |= extract64(i, 28, 4) << 12;
+    uint64_t r1 = rot_cells_1(i);
 
-    o |= tweak_cell_rot(extract64(i, 44, 4)) << 16;
-    o |= extract64(i,  8, 4) << 20;
-    o |= extract64(i, 12, 4) << 24;
-    o |= tweak_cell_rot(extract64(i, 32, 4)) << 28;
-
-    o |= extract64(i, 48, 4) << 32;
-    o |= extract64(i, 52, 4) << 36;
-    o |= extract64(i, 56, 4) << 40;
-    o |= tweak_cell_rot(extract64(i, 60, 4)) << 44;
-
-    o |= tweak_cell_rot(extract64(i,  0, 4)) << 48;
-    o |= extract64(i,  4, 4) << 52;
-    o |= tweak_cell_rot(extract64(i, 40, 4)) << 56;
-    o |= tweak_cell_rot(extract64(i, 36, 4)) << 60;
-
-    return o;
+    return ror64(r1, 16) ^ ror64(rot_cells_2(i), 32) ^ ror64(r1, 48);
 }
 
-static uint64_t tweak_cell_inv_rot(uint64_t cell)
+/* Step the LFSR of each cell in @i, for the cells the tweak rotates. */
+static uint64_t tweak_cells_rot(uint64_t i)
 {
-    return ((cell << 1) & 0xf) | ((cell & 1) ^ (cell >> 3));
+    return ((i >> 1) & 0x7777777777777777ull) |
+           (((i ^ (i >> 1)) & 0x1111111111111111ull) << 3);
 }
 
-static uint64_t tweak_inv_shuffle(uint64_t i)
+static uint64_t tweak_shuffle(uint64_t i)
 {
-    uint64_t o = 0;
-
-    o |= tweak_cell_inv_rot(extract64(i, 48, 4));
-    o |= extract64(i, 52, 4) << 4;
-    o |= extract64(i, 20, 4) << 8;
-    o |= extract64(i, 24, 4) << 12;
-
-    o |= extract64(i,  0, 4) << 16;
-    o |= extract64(i,  4, 4) << 20;
-    o |= tweak_cell_inv_rot(extract64(i,  8, 4)) << 24;
-    o |= extract64(i, 12, 4) << 28;
-
-    o |= tweak_cell_inv_rot(extract64(i, 28, 4)) << 32;
-    o |= tweak_cell_inv_rot(extract64(i, 60, 4)) << 36;
-    o |= tweak_cell_inv_rot(extract64(i, 56, 4)) << 40;
-    o |= tweak_cell_inv_rot(extract64(i, 16, 4)) << 44;
-
-    o |= extract64(i, 32, 4) << 48;
-    o |= extract64(i, 36, 4) << 52;
-    o |= extract64(i, 40, 4) << 56;
-    o |= tweak_cell_inv_rot(extract64(i, 44, 4)) << 60;
-
-    return o;
+    const uint64_t rot_mask = 0xff0ff000f00f0f00ull;
+    uint64_t o = ((i >> 4) & 0x00000000f0000000ull) |
+                 ((i & 0x000000000000ff00ull) << 12) |
+                 ((i >> 16) & 0x0000ffff0000ffffull) |
+                 ((i & 0x00000f0000000000ull) << 16) |
+                 ((i & 0x000000f000000000ull) << 24) |
+                 ((i >> 28) & 0x00000000000f0000ull) |
+                 ((i & 0x00000000000000ffull) << 48);
+
+    return (o & ~rot_mask) | (tweak_cells_rot(o) & rot_mask);
 }
 
 static uint64_t pauth_computepac_architected(uint64_t data, uint64_t modifier,
@@ -224,15 +217,17 @@ static uint64_t pauth_computepac_architected(uint64_t data, uint64_t modifier,
      * and key1 contains bits <63:0> of the 128-bit key.
      */
     uint64_t key0 = key.hi, key1 = key.lo;
-    uint64_t workingval, runningmod, roundkey, modk0;
+    uint64_t workingval, roundkey, modk0;
+    /* The tweak of each round; the rounds after the middle go backwards. */
+    uint64_t runningmod[6];
     int i;
 
     modk0 = (key0 << 63) | ((key0 >> 1) ^ (key0 >> 63));
-    runningmod = modifier;
+    runningmod[0] = modifier;
     workingval = data ^ key0;
 
     for (i = 0; i <= 4; ++i) {
-        roundkey = key1 ^ runningmod;
+        roundkey = key1 ^ runningmod[i];
         workingval ^= roundkey;
         workingval ^= RC[i];
         if (i > 0) {
@@ -240,9 +235,9 @@ static uint64_t pauth_computepac_architected(uint64_t data, uint64_t modifier,
             workingval = pac_mult(workingval);
         }
         workingval = pac_sub(workingval);
-        runningmod = tweak_shuffle(runningmod);
+        runningmod[i + 1] = tweak_shuffle(runningmod[i]);
     }
-    roundkey = modk0 ^ runningmod;
+    roundkey = modk0 ^ runningmod[5];
     workingval ^= roundkey;
     workingval = pac_cell_shuffle(workingval);
     workingval = pac_mult(workingval);
@@ -255,15 +250,14 @@ static uint64_t pauth_computepac_architected(uint64_t data, uint64_t modifier,
     workingval = pac_mult(workingval);
     workingval = pac_cell_inv_shuffle(workingval);
     workingval ^= key0;
-    workingval ^= runningmod;
+    workingval ^= runningmod[5];
     for (i = 0; i <= 4; ++i) {
         workingval = pac_inv_sub(workingval);
         if (i < 4) {
             workingval = pac_mult(workingval);
             workingval = pac_cell_inv_shuffle(workingval);
         }
-        runningmod = tweak_inv_shuffle(runningmod);
-        roundkey = key1 ^ runningmod;
+        roundkey = key1 ^ runningmod[4 - i];
         workingval ^= RC[4 - i];
         workingval ^= roundkey;
         workingval ^= alpha;
@@ -279,18 +273,77 @@ static uint64_t pauth_computepac_impdef(uint64_t data, uint64_t modifier,
     return qemu_xxhash64_4(data, modifier, key.lo, key.hi);
 }
 
+/* The keys of env->keys, in order */
+enum {
+    PAUTH_KEY_IA,
+    PAUTH_KEY_IB,
+    PAUTH_KEY_DA,
+    PAUTH_KEY_DB,
+    PAUTH_KEY_GA,
+};
+
+QEMU_BUILD_BUG_ON(ARRAY_SIZE(((ARMCPU *)0)->pac_cache) != PAUTH_KEY_GA + 1);
+
+static ARMPACKey *pauth_key(CPUARMState *env, int key)
+{
+    switch (key) {
+    case PAUTH_KEY_IA:
+        return &env->keys.apia;
+    case PAUTH_KEY_IB:
+        return &env->keys.apib;
+    case PAUTH_KEY_DA:
+        return &env->keys.apda;
+    case PAUTH_KEY_DB:
+        return &env->keys.apdb;
+    case PAUTH_KEY_GA:
+        return &env->keys.apga;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/*
+ * Code built with branch protection signs the return address with PACIASP
+ * on function entry and authenticates it with AUTIASP before returning,
+ * so the same PAC is computed twice for every call.  Remember the recent
+ * ones per key; the memo of a key is emptied when the key's value no
+ * longer matches the one it was filled with, whatever wrote the key.
+ */
 static uint64_t pauth_computepac(CPUARMState *env, uint64_t data,
-                                 uint64_t modifier, ARMPACKey key)
+                                 uint64_t modifier, int key)
 {
-    if (cpu_isar_feature(aa64_pauth_arch, env_archcpu(env))) {
-        return pauth_computepac_architected(data, modifier, key);
+    ARMCPU *cpu = env_archcpu(env);
+    ARMPACCache *cache = &cpu->pac_cache[key];
+    ARMPACKey *k = pauth_key(env, key);
+    /* Code pointers are 4-aligned, the stack pointer 16-aligned. */
+    uint64_t hash = (data >> 2) ^ (modifier >> 4);
+    unsigned i = (hash ^ (hash >> 6)) & (ARM_PAC_CACHE_SIZE - 1);
+    ARMPACCacheEntry *e = &cache->entry[i];
+    uint64_t pac;
+
+    if (unlikely(cache->key.lo != k->lo || cache->key.hi != k->hi)) {
+        cache->key = *k;
+        cache->valid = 0;
+    } else if ((cache->valid & (1ull << i)) &&
+               e->data == data && e->modifier == modifier) {
+        return e->pac;
+    }
+
+    if (cpu_isar_feature(aa64_pauth_arch, cpu)) {
+        pac = pauth_computepac_architected(data, modifier, *k);
     } else {
-        return pauth_computepac_impdef(data, modifier, key);
+        pac = pauth_computepac_impdef(data, modifier, *k);
     }
+
+    e->data = data;
+    e->modifier = modifier;
+    e->pac = pac;
+    cache->valid |= 1ull << i;
+    return pac;
 }
 
 static uint64_t pauth_addpac(CPUARMState *env, uint64_t ptr, uint64_t modifier,
-                             ARMPACKey *key, bool data)
+                             int key, bool data)
 {
     ARMMMUIdx mmu_idx = arm_stage1_mmu_idx(env);
     ARMVAParameters param = aa64_va_parameters(env, ptr, mmu_idx, data);
@@ -309,7 +362,7 @@ static uint64_t pauth_addpac(CPUARMState *env, uint64_t ptr, uint64_t modifier,
     bot_bit = 64 - param.tsz;
     ext_ptr = deposit64(ptr, bot_bit, top_bit - bot_bit, ext);
 
-    pac = pauth_computepac(env, ext_ptr, modifier, *key);
+    pac = pauth_computepac(env, ext_ptr, modifier, key);
 
     /*
      * Check if the ptr has good extension bits and corrupt the
@@ -350,7 +403,7 @@ static uint64_t pauth_original_ptr(uint64_t ptr, ARMVAParameters param)
 }
 
 static uint64_t pauth_auth(CPUARMState *env, uint64_t ptr, uint64_t modifier,
-                           ARMPACKey *key, bool data, int keynumber)
+                           int key, bool data, int keynumber)
 {
     ARMMMUIdx mmu_idx = arm_stage1_mmu_idx(env);
     ARMVAParameters param = aa64_va_parameters(env, ptr, mmu_idx, data);
@@ -358,7 +411,7 @@ static uint64_t pauth_auth(CPUARMState *env, uint64_t ptr, uint64_t modifier,
     uint64_t pac, orig_ptr, test;
 
     orig_ptr = pauth_original_ptr(ptr, param);
-    pac = pauth_computepac(env, orig_ptr, modifier, *key);
+    pac = pauth_computepac(env, orig_ptr, modifier, key);
     bot_bit = 64 - param.tsz;
     top_bit = 64 - 8 * param.tbi;
 
@@ -421,7 +474,7 @@ uint64_t HELPER(pacia)(CPUARMState *env, uint64_t x, uint64_t y)
         return x;
     }
     pauth_check_trap(env, el, GETPC());
-    return pauth_addpac(env, x, y, &env->keys.apia, false);
+    return pauth_addpac(env, x, y, PAUTH_KEY_IA, false);
 }
 
 uint64_t HELPER(pacib)(CPUARMState *env, uint64_t x, uint64_t y)
@@ -431,7 +484,7 @@ uint64_t HELPER(pacib)(CPUARMState *env, uint64_t x, uint64_t y)
         return x;
     }
     pauth_check_trap(env, el, GETPC());
-    return pauth_addpac(env, x, y, &env->keys.apib, false);
+    return pauth_addpac(env, x, y, PAUTH_KEY_IB, false);
 }
 
 uint64_t HELPER(pacda)(CPUARMState *env, uint64_t x, uint64_t y)
@@ -441,7 +494,7 @@ uint64_t HELPER(pacda)(CPUARMState *env, uint64_t x, uint64_t y)
         return x;
     }
     pauth_check_trap(env, el, GETPC());
-    return pauth_addpac(env, x, y, &env->keys.apda, true);
+    return pauth_addpac(env, x, y, PAUTH_KEY_DA, true);
 }
 
 uint64_t HELPER(pacdb)(CPUARMState *env, uint64_t x, uint64_t y)
@@ -451,7 +504,7 @@ uint64_t HELPER(pacdb)(CPUARMState *env, uint64_t x, uint64_t y)
         return x;
     }
     pauth_check_trap(env, el, GETPC());
-    return pauth_addpac(env, x, y, &env->keys.apdb, true);
+    return pauth_addpac(env, x, y, PAUTH_KEY_DB, true);
 }
 
 uint64_t HELPER(pacga)(CPUARMState *env, uint64_t x, uint64_t y)
@@ -459,7 +512,7 @@ uint64_t HELPER(pacga)(CPUARMState *env, uint64_t x, uint64_t y)
     uint64_t pac;
 
     pauth_check_trap(env, arm_current_el(env), GETPC());
-    pac = pauth_computepac(env, x, y, env->keys.apga);
+    pac = pauth_computepac(env, x, y, PAUTH_KEY_GA);
 
     return pac & 0xffffffff00000000ull;
 }
@@ -471,7 +524,7 @@ uint64_t HELPER(autia)(CPUARMState *env, uint64_t x, uint64_t y)
         return x;
     }
     pauth_check_trap(env, el, GETPC());
-    return pauth_auth(env, x, y, &env->keys.apia, false, 0);
+    return pauth_auth(env, x, y, PAUTH_KEY_IA, false, 0);
 }
 
 uint64_t HELPER(autib)(CPUARMState *env, uint64_t x, uint64_t y)
@@ -481,7 +534,7 @@ uint64_t HELPER(autib)(CPUARMState *env, uint64_t x, uint64_t y)
         return x;
     }
     pauth_check_trap(env, el, GETPC());
-    return pauth_auth(env, x, y, &env->keys.apib, false, 1);
+    return pauth_auth(env, x, y, PAUTH_KEY_IB, false, 1);
 }
 
 uint64_t HELPER(autda)(CPUARMState *env, uint64_t x, uint64_t y)
@@ -491,7 +544,7 @@ uint64_t HELPER(autda)(CPUARMState *env, uint64_t x, uint64_t y)
         return x;
     }
     pauth_check_trap(env, el, GETPC());
-    return pauth_auth(env, x, y, &env->keys.apda, true, 0);
+    return pauth_auth(env, x, y, PAUTH_KEY_DA, true, 0);
 }
 
 uint64_t HELPER(autdb)(CPUARMState *env, uint64_t x, uint64_t y)
@@ -501,7 +554,7 @@ uint64_t HELPER(autdb)(CPUARMState *env, uint64_t x, uint64_t y)
         return x;
     }
     pauth_check_trap(env, el, GETPC());
-    return pauth_auth(env, x, y, &env->keys.apdb, true, 1);
+    return pauth_auth(env, x, y, PAUTH_KEY_DB, true, 1);
 }
 
 uint64_t HELPER(xpaci)(CPUARMState *env, uint64_t a)
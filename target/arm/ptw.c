@@ -9,6 +9,7 @@
 #include "qemu/osdep.h"
 #include "qemu/log.h"
 #include "qemu/range.h"
+#include "sysemu/tcg.h"
 #include "cpu.h"
 #include "internals.h"
 #include "idau.h"
@@ -955,6 +956,172 @@ static bool check_s2_mmu_setup(ARMCPU *cpu, bool is_aa64, int level,
     return true;
 }
 
+/*
+ * Page table walk cache.
+ *
+ * get_phys_addr_lpae() records each table descriptor it follows and
+ * starts later walks at the deepest table recorded for the address.
+ * Entries are tagged with the regime and with the TTBR (hence ASID), TCR
+ * and, for stage 1 of a two stage walk, VTTBR (hence VMID) they were
+ * walked with, so that a switch of address space never makes them stale.
+ * Like the TLB, the walk cache may hold on to table descriptors that the
+ * guest has since changed until it invalidates them with a TLBI, which
+ * ends up in arm_cpu_tlb_flushed().  Invalid descriptors are never
+ * recorded, so filling in a new table needs no invalidation.
+ *
+ * Only the vCPU thread uses the cache; debug accesses from other
+ * threads always walk the tables in full.
+ */
+static bool walk_cache_enabled(CPUARMState *env)
+{
+    return tcg_enabled() && current_cpu == env_cpu(env);
+}
+
+/* Input address bits translated by the tables above @level. */
+static uint64_t walk_cache_va_mask(int stride, int inputsize, int level)
+{
+    int shift = stride * (5 - level) + 3;
+
+    return MAKE_64BIT_MASK(shift, inputsize - shift);
+}
+
+static void walk_cache_init_key(CPUARMState *env, ARMWalkCacheEntry *key,
+                                ARMMMUIdx mmu_idx, uint64_t ttbr,
+                                uint64_t tcr, bool aarch64)
+{
+    key->mmu_idx = mmu_idx;
+    key->ttbr = ttbr;
+    key->tcr = tcr;
+    key->aarch64 = aarch64;
+    if (arm_mmu_idx_is_stage1_of_2(mmu_idx)) {
+        key->vttbr = regime_ttbr(env, regime_is_secure(env, mmu_idx) ?
+                                 ARMMMUIdx_Stage2_S : ARMMMUIdx_Stage2, 0);
+    }
+}
+
+static ARMWalkCacheEntry *walk_cache_entry(ARMCPU *cpu,
+                                           const ARMWalkCacheEntry *key)
+{
+    uint64_t h = key->va ^ key->mmu_idx ^ ((uint64_t)key->level << 8);
+
+    h *= 0x9e3779b97f4a7c15ull;
+    return &cpu->walk_cache[h >> (64 - ARM_WALK_CACHE_BITS)];
+}
+
+static bool walk_cache_match(ARMCPU *cpu, const ARMWalkCacheEntry *e,
+                             const ARMWalkCacheEntry *key)
+{
+    return e->gen == cpu->walk_cache_gen &&
+           e->va == key->va && e->va_mask == key->va_mask &&
+           e->level == key->level && e->mmu_idx == key->mmu_idx &&
+           e->ttbr == key->ttbr && e->vttbr == key->vttbr &&
+           e->tcr == key->tcr && e->aarch64 == key->aarch64;
+}
+
+/*
+ * Look for the deepest table of the walk for @address below @level.
+ * On a hit, return true with @level, @descaddr and @tableattrs set to
+ * continue the walk from that table.
+ */
+static bool walk_cache_lookup(ARMCPU *cpu, const ARMWalkCacheEntry *key,
+                              uint64_t address, int stride, int inputsize,
+                              uint32_t *level, hwaddr *descaddr,
+                              uint32_t *tableattrs)
+{
+    ARMWalkCacheEntry k = *key;
+    ARMWalkCacheEntry *e;
+    int l;
+
+    for (l = 3; l > (int)*level; l--) {
+        k.level = l;
+        k.va_mask = walk_cache_va_mask(stride, inputsize, l);
+        k.va = address & k.va_mask;
+        e = walk_cache_entry(cpu, &k);
+        if (walk_cache_match(cpu, e, &k)) {
+            *level = l;
+            *descaddr = e->descaddr;
+            *tableattrs = e->tableattrs;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Record that the walk for @address continues at @descaddr. */
+static void walk_cache_insert(ARMCPU *cpu, const ARMWalkCacheEntry *key,
+                              uint64_t address, int stride, int inputsize,
+                              uint32_t level, hwaddr descaddr,
+                              uint32_t tableattrs)
+{
+    ARMWalkCacheEntry *e;
+    ARMWalkCacheEntry k = *key;
+
+    k.level = level;
+    k.va_mask = walk_cache_va_mask(stride, inputsize, level);
+    k.va = address & k.va_mask;
+    k.descaddr = descaddr;
+    k.tableattrs = tableattrs;
+    k.gen = cpu->walk_cache_gen;
+    e = walk_cache_entry(cpu, &k);
+    *e = k;
+}
+
+void arm_cpu_tlb_flushed(CPUState *cs, uint16_t idxmap,
+                         vaddr addr, vaddr len)
+{
+    ARMCPU *cpu = ARM_CPU(cs);
+    ARMWalkCacheEntry *e;
+    uint64_t size, in_mask, first, last;
+    int i;
+
+    /*
+     * The walk cache is indexed by ARMMMUIdx rather than by core mmu_idx,
+     * and stage 2 walks have no TLB of their own, so @idxmap is not used:
+     * every regime loses its entries for the flushed addresses.
+     */
+    if (len == 0) {
+        if (++cpu->walk_cache_gen == 0) {
+            memset(cpu->walk_cache, 0, sizeof(cpu->walk_cache));
+            cpu->walk_cache_gen = 1;
+        }
+        return;
+    }
+
+    for (i = 0; i < ARM_WALK_CACHE_SIZE; i++) {
+        e = &cpu->walk_cache[i];
+        if (e->gen != cpu->walk_cache_gen) {
+            continue;
+        }
+        size = e->va_mask & -e->va_mask;
+        in_mask = e->va_mask | (size - 1);
+        first = addr & in_mask;
+        last = (addr + len - 1) & in_mask;
+        /* A range that wraps within the input address size covers all. */
+        if (last < first || (e->va <= last && first <= e->va + size - 1)) {
+            e->gen = 0;
+        }
+    }
+}
+
+/*
+ * Only the AArch64 EL1&0 regime has tagged TLBs, whose tag holds the
+ * ASID and VMID.  Two vCPUs may use one ASID with different tables, so
+ * the shared TLB also keys its entries on the TTBR that translates
+ * @addr.
+ */
+bool arm_cpu_tlb_root(CPUState *cs, int mmu_idx, vaddr addr, uint64_t *root)
+{
+    CPUARMState *env = cs->env_ptr;
+    ARMMMUIdx arm_mmu_idx = core_to_arm_mmu_idx(env, mmu_idx);
+
+    if (!regime_has_2_ranges(arm_mmu_idx) ||
+        !arm_el_is_aa64(env, regime_el(env, arm_mmu_idx))) {
+        return false;
+    }
+    *root = regime_ttbr(env, arm_mmu_idx, extract64(addr, 55, 1));
+    return true;
+}
+
 /**
  * get_phys_addr_lpae: perform one stage of page table walk, LPAE format
  *
@@ -1004,6 +1171,8 @@ static bool get_phys_addr_lpae(CPUARMState *env, uint64_t address,
     uint64_t descaddrmask;
     bool aarch64 = arm_el_is_aa64(env, el);
     bool guarded = false;
+    bool use_walk_cache = walk_cache_enabled(env);
+    ARMWalkCacheEntry walk_key = {};
 
     /* TODO: This code does not support shareability levels. */
     if (aarch64) {
@@ -1202,6 +1371,15 @@ static bool get_phys_addr_lpae(CPUARMState *env, uint64_t address,
      * bits at each step.
      */
     tableattrs = regime_is_secure(env, mmu_idx) ? 0 : (1 << 4);
+
+    if (use_walk_cache) {
+        walk_cache_init_key(env, &walk_key, mmu_idx, ttbr, tcr, aarch64);
+        if (walk_cache_lookup(cpu, &walk_key, address, stride, inputsize,
+                              &level, &descaddr, &tableattrs)) {
+            indexmask = indexmask_grainsize;
+        }
+    }
+
     for (;;) {
         uint64_t descriptor;
         bool nstable;
@@ -1249,6 +1427,10 @@ static bool get_phys_addr_lpae(CPUARMState *env, uint64_t address,
             tableattrs |= extract64(descriptor, 59, 5);
             level++;
             indexmask = indexmask_grainsize;
+            if (use_walk_cache) {
+                walk_cache_insert(cpu, &walk_key, address, stride,
+                                  inputsize, level, descaddr, tableattrs);
+            }
             continue;
         }
         /*
@@ -214,6 +214,7 @@ bool arm_cpu_tlb_fill(CPUState *cs, vaddr address, int size,
     int prot, ret;
     MemTxAttrs attrs = {};
     ARMCacheAttrs cacheattrs = {};
+    ARMMMUIdx arm_mmu_idx = core_to_arm_mmu_idx(&cpu->env, mmu_idx);
 
     /*
      * Walk the page table and (if the mapping exists) add the page
@@ -221,8 +222,7 @@ bool arm_cpu_tlb_fill(CPUState *cs, vaddr address, int size,
      * return false.  Otherwise populate fsr with ARM DFSR/IFSR fault
      * register format, and signal the fault.
      */
-    ret = get_phys_addr(&cpu->env, address, access_type,
-                        core_to_arm_mmu_idx(&cpu->env, mmu_idx),
+    ret = get_phys_addr(&cpu->env, address, access_type, arm_mmu_idx,
                         &phys_addr, &attrs, &prot, &page_size,
                         &fi, &cacheattrs);
     if (likely(!ret)) {
@@ -240,8 +240,21 @@ bool arm_cpu_tlb_fill(CPUState *cs, vaddr address, int size,
             arm_tlb_mte_tagged(&attrs) = true;
         }
 
-        tlb_set_page_with_attrs(cs, address, phys_addr, attrs,
-                                prot, mmu_idx, page_size);
+        /*
+         * A VMSA block maps linearly, unless a second stage follows:
+         * page_size is then that of the stage 2 mapping.
+         */
+        if (page_size > TARGET_PAGE_SIZE &&
+            !arm_feature(&cpu->env, ARM_FEATURE_PMSA) &&
+            (stage_1_mmu_idx(arm_mmu_idx) == arm_mmu_idx ||
+             !arm_feature(&cpu->env, ARM_FEATURE_EL2) ||
+             !(arm_hcr_el2_eff(&cpu->env) & (HCR_VM | HCR_DC)))) {
+            tlb_set_large_page_with_attrs(cs, address, phys_addr, attrs,
+                                          prot, mmu_idx, page_size);
+        } else {
+            tlb_set_page_with_attrs(cs, address, phys_addr, attrs,
+                                    prot, mmu_idx, page_size);
+        }
         return true;
     } else if (probe) {
         return false;
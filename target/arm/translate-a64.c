@@ -137,7 +137,7 @@ static void set_btype(DisasContext *s, int val)
     /* BTYPE is a 2-bit field, and 0 should be done with reset_btype.  */
     tcg_debug_assert(val >= 1 && val <= 3);
     set_btype_raw(val);
-    s->btype = -1;
+    s->btype = -val;
 }
 
 static void reset_btype(DisasContext *s)
@@ -396,6 +396,85 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint64_t dest)
     }
 }
 
+/*
+ * TBs that have been promoted to TB_TIER_HOT are extended across direct
+ * branches into superblocks, so that the optimizer and the register
+ * allocator see the whole path at once.  Only forward branches are
+ * handled: backward ones are usually loop edges that are taken, for
+ * which ending the TB and chaining is the better choice.
+ *
+ * Code skipped by a followed branch stays within [pc_first, pc_next),
+ * so invalidation by tb->size remains conservative and correct.
+ */
+static bool a64_can_extend_tb(DisasContext *s, uint64_t dest)
+{
+    return s->base.tb->tier == TB_TIER_HOT &&
+           !s->ss_active &&
+           dest >= s->base.pc_next &&
+           s->base.num_insns < s->base.max_insns;
+}
+
+/*
+ * Continue translating at @dest, which is known to be reached from here,
+ * as if it were the next insn.
+ */
+static bool a64_follow_branch(DisasContext *s, uint64_t dest)
+{
+    if (!a64_can_extend_tb(s, dest) ||
+        !translator_use_goto_tb(&s->base, dest)) {
+        return false;
+    }
+    s->base.pc_next = dest;
+    /* The page bound of init_disas_context now counts from @dest.  */
+    s->base.max_insns = MIN(s->base.max_insns, s->base.num_insns +
+                            -(dest | TARGET_PAGE_MASK) / 4);
+    return true;
+}
+
+/*
+ * Return a label to branch to when a conditional branch to @dest is
+ * taken, continuing the translation on the fall-through path, or NULL
+ * if the TB should end here as usual.
+ */
+static TCGLabel *a64_side_exit(DisasContext *s, uint64_t dest)
+{
+    TCGLabel *label;
+
+    if (!a64_can_extend_tb(s, dest) ||
+        s->nb_side_exits == A64_MAX_SIDE_EXITS) {
+        return NULL;
+    }
+    label = gen_new_label();
+    s->side_exit[s->nb_side_exits].label = label;
+    s->side_exit[s->nb_side_exits].dest = dest;
+    s->nb_side_exits++;
+    return label;
+}
+
+/*
+ * Jump to the TB at cpu_pc, probing the jump cache inline: the cpu
+ * state there only differs from ours by PSTATE.BTYPE, set to @btype.
+ */
+static void gen_a64_goto_ptr(DisasContext *s, int btype)
+{
+    TranslationBlock *tb = s->base.tb;
+
+    translator_lookup_and_goto_ptr(&s->base, cpu_pc,
+                                   FIELD_DP32(tb->cs_base, TBFLAG_A64,
+                                              BTYPE, btype),
+                                   tb->flags);
+}
+
+/* A function return: BTYPE is always 0 after it.  */
+static void gen_a64_return(DisasContext *s)
+{
+    TranslationBlock *tb = s->base.tb;
+
+    translator_ras_return(&s->base, cpu_pc,
+                          FIELD_DP32(tb->cs_base, TBFLAG_A64, BTYPE, 0),
+                          tb->flags);
+}
+
 static void init_tmp_a64_array(DisasContext *s)
 {
 #ifdef CONFIG_DEBUG_TCG
@@ -1367,10 +1446,14 @@ static void disas_uncond_b_imm(DisasContext *s, uint32_t insn)
     if (insn & (1U << 31)) {
         /* BL Branch with link */
         tcg_gen_movi_i64(cpu_reg(s, 30), s->base.pc_next);
+        translator_ras_push(&s->base, s->base.pc_next);
     }
 
     /* B Branch / BL Branch with link */
     reset_btype(s);
+    if (a64_follow_branch(s, addr)) {
+        return;
+    }
     gen_goto_tb(s, 0, addr);
 }
 
@@ -1393,9 +1476,15 @@ static void disas_comp_b_imm(DisasContext *s, uint32_t insn)
     addr = s->pc_curr + sextract32(insn, 5, 19) * 4;
 
     tcg_cmp = read_cpu_reg(s, rt, sf);
-    label_match = gen_new_label();
+    label_match = a64_side_exit(s, addr);
 
     reset_btype(s);
+    if (label_match) {
+        tcg_gen_brcondi_i64(op ? TCG_COND_NE : TCG_COND_EQ,
+                            tcg_cmp, 0, label_match);
+        return;
+    }
+    label_match = gen_new_label();
     tcg_gen_brcondi_i64(op ? TCG_COND_NE : TCG_COND_EQ,
                         tcg_cmp, 0, label_match);
 
@@ -1424,9 +1513,16 @@ static void disas_test_b_imm(DisasContext *s, uint32_t insn)
 
     tcg_cmp = tcg_temp_new_i64();
     tcg_gen_andi_i64(tcg_cmp, cpu_reg(s, rt), (1ULL << bit_pos));
-    label_match = gen_new_label();
+    label_match = a64_side_exit(s, addr);
 
     reset_btype(s);
+    if (label_match) {
+        tcg_gen_brcondi_i64(op ? TCG_COND_NE : TCG_COND_EQ,
+                            tcg_cmp, 0, label_match);
+        tcg_temp_free_i64(tcg_cmp);
+        return;
+    }
+    label_match = gen_new_label();
     tcg_gen_brcondi_i64(op ? TCG_COND_NE : TCG_COND_EQ,
                         tcg_cmp, 0, label_match);
     tcg_temp_free_i64(tcg_cmp);
@@ -1456,13 +1552,22 @@ static void disas_cond_b_imm(DisasContext *s, uint32_t insn)
     reset_btype(s);
     if (cond < 0x0e) {
         /* genuinely conditional branches */
-        TCGLabel *label_match = gen_new_label();
+        TCGLabel *label_match = a64_side_exit(s, addr);
+
+        if (label_match) {
+            arm_gen_test_cc(cond, label_match);
+            return;
+        }
+        label_match = gen_new_label();
         arm_gen_test_cc(cond, label_match);
         gen_goto_tb(s, 0, s->base.pc_next);
         gen_set_label(label_match);
         gen_goto_tb(s, 1, addr);
     } else {
         /* 0xe and 0xf are both "always" conditions */
+        if (a64_follow_branch(s, addr)) {
+            return;
+        }
         gen_goto_tb(s, 0, addr);
     }
 }
@@ -1485,22 +1590,29 @@ static void handle_hint(DisasContext *s, uint32_t insn,
         s->base.is_jmp = DISAS_WFI;
         break;
     case 0b00001: /* YIELD */
-        /* When running in MTTCG we don't generate jumps to the yield and
-         * WFE helpers as it won't affect the scheduling of other vCPUs.
-         * If we wanted to more completely model WFE/SEV so we don't busy
-         * spin unnecessarily we would need to do something more involved.
+        /* When running in MTTCG we don't generate jumps to the yield
+         * helper as it won't affect the scheduling of other vCPUs.
          */
         if (!(tb_cflags(s->base.tb) & CF_PARALLEL)) {
             s->base.is_jmp = DISAS_YIELD;
         }
         break;
     case 0b00010: /* WFE */
-        if (!(tb_cflags(s->base.tb) & CF_PARALLEL)) {
-            s->base.is_jmp = DISAS_WFE;
+#ifdef CONFIG_USER_ONLY
+        if (tb_cflags(s->base.tb) & CF_PARALLEL) {
+            break;
         }
+#endif
+        /* Under MTTCG the helper sleeps until an event, see HELPER(wfe). */
+        s->base.is_jmp = DISAS_WFE;
         break;
     case 0b00100: /* SEV */
+        gen_helper_sev(cpu_env);
+        break;
     case 0b00101: /* SEVL */
+        tcg_gen_st_i32(tcg_constant_i32(1), cpu_env,
+                       offsetof(CPUARMState, event_register));
+        break;
     case 0b00110: /* DGH */
         /* we treat all as NOP at least for now */
         break;
@@ -2324,6 +2436,7 @@ static void disas_uncond_b_reg(DisasContext *s, uint32_t insn)
         /* BLR also needs to load return address */
         if (opc == 1) {
             tcg_gen_movi_i64(cpu_reg(s, 30), s->base.pc_next);
+            translator_ras_push(&s->base, s->base.pc_next);
         }
         break;
 
@@ -2351,6 +2464,7 @@ static void disas_uncond_b_reg(DisasContext *s, uint32_t insn)
         /* BLRAA also needs to load return address */
         if (opc == 9) {
             tcg_gen_movi_i64(cpu_reg(s, 30), s->base.pc_next);
+            translator_ras_push(&s->base, s->base.pc_next);
         }
         break;
 
@@ -2436,7 +2550,7 @@ static void disas_uncond_b_reg(DisasContext *s, uint32_t insn)
         break;
     }
 
-    s->base.is_jmp = DISAS_JUMP;
+    s->base.is_jmp = opc == 2 ? DISAS_RETURN : DISAS_JUMP;
 }
 
 /* Branches, exception generating and system instructions */
@@ -2528,6 +2642,8 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
         tcg_gen_mov_i64(cpu_reg(s, rt), cpu_exclusive_val);
     }
     tcg_gen_mov_i64(cpu_exclusive_addr, addr);
+    tcg_gen_st_i32(tcg_constant_i32(is_pair ? 2 << size : 1 << size),
+                   cpu_env, offsetof(CPUARMState, exclusive_size));
 }
 
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
@@ -14623,6 +14739,8 @@ static bool is_guarded_page(CPUARMState *env, DisasContext *s)
     unsigned int index = tlb_index(env, mmu_idx, addr);
     CPUTLBEntry *entry = tlb_entry(env, mmu_idx, addr);
 
+    translator_no_speculation();
+
     /*
      * We test this immediately after reading an insn, which means
      * that any normal page must be in the TLB.  The only exception
@@ -14943,6 +15061,7 @@ static void aarch64_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
 static void aarch64_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
 {
     DisasContext *dc = container_of(dcbase, DisasContext, base);
+    int i;
 
     if (unlikely(dc->ss_active)) {
         /* Note that this means single stepping WFI doesn't halt the CPU.
@@ -14956,6 +15075,7 @@ static void aarch64_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
             /* fall through */
         case DISAS_EXIT:
         case DISAS_JUMP:
+        case DISAS_RETURN:
             gen_step_complete_exception(dc);
             break;
         case DISAS_NORETURN:
@@ -14976,16 +15096,20 @@ static void aarch64_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
             break;
         case DISAS_UPDATE_NOCHAIN:
             gen_a64_set_pc_im(dc->base.pc_next);
-            /* fall through */
-        case DISAS_JUMP:
             tcg_gen_lookup_and_goto_ptr();
             break;
+        case DISAS_JUMP:
+            gen_a64_goto_ptr(dc, dc->btype < 0 ? -dc->btype : dc->btype);
+            break;
+        case DISAS_RETURN:
+            gen_a64_return(dc);
+            break;
         case DISAS_NORETURN:
         case DISAS_SWI:
             break;
         case DISAS_WFE:
             gen_a64_set_pc_im(dc->base.pc_next);
-            gen_helper_wfe(cpu_env);
+            gen_helper_wfe(cpu_env, tcg_constant_i32(4));
             break;
         case DISAS_YIELD:
             gen_a64_set_pc_im(dc->base.pc_next);
@@ -15006,6 +15130,12 @@ static void aarch64_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
             break;
         }
     }
+
+    for (i = 0; i < dc->nb_side_exits; i++) {
+        gen_set_label(dc->side_exit[i].label);
+        gen_a64_set_pc_im(dc->side_exit[i].dest);
+        gen_a64_goto_ptr(dc, 0);
+    }
 }
 
 static void aarch64_tr_disas_log(const DisasContextBase *dcbase,
@@ -5007,6 +5007,8 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
 
     store_reg(s, rt, tmp);
     tcg_gen_extu_i32_i64(cpu_exclusive_addr, addr);
+    tcg_gen_st_i32(tcg_constant_i32(1 << size), cpu_env,
+                   offsetof(CPUARMState, exclusive_size));
 }
 
 static void gen_clrex(DisasContext *s)
@@ -6240,16 +6242,32 @@ static bool trans_YIELD(DisasContext *s, arg_YIELD *a)
 static bool trans_WFE(DisasContext *s, arg_WFE *a)
 {
     /*
-     * When running single-threaded TCG code, use the helper to ensure that
-     * the next round-robin scheduled vCPU gets a crack.  In MTTCG mode we
-     * just skip this instruction.  Currently the SEV/SEVL instructions,
-     * which are *one* of many ways to wake the CPU from WFE, are not
-     * implemented so we can't sleep like WFI does.
+     * When running single-threaded TCG code, the helper yields so that
+     * the next round-robin scheduled vCPU gets a crack.  Under MTTCG it
+     * sleeps until SEV, an interrupt or a store to the address watched
+     * by the exclusive monitor.  The user-mode helper can only yield,
+     * which is pointless with parallel threads, so skip it there.
      */
-    if (!(tb_cflags(s->base.tb) & CF_PARALLEL)) {
-        gen_set_pc_im(s, s->base.pc_next);
-        s->base.is_jmp = DISAS_WFE;
+#ifdef CONFIG_USER_ONLY
+    if (tb_cflags(s->base.tb) & CF_PARALLEL) {
+        return true;
     }
+#endif
+    gen_set_pc_im(s, s->base.pc_next);
+    s->base.is_jmp = DISAS_WFE;
+    return true;
+}
+
+static bool trans_SEV(DisasContext *s, arg_SEV *a)
+{
+    gen_helper_sev(cpu_env);
+    return true;
+}
+
+static bool trans_SEVL(DisasContext *s, arg_SEVL *a)
+{
+    tcg_gen_st_i32(tcg_constant_i32(1), cpu_env,
+                   offsetof(CPUARMState, event_register));
     return true;
 }
 
@@ -9834,7 +9852,8 @@ static void arm_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
             tcg_gen_exit_tb(NULL, 0);
             break;
         case DISAS_WFE:
-            gen_helper_wfe(cpu_env);
+            gen_helper_wfe(cpu_env,
+                           tcg_constant_i32(dc->base.pc_next - dc->pc_curr));
             break;
         case DISAS_YIELD:
             gen_helper_yield(cpu_env);
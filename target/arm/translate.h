@@ -110,7 +110,7 @@ typedef struct DisasContext {
     bool mve_no_pred;
     /*
      * >= 0, a copy of PSTATE.BTYPE, which will be 0 without v8.5-BTI.
-     *  < 0, set by the current instruction.
+     *  < 0, set to -btype by the current instruction.
      */
     int8_t btype;
     /* A copy of cpu->dcz_blocksize. */
@@ -121,6 +121,13 @@ typedef struct DisasContext {
     int c15_cpar;
     /* TCG op of the current insn_start.  */
     TCGOp *insn_start;
+    /* Side exits of a hot AArch64 TB, emitted at its end by tb_stop.  */
+#define A64_MAX_SIDE_EXITS 4
+    int nb_side_exits;
+    struct {
+        TCGLabel *label;
+        target_ulong dest;
+    } side_exit[A64_MAX_SIDE_EXITS];
 #define TMP_A64_MAX 16
     int tmp_a64_count;
     TCGv_i64 tmp_a64[TMP_A64_MAX];
@@ -255,6 +262,8 @@ static inline void disas_set_insn_syndrome(DisasContext *s, uint32_t syn)
 #define DISAS_EXIT      DISAS_TARGET_9
 /* CPU state was modified dynamically; no need to exit, but do not chain. */
 #define DISAS_UPDATE_NOCHAIN  DISAS_TARGET_10
+/* Only pc was modified dynamically, by a function return */
+#define DISAS_RETURN    DISAS_TARGET_11
 
 #ifdef TARGET_AARCH64
 void a64_translate_init(void);
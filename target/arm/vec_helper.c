@@ -23,6 +23,8 @@
 #include "tcg/tcg-gvec-desc.h"
 #include "fpu/softfloat.h"
 #include "qemu/int128.h"
+#include "qemu/host-crypto.h"
+#include "crypto/arm-crypto.h"
 #include "vec_internal.h"
 
 /*
@@ -2012,28 +2014,16 @@ void HELPER(gvec_pmul_b)(void *vd, void *vn, void *vm, uint32_t desc)
  */
 void HELPER(gvec_pmull_q)(void *vd, void *vn, void *vm, uint32_t desc)
 {
-    intptr_t i, j, opr_sz = simd_oprsz(desc);
+    intptr_t i, opr_sz = simd_oprsz(desc);
     intptr_t hi = simd_data(desc);
     uint64_t *d = vd, *n = vn, *m = vm;
 
     for (i = 0; i < opr_sz / 8; i += 2) {
-        uint64_t nn = n[i + hi];
-        uint64_t mm = m[i + hi];
-        uint64_t rhi = 0;
-        uint64_t rlo = 0;
-
-        /* Bit 0 can only influence the low 64-bit result.  */
-        if (nn & 1) {
-            rlo = mm;
-        }
-
-        for (j = 1; j < 64; ++j) {
-            uint64_t mask = -((nn >> j) & 1);
-            rlo ^= (mm << j) & mask;
-            rhi ^= (mm >> (64 - j)) & mask;
+        if (host_crypto_has(HOST_CRYPTO_PMULL)) {
+            host_crypto_pmull_64(d + i, n[i + hi], m[i + hi]);
+        } else {
+            crypto_pmull_64(d + i, n[i + hi], m[i + hi]);
         }
-        d[i] = rlo;
-        d[i + 1] = rhi;
     }
     clear_tail(d, opr_sz, simd_maxsz(desc));
 }
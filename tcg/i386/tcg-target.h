@@ -241,5 +241,7 @@ static inline void tb_target_set_jmp_target(uintptr_t tc_ptr, uintptr_t jmp_rx,
 
 #define TCG_TARGET_NEED_LDST_LABELS
 #define TCG_TARGET_NEED_POOL_LABELS
+/* Slow paths reach their fast paths anywhere in code_gen_buffer.  */
+#define TCG_TARGET_COLD_CODE
 
 #endif
@@ -46,11 +46,28 @@ typedef struct TempOptInfo {
     uint64_t s_mask;  /* a left-aligned mask of clrsb(value) bits. */
 } TempOptInfo;
 
+/*
+ * A value known to be held in env memory: loading @size bytes at @ofs
+ * with @ld_opc would produce the value of @val.
+ */
+typedef struct EnvMemInfo {
+    TCGTemp *val;
+    intptr_t ofs;
+    TCGOpcode ld_opc;
+    int size;
+} EnvMemInfo;
+
+#define MAX_ENV_MEM 32
+
 typedef struct OptContext {
     TCGContext *tcg;
     TCGOp *prev_mb;
     TCGTempSet temps_used;
 
+    /* Known contents of env, for forwarding stores and loads. */
+    int nb_env_mem;
+    EnvMemInfo env_mem[MAX_ENV_MEM];
+
     /* In flight values from optimization. */
     uint64_t a_mask;  /* mask bit is 0 iff value identical to first input */
     uint64_t z_mask;  /* mask bit is 0 iff value bit is 0 */
@@ -174,6 +191,87 @@ static void init_ts_info(OptContext *ctx, TCGTemp *ts)
     }
 }
 
+static void env_mem_remove(OptContext *ctx, int i)
+{
+    ctx->env_mem[i] = ctx->env_mem[--ctx->nb_env_mem];
+}
+
+/* Forget the env memory values held in @ts, which is being redefined. */
+static void env_mem_kill_temp(OptContext *ctx, TCGTemp *ts)
+{
+    int i;
+
+    for (i = ctx->nb_env_mem - 1; i >= 0; i--) {
+        if (ctx->env_mem[i].val == ts) {
+            env_mem_remove(ctx, i);
+        }
+    }
+}
+
+/* Forget the env memory values overlapping [@ofs, @ofs + @size). */
+static void env_mem_clobber(OptContext *ctx, intptr_t ofs, int size)
+{
+    int i;
+
+    for (i = ctx->nb_env_mem - 1; i >= 0; i--) {
+        EnvMemInfo *e = &ctx->env_mem[i];
+
+        if (e->ofs < ofs + size && ofs < e->ofs + e->size) {
+            env_mem_remove(ctx, i);
+        }
+    }
+}
+
+static EnvMemInfo *env_mem_find(OptContext *ctx, TCGOpcode ld_opc,
+                                intptr_t ofs)
+{
+    int i;
+
+    for (i = 0; i < ctx->nb_env_mem; i++) {
+        EnvMemInfo *e = &ctx->env_mem[i];
+
+        if (e->ofs == ofs && e->ld_opc == ld_opc) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void env_mem_add(OptContext *ctx, TCGOpcode ld_opc, intptr_t ofs,
+                        int size, TCGTemp *val)
+{
+    EnvMemInfo *e;
+
+    /* When full, simply stop tracking the oldest value. */
+    if (ctx->nb_env_mem == MAX_ENV_MEM) {
+        env_mem_remove(ctx, 0);
+    }
+    e = &ctx->env_mem[ctx->nb_env_mem++];
+    e->val = val;
+    e->ofs = ofs;
+    e->ld_opc = ld_opc;
+    e->size = size;
+}
+
+/* Forget about the temps that die at the end of a BB.  */
+static void reset_normal_temps(OptContext *ctx)
+{
+    TCGContext *s = ctx->tcg;
+    size_t i;
+
+    for (i = find_next_bit(ctx->temps_used.l, s->nb_temps, s->nb_globals);
+         i < s->nb_temps;
+         i = find_next_bit(ctx->temps_used.l, s->nb_temps, i + 1)) {
+        TCGTemp *ts = &s->temps[i];
+
+        if (ts->kind == TEMP_NORMAL) {
+            reset_ts(ts);
+            clear_bit(i, ctx->temps_used.l);
+            env_mem_kill_temp(ctx, ts);
+        }
+    }
+}
+
 static TCGTemp *find_better_copy(TCGContext *s, TCGTemp *ts)
 {
     TCGTemp *i, *g, *l;
@@ -692,11 +790,22 @@ static void finish_folding(OptContext *ctx, TCGOp *op)
     int i, nb_oargs;
 
     /*
-     * For an opcode that ends a BB, reset all temp data.
-     * We do no cross-BB optimization.
+     * For an opcode that ends a BB, reset temp data.
+     *
+     * The ops following a conditional branch can only be reached through
+     * its fall-through path, as any other entry would need a label.  So
+     * everything that survives the branch -- globals, locals and EBB temps
+     * -- keeps the value it had; only normal temps die.  This lets known
+     * constants and copies flow through the EBB.  Any other end of BB is
+     * followed by a label and may be reached from elsewhere.
      */
     if (def->flags & TCG_OPF_BB_END) {
-        memset(&ctx->temps_used, 0, sizeof(ctx->temps_used));
+        if (def->flags & TCG_OPF_COND_BRANCH) {
+            reset_normal_temps(ctx);
+        } else {
+            memset(&ctx->temps_used, 0, sizeof(ctx->temps_used));
+            ctx->nb_env_mem = 0;
+        }
         ctx->prev_mb = NULL;
         return;
     }
@@ -1222,9 +1331,18 @@ static bool fold_call(OptContext *ctx, TCGOp *op)
         }
     }
 
+    /*
+     * Helpers that do not write globals may still write env directly,
+     * so only those without side effects preserve its known contents.
+     */
+    if ((flags & TCG_CALL_NO_WG_SE) != TCG_CALL_NO_WG_SE) {
+        ctx->nb_env_mem = 0;
+    }
+
     /* Reset temp data for outputs. */
     for (i = 0; i < nb_oargs; i++) {
         reset_temp(op->args[i]);
+        env_mem_kill_temp(ctx, arg_temp(op->args[i]));
     }
 
     /* Stop optimizing MB across calls. */
@@ -1975,10 +2093,59 @@ static bool fold_sub2(OptContext *ctx, TCGOp *op)
     return fold_addsub2(ctx, op, false);
 }
 
+static inline bool ts_is_env(TCGTemp *ts)
+{
+    return ts == tcgv_ptr_temp(cpu_env);
+}
+
+/* Size in bytes of the memory accessed by a host load or store. */
+static int tcg_ldst_size(TCGOp *op)
+{
+    switch (op->opc) {
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    case INDEX_op_st_vec:
+        return 8 << TCGOP_VECL(op);
+    default:
+        g_assert_not_reached();
+    }
+}
+
 static bool fold_tcg_ld(OptContext *ctx, TCGOp *op)
 {
+    /*
+     * Replace a load from env by a copy of the value last stored to
+     * or loaded from the same location, if it is still available.
+     */
+    if (ts_is_env(arg_temp(op->args[1]))) {
+        EnvMemInfo *e = env_mem_find(ctx, op->opc, op->args[2]);
+
+        if (e) {
+            return tcg_opt_gen_mov(ctx, op, op->args[0], temp_arg(e->val));
+        }
+        env_mem_add(ctx, op->opc, op->args[2], tcg_ldst_size(op),
+                    arg_temp(op->args[0]));
+    }
+
     /* We can't do any folding with a load, but we can record bits. */
     switch (op->opc) {
+    CASE_OP_32_64(ld):
+        break;
     CASE_OP_32_64(ld8s):
         ctx->s_mask = MAKE_64BIT_MASK(8, 56);
         break;
@@ -2006,6 +2173,43 @@ static bool fold_tcg_ld(OptContext *ctx, TCGOp *op)
     return false;
 }
 
+static bool fold_tcg_st(OptContext *ctx, TCGOp *op)
+{
+    TCGTemp *val = arg_temp(op->args[0]);
+    intptr_t ofs = op->args[2];
+    TCGOpcode ld_opc;
+    EnvMemInfo *e;
+
+    if (!ts_is_env(arg_temp(op->args[1]))) {
+        /* The pointer may be derived from env: forget everything. */
+        ctx->nb_env_mem = 0;
+        return false;
+    }
+
+    switch (op->opc) {
+    case INDEX_op_st_i32:
+        ld_opc = INDEX_op_ld_i32;
+        break;
+    case INDEX_op_st_i64:
+        ld_opc = INDEX_op_ld_i64;
+        break;
+    default:
+        env_mem_clobber(ctx, ofs, tcg_ldst_size(op));
+        return false;
+    }
+
+    /* Drop a store of the value that env already holds. */
+    e = env_mem_find(ctx, ld_opc, ofs);
+    if (e && ts_are_copies(e->val, val)) {
+        tcg_op_remove(ctx->tcg, op);
+        return true;
+    }
+
+    env_mem_clobber(ctx, ofs, tcg_ldst_size(op));
+    env_mem_add(ctx, ld_opc, ofs, tcg_ldst_size(op), val);
+    return false;
+}
+
 static bool fold_xor(OptContext *ctx, TCGOp *op)
 {
     if (fold_const2_commutative(ctx, op) ||
@@ -2054,6 +2258,11 @@ void tcg_optimize(TCGContext *s)
         init_arguments(&ctx, op, def->nb_oargs + def->nb_iargs);
         copy_propagate(&ctx, op, def->nb_oargs, def->nb_iargs);
 
+        /* Env memory values held by the outputs are lost. */
+        for (i = 0; i < def->nb_oargs; i++) {
+            env_mem_kill_temp(&ctx, arg_temp(op->args[i]));
+        }
+
         /* Pre-compute the type of the operation. */
         if (def->flags & TCG_OPF_VECTOR) {
             ctx.type = TCG_TYPE_V64 + TCGOP_VECL(op);
@@ -2148,6 +2357,7 @@ void tcg_optimize(TCGContext *s)
         CASE_OP_32_64(ld16u):
         case INDEX_op_ld32s_i64:
         case INDEX_op_ld32u_i64:
+        CASE_OP_32_64(ld):
             done = fold_tcg_ld(&ctx, op);
             break;
         case INDEX_op_mb:
@@ -2217,6 +2427,12 @@ void tcg_optimize(TCGContext *s)
         CASE_OP_32_64(sextract):
             done = fold_sextract(&ctx, op);
             break;
+        CASE_OP_32_64(st8):
+        CASE_OP_32_64(st16):
+        case INDEX_op_st32_i64:
+        CASE_OP_32_64_VEC(st):
+            done = fold_tcg_st(&ctx, op);
+            break;
         CASE_OP_32_64(sub):
             done = fold_sub(&ctx, op);
             break;
@@ -33,6 +33,10 @@
 #include "tcg/tcg.h"
 #include "tcg-internal.h"
 
+#ifdef TCG_TARGET_COLD_CODE
+/* One part in TCG_REGION_COLD_FRACTION of each region holds slow paths. */
+#define TCG_REGION_COLD_FRACTION 8
+#endif
 
 struct tcg_region_tree {
     QemuMutex lock;
@@ -60,6 +64,8 @@ struct tcg_region_state {
     /* fields protected by the lock */
     size_t current; /* current region index */
     size_t agg_size_full; /* aggregate size of full regions */
+    uint64_t *gen; /* allocation order of each region; 0 if not allocated */
+    uint64_t next_gen;
 };
 
 static struct tcg_region_state region;
@@ -167,10 +173,23 @@ static void tcg_region_trees_init(void)
     }
 }
 
-static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+/* Return the index of the region containing @p, a pointer into the rw buffer */
+static size_t tcg_region_idx(const void *p)
 {
-    size_t region_idx;
+    ptrdiff_t offset;
 
+    if (p < region.start_aligned) {
+        return 0;
+    }
+    offset = p - region.start_aligned;
+    if (offset > region.stride * (region.n - 1)) {
+        return region.n - 1;
+    }
+    return offset / region.stride;
+}
+
+static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+{
     /*
      * Like tcg_splitwx_to_rw, with no assert.  The pc may come from
      * a signal handler over which the caller has no control.
@@ -181,19 +200,7 @@ static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
             return NULL;
         }
     }
-
-    if (p < region.start_aligned) {
-        region_idx = 0;
-    } else {
-        ptrdiff_t offset = p - region.start_aligned;
-
-        if (offset > region.stride * (region.n - 1)) {
-            region_idx = region.n - 1;
-        } else {
-            region_idx = offset / region.stride;
-        }
-    }
-    return region_trees + region_idx * tree_size;
+    return region_trees + tcg_region_idx(p) * tree_size;
 }
 
 void tcg_tb_insert(TranslationBlock *tb)
@@ -330,16 +337,36 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
     s->code_gen_buffer = start;
     s->code_gen_ptr = start;
     s->code_gen_buffer_size = end - start;
+#ifdef TCG_TARGET_COLD_CODE
+    /*
+     * Keep the tail of the region for slow paths, so that the fast paths
+     * of neighbouring TBs share i-cache lines and pages.
+     */
+    s->code_gen_cold_highwater = end - TCG_HIGHWATER;
+    end = QEMU_ALIGN_PTR_DOWN(end - (end - start) / TCG_REGION_COLD_FRACTION,
+                              CODE_GEN_ALIGN);
+    s->code_gen_cold_ptr = end;
+#endif
     s->code_gen_highwater = end - TCG_HIGHWATER;
 }
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
-    if (region.current == region.n) {
-        return true;
+    size_t i = region.current;
+
+    if (i < region.n) {
+        region.current++;
+    } else {
+        /* All regions have been handed out; reuse an evicted one. */
+        for (i = 0; i < region.n && region.gen[i]; i++) {
+            continue;
+        }
+        if (i == region.n) {
+            return true;
+        }
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
+    tcg_region_assign(s, i);
+    region.gen[i] = ++region.next_gen;
     return false;
 }
 
@@ -388,6 +415,7 @@ void tcg_region_reset_all(void)
     qemu_mutex_lock(&region.lock);
     region.current = 0;
     region.agg_size_full = 0;
+    memset(region.gen, 0, region.n * sizeof(*region.gen));
 
     for (i = 0; i < n_ctxs; i++) {
         TCGContext *s = qatomic_read(&tcg_ctxs[i]);
@@ -398,6 +426,76 @@ void tcg_region_reset_all(void)
     tcg_region_tree_reset_all();
 }
 
+/*
+ * Return the full region that was allocated the longest time ago,
+ * excluding those that TCG contexts are generating code into,
+ * or region.n if there is none.
+ */
+static size_t tcg_region_oldest__locked(void)
+{
+    unsigned int n_ctxs = qatomic_read(&tcg_cur_ctxs);
+    size_t i, oldest = region.n;
+    unsigned int j;
+
+    for (i = 0; i < region.n; i++) {
+        if (region.gen[i] == 0) {
+            continue;
+        }
+        for (j = 0; j < n_ctxs; j++) {
+            const TCGContext *s = qatomic_read(&tcg_ctxs[j]);
+
+            if (tcg_region_idx(s->code_gen_buffer) == i) {
+                break;
+            }
+        }
+        if (j < n_ctxs) {
+            continue;
+        }
+        if (oldest == region.n || region.gen[i] < region.gen[oldest]) {
+            oldest = i;
+        }
+    }
+    return oldest;
+}
+
+/*
+ * Evict the oldest full region: call @func on each of its TBs, which
+ * must make them unreachable, and then make the region available to
+ * tcg_region_alloc() again.  The TBs of other regions are kept.
+ * Returns false if there was no region to evict, in which case only
+ * a full flush can make room.
+ *
+ * Call from a safe-work context.
+ */
+bool tcg_region_evict(GTraverseFunc func, gpointer user_data)
+{
+    struct tcg_region_tree *rt;
+    void *start, *end;
+    size_t victim;
+
+    qemu_mutex_lock(&region.lock);
+    victim = tcg_region_oldest__locked();
+    qemu_mutex_unlock(&region.lock);
+    if (victim == region.n) {
+        return false;
+    }
+
+    rt = region_trees + victim * tree_size;
+    qemu_mutex_lock(&rt->lock);
+    g_tree_foreach(rt->tree, func, user_data);
+    /* Increment the refcount first so that destroy acts as a reset */
+    g_tree_ref(rt->tree);
+    g_tree_destroy(rt->tree);
+    qemu_mutex_unlock(&rt->lock);
+
+    tcg_region_bounds(victim, &start, &end);
+    qemu_mutex_lock(&region.lock);
+    region.agg_size_full -= end - start - TCG_HIGHWATER;
+    region.gen[victim] = 0;
+    qemu_mutex_unlock(&region.lock);
+    return true;
+}
+
 static size_t tcg_n_regions(size_t tb_size, unsigned max_cpus)
 {
 #ifdef CONFIG_USER_ONLY
@@ -527,12 +625,44 @@ static int alloc_code_gen_buffer(size_t size, int splitwx, Error **errp)
     return PAGE_READ | PAGE_WRITE | PAGE_EXEC;
 }
 #else
+/*
+ * Map the code buffer at a huge page boundary, so that transparent
+ * huge pages can back all of it rather than only its aligned middle.
+ */
+static void *mmap_code_gen_buffer(size_t size, int prot, int flags, int fd)
+{
+#ifdef CONFIG_LINUX
+    size_t align = QEMU_VMALLOC_ALIGN;
+    void *resv, *buf;
+
+    resv = mmap(NULL, size + align, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (resv == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+    buf = QEMU_ALIGN_PTR_UP(resv, align);
+    if (buf != resv) {
+        munmap(resv, buf - resv);
+    }
+    munmap(buf + size, resv + align - buf);
+
+    resv = buf;
+    buf = mmap(buf, size, prot, flags | MAP_FIXED, fd, 0);
+    if (buf == MAP_FAILED) {
+        munmap(resv, size);
+    }
+    return buf;
+#else
+    return mmap(NULL, size, prot, flags, fd, 0);
+#endif
+}
+
 static int alloc_code_gen_buffer_anon(size_t size, int prot,
                                       int flags, Error **errp)
 {
     void *buf;
 
-    buf = mmap(NULL, size, prot, flags, -1, 0);
+    buf = mmap_code_gen_buffer(size, prot, flags, -1);
     if (buf == MAP_FAILED) {
         error_setg_errno(errp, errno,
                          "allocate %zu bytes for jit buffer", size);
@@ -558,7 +688,7 @@ static int alloc_code_gen_buffer_splitwx_memfd(size_t size, Error **errp)
         goto fail;
     }
 
-    buf_rx = mmap(NULL, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    buf_rx = mmap_code_gen_buffer(size, PROT_READ | PROT_EXEC, MAP_SHARED, fd);
     if (buf_rx == MAP_FAILED) {
         goto fail_rx;
     }
@@ -786,6 +916,7 @@ void tcg_region_init(size_t tb_size, int splitwx, unsigned max_cpus)
 
     /* init the region struct */
     qemu_mutex_init(&region.lock);
+    region.gen = g_new0(uint64_t, region.n);
 
     /*
      * Set guard pages in the rw buffer, as that's the one into which
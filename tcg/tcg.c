@@ -4193,7 +4193,7 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 #ifdef CONFIG_PROFILER
     TCGProfile *prof = &s->prof;
 #endif
-    int i, num_insns;
+    int i, num_insns, nb_ops_in;
     TCGOp *op;
 
 #ifdef CONFIG_PROFILER
@@ -4246,6 +4246,8 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
     }
 #endif
 
+    nb_ops_in = s->nb_ops;
+
 #ifdef CONFIG_PROFILER
     qatomic_set(&prof->opt_time, prof->opt_time - profile_getclock());
 #endif
@@ -4260,6 +4262,18 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 #endif
 
     reachable_code_pass(s);
+
+#ifdef USE_TCG_OPTIMIZATIONS
+    /*
+     * Hot TBs can afford a second round: removing the code made
+     * unreachable by the first one exposes more constants and copies.
+     */
+    if (tb->tier == TB_TIER_HOT) {
+        tcg_optimize(s);
+        reachable_code_pass(s);
+    }
+#endif
+
     liveness_pass_1(s);
 
     if (s->nb_indirects > 0) {
@@ -4293,6 +4307,9 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
         if (logfile) {
             fprintf(logfile, "OP after optimization and liveness analysis:\n");
             tcg_dump_ops(s, logfile, true);
+            fprintf(logfile, " -- ops: %d before optimization, %d after "
+                    "(%d removed)\n", nb_ops_in, s->nb_ops,
+                    nb_ops_in - s->nb_ops);
             fprintf(logfile, "\n");
             qemu_log_unlock(logfile);
         }
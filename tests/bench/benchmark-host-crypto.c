@@ -0,0 +1,167 @@
+/*
+ * Host crypto instructions used by the Arm crypto helpers: checks that
+ * they match the helpers' C implementation bit for bit, and measures
+ * both.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-crypto.h"
+#include "qemu/timer.h"
+#include "crypto/arm-crypto.h"
+
+#define EXACT_ROUNDS    100000
+#define SPEED_ROUNDS    (10 * 1000 * 1000)
+
+typedef void HostCryptoFn(uint64_t *d, const uint64_t *n, const uint64_t *m);
+
+typedef struct HostCryptoOp {
+    const char *name;
+    unsigned caps;
+    HostCryptoFn *host;
+    HostCryptoFn *ref;
+} HostCryptoOp;
+
+/*
+ * Both sides of each operation with the same signature: the host
+ * instructions, and the C code that the target/arm helpers run when
+ * the host does not have them.
+ */
+
+#define CRYPTO_OP2(name, ref_body, host_body)                               \
+    static void ref_##name(uint64_t *d, const uint64_t *n,                  \
+                           const uint64_t *m)                               \
+    {                                                                       \
+        ref_body;                                                           \
+    }                                                                       \
+    static void host_##name(uint64_t *d, const uint64_t *n,                 \
+                            const uint64_t *m)                              \
+    {                                                                       \
+        host_body;                                                          \
+    }
+
+CRYPTO_OP2(aese, crypto_aese(d, n, m, false),
+           host_crypto_aese(d, n, m, false))
+CRYPTO_OP2(aesd, crypto_aese(d, n, m, true),
+           host_crypto_aese(d, n, m, true))
+CRYPTO_OP2(aesmc, crypto_aesmc(d, m, false),
+           host_crypto_aesmc(d, m, false))
+CRYPTO_OP2(aesimc, crypto_aesmc(d, m, true),
+           host_crypto_aesmc(d, m, true))
+CRYPTO_OP2(pmull, crypto_pmull_64(d, n[0], m[0]),
+           host_crypto_pmull_64(d, n[0], m[0]))
+CRYPTO_OP2(sha1c, crypto_sha1(d, n, m, HOST_CRYPTO_SHA1C),
+           host_crypto_sha1(d, n, m, HOST_CRYPTO_SHA1C))
+CRYPTO_OP2(sha1p, crypto_sha1(d, n, m, HOST_CRYPTO_SHA1P),
+           host_crypto_sha1(d, n, m, HOST_CRYPTO_SHA1P))
+CRYPTO_OP2(sha1m, crypto_sha1(d, n, m, HOST_CRYPTO_SHA1M),
+           host_crypto_sha1(d, n, m, HOST_CRYPTO_SHA1M))
+CRYPTO_OP2(sha256h, crypto_sha256h(d, n, m, false),
+           host_crypto_sha256h(d, n, m, false))
+CRYPTO_OP2(sha256h2, crypto_sha256h(d, n, m, true),
+           host_crypto_sha256h(d, n, m, true))
+CRYPTO_OP2(sha512su0, crypto_sha512su0(d, n),
+           host_crypto_sha512su0(d, n))
+
+static const HostCryptoOp ops[] = {
+    { "aese", HOST_CRYPTO_AES, host_aese, ref_aese },
+    { "aesd", HOST_CRYPTO_AES, host_aesd, ref_aesd },
+    { "aesmc", HOST_CRYPTO_AES, host_aesmc, ref_aesmc },
+    { "aesimc", HOST_CRYPTO_AES, host_aesimc, ref_aesimc },
+    { "pmull", HOST_CRYPTO_PMULL, host_pmull, ref_pmull },
+    { "sha1c", HOST_CRYPTO_SHA1, host_sha1c, ref_sha1c },
+    { "sha1p", HOST_CRYPTO_SHA1, host_sha1p, ref_sha1p },
+    { "sha1m", HOST_CRYPTO_SHA1, host_sha1m, ref_sha1m },
+    { "sha256h", HOST_CRYPTO_SHA256, host_sha256h, ref_sha256h },
+    { "sha256h2", HOST_CRYPTO_SHA256, host_sha256h2, ref_sha256h2 },
+    { "sha512h", HOST_CRYPTO_SHA512, host_crypto_sha512h, crypto_sha512h },
+    { "sha512h2", HOST_CRYPTO_SHA512, host_crypto_sha512h2,
+      crypto_sha512h2 },
+    { "sha512su0", HOST_CRYPTO_SHA512, host_sha512su0, ref_sha512su0 },
+    { "sha512su1", HOST_CRYPTO_SHA512, host_crypto_sha512su1,
+      crypto_sha512su1 },
+};
+
+static void random_vector(uint64_t *v)
+{
+    v[0] = (uint64_t)g_test_rand_int() << 32 | (uint32_t)g_test_rand_int();
+    v[1] = (uint64_t)g_test_rand_int() << 32 | (uint32_t)g_test_rand_int();
+}
+
+static void test_host_crypto_exact(const void *opaque)
+{
+    const HostCryptoOp *op = opaque;
+    uint64_t d[2], n[2], m[2], expected[2], actual[2];
+    int i;
+
+    if (!host_crypto_has(op->caps)) {
+        g_test_skip("not supported by the host");
+        return;
+    }
+
+    for (i = 0; i < EXACT_ROUNDS; i++) {
+        random_vector(d);
+        random_vector(n);
+        random_vector(m);
+        memcpy(expected, d, sizeof(d));
+        memcpy(actual, d, sizeof(d));
+        op->ref(expected, n, m);
+        op->host(actual, n, m);
+        g_assert_cmphex(actual[0], ==, expected[0]);
+        g_assert_cmphex(actual[1], ==, expected[1]);
+    }
+}
+
+/* Feed the result back in, so that the latency is measured too. */
+static double host_crypto_ops_per_us(HostCryptoFn *fn)
+{
+    uint64_t d[2], n[2], m[2];
+    int64_t start;
+    int i;
+
+    random_vector(d);
+    random_vector(n);
+    random_vector(m);
+    start = get_clock();
+    for (i = 0; i < SPEED_ROUNDS; i++) {
+        fn(d, n, m);
+        n[0] ^= d[0];
+    }
+    return (double)SPEED_ROUNDS * SCALE_US / (get_clock() - start);
+}
+
+static void test_host_crypto_speed(const void *opaque)
+{
+    const HostCryptoOp *op = opaque;
+    double host, ref;
+
+    if (!host_crypto_has(op->caps)) {
+        g_test_skip("not supported by the host");
+        return;
+    }
+
+    host = host_crypto_ops_per_us(op->host);
+    ref = host_crypto_ops_per_us(op->ref);
+    g_test_message("%s: host %.1f Mops/sec, C %.1f Mops/sec (%.1fx)",
+                   op->name, host, ref, host / ref);
+}
+
+int main(int argc, char **argv)
+{
+    char *name;
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(ops); i++) {
+        name = g_strdup_printf("/host-crypto/exact/%s", ops[i].name);
+        g_test_add_data_func(name, &ops[i], test_host_crypto_exact);
+        g_free(name);
+        name = g_strdup_printf("/host-crypto/speed/%s", ops[i].name);
+        g_test_add_data_func(name, &ops[i], test_host_crypto_speed);
+        g_free(name);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,369 @@
+/*
+ * PageDesc lookup: the radix table walk of page_find(), with and
+ * without the per-thread cache of its bottom level arrays.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include "qemu/osdep.h"
+#include "qemu/processor.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
+#include "qemu/rcu.h"
+#include "qemu/memalign.h"
+#include "qemu/host-utils.h"
+
+/*
+ * l1_map, page_find_alloc() and page_leaf_cache are static to
+ * accel/tcg/translate-all.c, which is built per target.  They are
+ * copied here, with the same layout and the same lookup code, and
+ * must be kept in sync.
+ */
+#define V_L2_BITS 10
+#define V_L2_SIZE (1 << V_L2_BITS)
+
+#define V_L1_MIN_BITS 4
+#define V_L1_MAX_BITS (V_L2_BITS + 3)
+#define V_L1_MAX_SIZE (1 << V_L1_MAX_BITS)
+
+#define PAGE_LEAF_CACHE_BITS 3
+#define PAGE_LEAF_CACHE_SIZE (1 << PAGE_LEAF_CACHE_BITS)
+
+/* As in system mode */
+typedef struct PageDesc {
+    uintptr_t first_tb;
+    unsigned long *code_bitmap;
+    unsigned int code_write_count;
+    unsigned int smc_clean_writes;
+    bool self_check;
+    QemuSpin lock;
+} PageDesc;
+
+typedef struct PageLeafCacheEntry {
+    uint64_t key;
+    PageDesc *leaf;
+} PageLeafCacheEntry;
+
+static int v_l1_size;
+static int v_l1_shift;
+static int v_l2_levels;
+
+static void *l1_map[V_L1_MAX_SIZE];
+
+static __thread PageLeafCacheEntry page_leaf_cache[PAGE_LEAF_CACHE_SIZE];
+
+struct thread_info {
+    PageDesc *(*func)(uint64_t index);
+    uint64_t seed;
+    uint64_t base;
+    size_t lookups;
+    size_t misses;
+    uintptr_t sum;
+} QEMU_ALIGNED(64); /* avoid false sharing among threads */
+
+static QemuThread *threads;
+static struct thread_info *info;
+
+static unsigned int duration = 1;
+static unsigned int n_threads = 1;
+static unsigned int addr_bits = 48;
+static unsigned int page_bits = 12;
+static unsigned long n_pages = 64;
+static unsigned long page_stride = 1;
+static size_t n_ready_threads;
+
+static bool test_start;
+static bool test_stop;
+
+static __thread size_t page_leaf_misses;
+
+static const char commands_string[] =
+    " -d = duration, in seconds\n"
+    " -n = number of threads\n"
+    "\n"
+    " -a = bits of the physical address space\n"
+    " -b = bits of the target page size\n"
+    "\n"
+    " -k = pages looked up by each thread (will be rounded up to pow2)\n"
+    " -s = stride between these pages, in pages";
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+    exit(-1);
+}
+
+/* From qht-bench.c */
+static uint64_t xorshift64star(uint64_t x)
+{
+    x ^= x >> 12; /* a */
+    x ^= x << 25; /* b */
+    x ^= x >> 27; /* c */
+    return x * UINT64_C(2685821657736338717);
+}
+
+static void page_table_config_init(void)
+{
+    uint32_t v_l1_bits;
+
+    /* The bits remaining after N lower levels of page tables.  */
+    v_l1_bits = (addr_bits - page_bits) % V_L2_BITS;
+    if (v_l1_bits < V_L1_MIN_BITS) {
+        v_l1_bits += V_L2_BITS;
+    }
+
+    v_l1_size = 1 << v_l1_bits;
+    v_l1_shift = addr_bits - page_bits - v_l1_bits;
+    v_l2_levels = v_l1_shift / V_L2_BITS - 1;
+
+    assert(v_l1_bits <= V_L1_MAX_BITS);
+    assert(v_l1_shift % V_L2_BITS == 0);
+    assert(v_l2_levels >= 0);
+}
+
+/* page_find_alloc() as it was before the leaf cache */
+static PageDesc *page_find_alloc(uint64_t index, int alloc)
+{
+    PageDesc *pd;
+    void **lp;
+    int i;
+
+    /* Level 1.  Always allocated.  */
+    lp = l1_map + ((index >> v_l1_shift) & (v_l1_size - 1));
+
+    /* Level 2..N-1.  */
+    for (i = v_l2_levels; i > 0; i--) {
+        void **p = qatomic_rcu_read(lp);
+
+        if (p == NULL) {
+            void *existing;
+
+            if (!alloc) {
+                return NULL;
+            }
+            p = g_new0(void *, V_L2_SIZE);
+            existing = qatomic_cmpxchg(lp, NULL, p);
+            if (unlikely(existing)) {
+                g_free(p);
+                p = existing;
+            }
+        }
+
+        lp = p + ((index >> (i * V_L2_BITS)) & (V_L2_SIZE - 1));
+    }
+
+    pd = qatomic_rcu_read(lp);
+    if (pd == NULL) {
+        void *existing;
+
+        if (!alloc) {
+            return NULL;
+        }
+        pd = g_new0(PageDesc, V_L2_SIZE);
+        for (i = 0; i < V_L2_SIZE; i++) {
+            qemu_spin_init(&pd[i].lock);
+        }
+        existing = qatomic_cmpxchg(lp, NULL, pd);
+        if (unlikely(existing)) {
+            g_free(pd);
+            pd = existing;
+        }
+    }
+
+    return pd + (index & (V_L2_SIZE - 1));
+}
+
+static PageDesc *page_find_walk(uint64_t index)
+{
+    return page_find_alloc(index, 0);
+}
+
+/* page_find() with the leaf cache in front of the walk */
+static PageDesc *page_find_cached(uint64_t index)
+{
+    uint64_t key = index >> V_L2_BITS;
+    PageLeafCacheEntry *e =
+        &page_leaf_cache[key & (PAGE_LEAF_CACHE_SIZE - 1)];
+    PageDesc *pd;
+
+    if (likely(e->leaf && e->key == key)) {
+        return e->leaf + (index & (V_L2_SIZE - 1));
+    }
+
+    page_leaf_misses++;
+    pd = page_find_alloc(index, 0);
+    if (pd) {
+        e->key = key;
+        e->leaf = pd - (index & (V_L2_SIZE - 1));
+    }
+    return pd;
+}
+
+static uint64_t page_index(struct thread_info *ti, uint64_t r)
+{
+    return ti->base + (r & (n_pages - 1)) * page_stride;
+}
+
+static void *thread_func(void *p)
+{
+    struct thread_info *ti = p;
+
+    rcu_register_thread();
+
+    qatomic_inc(&n_ready_threads);
+    while (!qatomic_read(&test_start)) {
+        cpu_relax();
+    }
+
+    rcu_read_lock();
+    page_leaf_misses = 0;
+    while (!qatomic_read(&test_stop)) {
+        ti->seed = xorshift64star(ti->seed);
+        ti->sum += ti->func(page_index(ti, ti->seed))->first_tb;
+        ti->lookups++;
+    }
+    ti->misses = page_leaf_misses;
+    rcu_read_unlock();
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" duration:          %d s\n", duration);
+    printf(" # of threads:      %u\n", n_threads);
+    printf(" address bits:      %u\n", addr_bits);
+    printf(" page bits:         %u\n", page_bits);
+    printf(" radix levels:      %d\n", v_l2_levels + 2);
+    printf(" pages per thread:  %lu\n", n_pages);
+    printf(" page stride:       %lu\n", page_stride);
+}
+
+/*
+ * Give each thread its own part of the address space, as the vCPUs of
+ * a guest mostly run code from different pages, and allocate the
+ * PageDescs they look up.
+ */
+static void pages_init(void)
+{
+    uint64_t index_mask = MAKE_64BIT_MASK(0, addr_bits - page_bits);
+    unsigned long i;
+    unsigned int j;
+
+    page_table_config_init();
+
+    info = qemu_memalign(64, sizeof(*info) * n_threads);
+    threads = g_new(QemuThread, n_threads);
+    for (j = 0; j < n_threads; j++) {
+        struct thread_info *ti = &info[j];
+
+        memset(ti, 0, sizeof(*ti));
+        ti->base = xorshift64star(j + 1) & index_mask;
+        ti->base &= ~(uint64_t)(V_L2_SIZE - 1);
+        if (ti->base + n_pages * page_stride > index_mask) {
+            ti->base = 0;
+        }
+        for (i = 0; i < n_pages; i++) {
+            page_find_alloc(page_index(ti, i), 1);
+        }
+    }
+}
+
+static double run_test(const char *name, PageDesc *(*func)(uint64_t index))
+{
+    size_t lookups = 0, misses = 0;
+    unsigned int i;
+    double tx;
+
+    qatomic_set(&n_ready_threads, 0);
+    qatomic_set(&test_start, false);
+    qatomic_set(&test_stop, false);
+
+    for (i = 0; i < n_threads; i++) {
+        info[i].func = func;
+        /* seed for the RNG; each thread should have a different one */
+        info[i].seed = (i + 1) ^ time(NULL);
+        info[i].lookups = 0;
+        qemu_thread_create(&threads[i], name, thread_func, &info[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    while (qatomic_read(&n_ready_threads) != n_threads) {
+        cpu_relax();
+    }
+
+    qatomic_set(&test_start, true);
+    g_usleep(duration * G_USEC_PER_SEC);
+    qatomic_set(&test_stop, true);
+
+    for (i = 0; i < n_threads; i++) {
+        qemu_thread_join(&threads[i]);
+        lookups += info[i].lookups;
+        misses += info[i].misses;
+    }
+
+    tx = lookups / 1e6 / duration;
+    printf(" %-7s            %.2f MT/s, %.2f MT/s/thread", name,
+           tx, tx / n_threads);
+    if (func == page_find_cached) {
+        printf(", %.2f%% leaf misses", (double)misses / lookups * 100);
+    }
+    printf("\n");
+    return tx;
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "a:b:d:hk:n:s:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'a':
+            addr_bits = atoi(optarg);
+            break;
+        case 'b':
+            page_bits = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'h':
+            usage_complete(argc, argv);
+            exit(0);
+        case 'k':
+            n_pages = pow2ceil(atol(optarg));
+            break;
+        case 'n':
+            n_threads = atoi(optarg);
+            break;
+        case 's':
+            page_stride = atol(optarg);
+            break;
+        }
+    }
+    if (addr_bits > 64 || page_bits >= addr_bits ||
+        addr_bits - page_bits < V_L2_BITS + V_L1_MIN_BITS ||
+        !n_threads || !n_pages || !page_stride) {
+        usage_complete(argc, argv);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    double walk, cached;
+
+    parse_args(argc, argv);
+    pages_init();
+    pr_params();
+
+    printf("Results:\n");
+    walk = run_test("walk", page_find_walk);
+    cached = run_test("cached", page_find_cached);
+    printf(" Speedup:           %.2fx\n", cached / walk);
+    return 0;
+}
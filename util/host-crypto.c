@@ -0,0 +1,360 @@
+/*
+ * Host instructions for AES, SHA and carry-less multiplication
+ *
+ * The Arm crypto extension instructions are emulated in C with table
+ * lookups and 32-bit rotates, a few dozen host instructions for every
+ * round of the guest.  Hosts that implement the same algorithms in
+ * hardware can do each of them in one or two instructions: AES-NI,
+ * PCLMULQDQ and the SHA extensions on x86, and of course the crypto
+ * extensions on Arm.  x86 has no SHA-512 instructions.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-crypto.h"
+
+unsigned host_crypto_caps;
+
+#if defined(CONFIG_HOST_CRYPTO_OPT) && \
+    (defined(__x86_64__) || defined(__i386__))
+
+#include "qemu/cpuid.h"
+
+#pragma GCC push_options
+#pragma GCC target("aes,pclmul,sha")
+#include <immintrin.h>
+
+/* Word order of the SHA state in the x86 instructions */
+#define SHA_REVERSE     0x1b
+#define SHA_SWAP_PAIRS  0xb1
+
+static const uint32_t sha1_k[] = {
+    [HOST_CRYPTO_SHA1C] = 0x5a827999,
+    [HOST_CRYPTO_SHA1P] = 0x6ed9eba1,
+    [HOST_CRYPTO_SHA1M] = 0x8f1bbcdc,
+};
+
+void host_crypto_aese(uint64_t *rd, const uint64_t *rn,
+                      const uint64_t *rm, bool decrypt)
+{
+    __m128i st = _mm_xor_si128(_mm_loadu_si128((const __m128i *)rn),
+                               _mm_loadu_si128((const __m128i *)rm));
+    __m128i zero = _mm_setzero_si128();
+
+    /* The last round has no MixColumns, and the round key is zero. */
+    if (decrypt) {
+        st = _mm_aesdeclast_si128(st, zero);
+    } else {
+        st = _mm_aesenclast_si128(st, zero);
+    }
+    _mm_storeu_si128((__m128i *)rd, st);
+}
+
+void host_crypto_aesmc(uint64_t *rd, const uint64_t *rm, bool decrypt)
+{
+    __m128i st = _mm_loadu_si128((const __m128i *)rm);
+    __m128i zero = _mm_setzero_si128();
+
+    if (decrypt) {
+        st = _mm_aesimc_si128(st);
+    } else {
+        /*
+         * A full encryption round does ShiftRows, SubBytes and then
+         * MixColumns; undo the first two with a last decryption round.
+         */
+        st = _mm_aesenc_si128(_mm_aesdeclast_si128(st, zero), zero);
+    }
+    _mm_storeu_si128((__m128i *)rd, st);
+}
+
+void host_crypto_pmull_64(uint64_t *rd, uint64_t n, uint64_t m)
+{
+    __m128i r = _mm_clmulepi64_si128(_mm_set_epi64x(0, n),
+                                     _mm_set_epi64x(0, m), 0);
+
+    _mm_storeu_si128((__m128i *)rd, r);
+}
+
+/*
+ * SHA1RNDS4 does four rounds with the same constant, which it adds
+ * itself, and takes E from the first word of the message schedule.
+ */
+void host_crypto_sha1(uint64_t *rd, const uint64_t *rn,
+                      const uint64_t *rm, HostCryptoSHA1Op op)
+{
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)rd),
+                                     SHA_REVERSE);
+    __m128i w = _mm_loadu_si128((const __m128i *)rm);
+
+    w = _mm_sub_epi32(w, _mm_set1_epi32(sha1_k[op]));
+    w = _mm_add_epi32(w, _mm_cvtsi32_si128((uint32_t)rn[0]));
+    w = _mm_shuffle_epi32(w, SHA_REVERSE);
+
+    switch (op) {
+    case HOST_CRYPTO_SHA1C:
+        abcd = _mm_sha1rnds4_epu32(abcd, w, 0);
+        break;
+    case HOST_CRYPTO_SHA1P:
+        abcd = _mm_sha1rnds4_epu32(abcd, w, 1);
+        break;
+    case HOST_CRYPTO_SHA1M:
+        abcd = _mm_sha1rnds4_epu32(abcd, w, 2);
+        break;
+    }
+    _mm_storeu_si128((__m128i *)rd, _mm_shuffle_epi32(abcd, SHA_REVERSE));
+}
+
+/*
+ * SHA256RNDS2 does two rounds on the state split into ABEF and CDGH.
+ * Four rounds leave A..D of the result in the two ABEF values, and
+ * E..H in the other halves of them; SHA256H returns the former and
+ * SHA256H2 the latter.
+ */
+void host_crypto_sha256h(uint64_t *rd, const uint64_t *rn,
+                         const uint64_t *rm, bool h2)
+{
+    __m128i abcd = _mm_loadu_si128((const __m128i *)(h2 ? rn : rd));
+    __m128i efgh = _mm_loadu_si128((const __m128i *)(h2 ? rd : rn));
+    __m128i wk = _mm_loadu_si128((const __m128i *)rm);
+    __m128i abef, cdgh, abef1, abef2, r;
+
+    abef = _mm_shuffle_epi32(_mm_unpacklo_epi64(efgh, abcd), SHA_SWAP_PAIRS);
+    cdgh = _mm_shuffle_epi32(_mm_unpackhi_epi64(efgh, abcd), SHA_SWAP_PAIRS);
+
+    abef1 = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+    abef2 = _mm_sha256rnds2_epu32(abef, abef1, _mm_shuffle_epi32(wk, 0x0e));
+
+    if (h2) {
+        r = _mm_unpacklo_epi64(abef2, abef1);
+    } else {
+        r = _mm_unpackhi_epi64(abef2, abef1);
+    }
+    _mm_storeu_si128((__m128i *)rd, _mm_shuffle_epi32(r, SHA_SWAP_PAIRS));
+}
+
+#pragma GCC pop_options
+
+static void __attribute__((constructor)) host_crypto_init(void)
+{
+    unsigned max = __get_cpuid_max(0, NULL);
+    unsigned caps = 0;
+    int a, b, c, d;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (c & bit_AES) {
+            caps |= HOST_CRYPTO_AES;
+        }
+        if (c & bit_PCLMUL) {
+            caps |= HOST_CRYPTO_PMULL;
+        }
+    }
+    if (max >= 7) {
+        __cpuid_count(7, 0, a, b, c, d);
+        if (b & bit_SHA) {
+            caps |= HOST_CRYPTO_SHA1 | HOST_CRYPTO_SHA256;
+        }
+    }
+    host_crypto_caps = caps;
+}
+
+#elif defined(CONFIG_HOST_CRYPTO_OPT) && defined(__aarch64__)
+
+#include "elf.h"
+
+#ifndef HWCAP_AES
+#define HWCAP_AES       (1 << 3)
+#define HWCAP_PMULL     (1 << 4)
+#define HWCAP_SHA1      (1 << 5)
+#define HWCAP_SHA2      (1 << 6)
+#define HWCAP_SHA512    (1 << 21)
+#endif
+
+#pragma GCC push_options
+#pragma GCC target("+crypto")
+#include <arm_neon.h>
+
+void host_crypto_aese(uint64_t *rd, const uint64_t *rn,
+                      const uint64_t *rm, bool decrypt)
+{
+    uint8x16_t st = vld1q_u8((const uint8_t *)rn);
+    uint8x16_t rk = vld1q_u8((const uint8_t *)rm);
+
+    st = decrypt ? vaesdq_u8(st, rk) : vaeseq_u8(st, rk);
+    vst1q_u8((uint8_t *)rd, st);
+}
+
+void host_crypto_aesmc(uint64_t *rd, const uint64_t *rm, bool decrypt)
+{
+    uint8x16_t st = vld1q_u8((const uint8_t *)rm);
+
+    st = decrypt ? vaesimcq_u8(st) : vaesmcq_u8(st);
+    vst1q_u8((uint8_t *)rd, st);
+}
+
+void host_crypto_pmull_64(uint64_t *rd, uint64_t n, uint64_t m)
+{
+    poly128_t r = vmull_p64(n, m);
+
+    vst1q_u8((uint8_t *)rd, vreinterpretq_u8_p128(r));
+}
+
+void host_crypto_sha1(uint64_t *rd, const uint64_t *rn,
+                      const uint64_t *rm, HostCryptoSHA1Op op)
+{
+    uint32x4_t abcd = vld1q_u32((const uint32_t *)rd);
+    uint32x4_t wk = vld1q_u32((const uint32_t *)rm);
+    uint32_t e = rn[0];
+
+    switch (op) {
+    case HOST_CRYPTO_SHA1C:
+        abcd = vsha1cq_u32(abcd, e, wk);
+        break;
+    case HOST_CRYPTO_SHA1P:
+        abcd = vsha1pq_u32(abcd, e, wk);
+        break;
+    case HOST_CRYPTO_SHA1M:
+        abcd = vsha1mq_u32(abcd, e, wk);
+        break;
+    }
+    vst1q_u32((uint32_t *)rd, abcd);
+}
+
+void host_crypto_sha256h(uint64_t *rd, const uint64_t *rn,
+                         const uint64_t *rm, bool h2)
+{
+    uint32x4_t d = vld1q_u32((const uint32_t *)rd);
+    uint32x4_t n = vld1q_u32((const uint32_t *)rn);
+    uint32x4_t wk = vld1q_u32((const uint32_t *)rm);
+
+    d = h2 ? vsha256h2q_u32(d, n, wk) : vsha256hq_u32(d, n, wk);
+    vst1q_u32((uint32_t *)rd, d);
+}
+
+#pragma GCC pop_options
+
+#ifdef CONFIG_HOST_SHA512_OPT
+#define HOST_CRYPTO_HAVE_SHA512
+
+#pragma GCC push_options
+#pragma GCC target("+sha3")
+
+void host_crypto_sha512h(uint64_t *rd, const uint64_t *rn,
+                         const uint64_t *rm)
+{
+    vst1q_u64(rd, vsha512hq_u64(vld1q_u64(rd), vld1q_u64(rn),
+                                vld1q_u64(rm)));
+}
+
+void host_crypto_sha512h2(uint64_t *rd, const uint64_t *rn,
+                          const uint64_t *rm)
+{
+    vst1q_u64(rd, vsha512h2q_u64(vld1q_u64(rd), vld1q_u64(rn),
+                                 vld1q_u64(rm)));
+}
+
+void host_crypto_sha512su0(uint64_t *rd, const uint64_t *rn)
+{
+    vst1q_u64(rd, vsha512su0q_u64(vld1q_u64(rd), vld1q_u64(rn)));
+}
+
+void host_crypto_sha512su1(uint64_t *rd, const uint64_t *rn,
+                           const uint64_t *rm)
+{
+    vst1q_u64(rd, vsha512su1q_u64(vld1q_u64(rd), vld1q_u64(rn),
+                                  vld1q_u64(rm)));
+}
+
+#pragma GCC pop_options
+#endif /* CONFIG_HOST_SHA512_OPT */
+
+static void __attribute__((constructor)) host_crypto_init(void)
+{
+    unsigned long hwcap = qemu_getauxval(AT_HWCAP);
+    unsigned caps = 0;
+
+    if (HOST_BIG_ENDIAN) {
+        /* The vector registers of the cpu state are not in lane order. */
+        return;
+    }
+    if (hwcap & HWCAP_AES) {
+        caps |= HOST_CRYPTO_AES;
+    }
+    if (hwcap & HWCAP_PMULL) {
+        caps |= HOST_CRYPTO_PMULL;
+    }
+    if (hwcap & HWCAP_SHA1) {
+        caps |= HOST_CRYPTO_SHA1;
+    }
+    if (hwcap & HWCAP_SHA2) {
+        caps |= HOST_CRYPTO_SHA256;
+    }
+#ifdef HOST_CRYPTO_HAVE_SHA512
+    if (hwcap & HWCAP_SHA512) {
+        caps |= HOST_CRYPTO_SHA512;
+    }
+#endif
+    host_crypto_caps = caps;
+}
+
+#else
+
+/* host_crypto_has() is always false, so these are never called. */
+
+void host_crypto_aese(uint64_t *rd, const uint64_t *rn,
+                      const uint64_t *rm, bool decrypt)
+{
+    g_assert_not_reached();
+}
+
+void host_crypto_aesmc(uint64_t *rd, const uint64_t *rm, bool decrypt)
+{
+    g_assert_not_reached();
+}
+
+void host_crypto_pmull_64(uint64_t *rd, uint64_t n, uint64_t m)
+{
+    g_assert_not_reached();
+}
+
+void host_crypto_sha1(uint64_t *rd, const uint64_t *rn,
+                      const uint64_t *rm, HostCryptoSHA1Op op)
+{
+    g_assert_not_reached();
+}
+
+void host_crypto_sha256h(uint64_t *rd, const uint64_t *rn,
+                         const uint64_t *rm, bool h2)
+{
+    g_assert_not_reached();
+}
+
+#endif
+
+#ifndef HOST_CRYPTO_HAVE_SHA512
+
+void host_crypto_sha512h(uint64_t *rd, const uint64_t *rn,
+                         const uint64_t *rm)
+{
+    g_assert_not_reached();
+}
+
+void host_crypto_sha512h2(uint64_t *rd, const uint64_t *rn,
+                          const uint64_t *rm)
+{
+    g_assert_not_reached();
+}
+
+void host_crypto_sha512su0(uint64_t *rd, const uint64_t *rn)
+{
+    g_assert_not_reached();
+}
+
+void host_crypto_sha512su1(uint64_t *rd, const uint64_t *rn,
+                           const uint64_t *rm)
+{
+    g_assert_not_reached();
+}
+
+#endif /* HOST_CRYPTO_HAVE_SHA512 */